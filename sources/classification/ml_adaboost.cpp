@@ -59,6 +59,8 @@ namespace ml
         // Pure virtual method implementations
         GRT::Classifier &get_Classifier_instance();
         const GRT::Classifier &get_Classifier_instance() const;
+        
+        bool changes_prediction(const t_symbol *s) const;
            
     private:
         // Flext Flext attribute wrappers
@@ -148,6 +150,14 @@ namespace ml
     }
 
     
+    // Training settings, these take effect at the next 'train'
+    bool adaboost::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const training_settings[] = {"num_boosting_iterations", "set_weak_classifier", "add_weak_classifier", NULL};
+        
+        return !is_symbol_in(s, training_settings) && classification::changes_prediction(s);
+    }
+    
     typedef class adaboost ml0x2eadaboost;
     
 #ifdef BUILD_AS_LIBRARY
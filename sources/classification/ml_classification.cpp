@@ -17,11 +17,30 @@
  */
 
 #include "ml_classification.h"
+#include "ml_thread_pool.h"
 
 #include <sstream>
+#include <algorithm>
+#include <cmath>
 
 namespace ml
 {
+    static const t_symbol *get_s_cross_validate()
+    {
+        static const t_symbol *s_cross_validate = flext::MakeSymbol("cross_validate");
+        return s_cross_validate;
+    }
+    
+    static const GRT::VectorDouble &get_sample_data(const GRT::ClassificationSample &sample)
+    {
+        return sample.getSample();
+    }
+    
+    static const GRT::MatrixDouble &get_sample_data(const GRT::TimeSeriesClassificationSample &sample)
+    {
+        return sample.getData();
+    }
+    
     classification::classification()
     {
         set_data_type(LABELLED_CLASSIFICATION);
@@ -50,6 +69,17 @@ namespace ml
         }
     }
     
+    void classification::set_window_size(int window_size)
+    {
+        if (window_size < 0)
+        {
+            error("window size must be 0 or greater");
+            return;
+        }
+        
+        recording_window.set_capacity(window_size);
+    }
+    
     // Flext attribute getters
     void classification::get_null_rejection(bool &null_rejection) const
     {
@@ -62,80 +92,67 @@ namespace ml
         null_rejection_coeff = classifier.getNullRejectionCoeff();
     }
     
-    bool classification::get_num_samples() const
+    // GRT only returns the likelihoods by value, this reads them in place so that 'map' doesn't allocate
+    struct classifier_access : GRT::Classifier
     {
-        GRT::UINT numSamples = 0;
-        const data_type data_type = get_data_type();
-        
-        if (data_type == LABELLED_REGRESSION)
-        {
-            regression_data.getNumSamples();
-        }
-        else if (data_type == LABELLED_CLASSIFICATION)
-        {
-            numSamples = classification_data.getNumSamples();
-        }
-        else if (data_type == LABELLED_TIME_SERIES_CLASSIFICATION)
-        {
-            numSamples = time_series_classification_data.getNumSamples();
-        }
-        else if (data_type == UNLABELLED_CLASSIFICATION)
+        static const GRT::VectorDouble &get_class_likelihoods(const GRT::Classifier &classifier)
         {
-            numSamples = unlabelled_data.getNumSamples();
+            return classifier.*(&classifier_access::classLikelihoods);
         }
-        
-        return numSamples;
-    }
+    };
     
-    void classification::train()
+    void classification::prepare_inference_context(const GRT::Classifier &classifier, uint32_t generation)
     {
-        GRT::UINT numSamples = get_num_samples();
-        const enum data_type data_type = get_data_type();
-        GRT::Classifier &classifier = get_Classifier_instance();
-        
-        if (numSamples == 0)
-        {
-            error("no observations added, use 'add' to add training data");
-            return;
-        }
+        const data_type data_type = get_data_type();
+        GRT::Vector<GRT::UINT> &labels = context.labels;
+        std::vector<t_atom> &probs_l = context.output;
         
-        bool success = false;
+        context.query.resize(classifier.getNumInputFeatures());
+        labels.clear();
         
-        if (data_type == LABELLED_CLASSIFICATION)
+        // Labels come from the model rather than the dataset so they line up with the likelihoods, also after reading a '.model' on its own
+        if (data_type == LABELLED_CLASSIFICATION || data_type == LABELLED_TIME_SERIES_CLASSIFICATION)
         {
-            success = classifier.train(classification_data);
+            labels = classifier.getClassLabels();
         }
-        else if (data_type == LABELLED_TIME_SERIES_CLASSIFICATION)
-        {
-            success = classifier.train(time_series_classification_data);
-        }
-        else if (data_type == UNLABELLED_CLASSIFICATION)
+        
+        // label / likelihood pairs for labelled data, likelihoods only otherwise, the labels are laid out once here so that 'map' only writes the likelihoods
+        if (labels.empty())
         {
-            success = classifier.train(unlabelled_data);
+            probs_l.resize(classifier.getNumClasses());
         }
-        
-        if (!success)
+        else
         {
-            error("training failed");
+            probs_l.resize(labels.size() * 2);
+            
+            for (uint16_t count = 0; count < labels.size(); ++count)
+            {
+                SetInt(probs_l[count * 2], labels[count]);
+            }
         }
         
-        t_atom a_success;
-        
-        SetInt(a_success, success);
-        ToOutAnything(1, get_s_train(), 1, &a_success);
+        context.generation = generation;
+    }
+    
+    void classification::get_window_size(int &window_size) const
+    {
+        window_size = recording_window.get_capacity();
     }
     
     void classification::map(int argc, const t_atom *argv)
     {
-        GRT::Classifier &classifier = get_Classifier_instance();
+        const uint32_t generation = get_active_generation();
+        GRT::Classifier *active_classifier = static_cast<GRT::Classifier *>(get_active_MLBase_instance());
         const data_type data_type = get_data_type();
         
-        if (classifier.getTrained() == false)
+        if (active_classifier == NULL || active_classifier->getTrained() == false)
         {
             error("model has not been trained, use 'train' to train the model");
             return;
         }
         
+        GRT::Classifier &classifier = *active_classifier;
+        
         if (classifier.getNumClasses() == 0)
         {
             error("no classes in the trained model, use 'add' to add more training data");
@@ -148,14 +165,20 @@ namespace ml
             return;
         }
         
-        GRT::UINT numInputFeatures = classifier.getNumInputFeatures();
-        GRT::VectorDouble query(numInputFeatures);
+        if (context.generation != generation)
+        {
+            prepare_inference_context(classifier, generation);
+        }
+        
+        GRT::VectorDouble &query = context.query;
+        GRT::UINT numInputFeatures = query.size();
         
         if (argc < 0 || (unsigned)argc != numInputFeatures)
         {
             std::stringstream ss;
             ss << "invalid input length, expected " << numInputFeatures << ", got " << argc;
             error(ss.str());
+            return;
         }
         
         for (uint32_t index = 0; index < (uint32_t)argc; ++index)
@@ -165,15 +188,44 @@ namespace ml
         }
         
         bool success = false;
+        GRT::UINT classification = 0;
         
-        if (recording)
+        if (recording && recording_window.get_capacity() > 0)
+        {
+            // Sliding window, constant cost per frame however long we record for
+            recording_window.push_back(query);
+            success = predict_time_series(classifier, recording_window.get_ordered_frames(), classification);
+        }
+        else if (recording)
         {
             time_series_data.push_back(query);
-            success = classifier.predict(time_series_data);
+            
+            // Prediction may scale its input in place, so it gets a buffer that grows with the recording a frame at a time and is
+            // overwritten from it, rather than a new copy of the whole recording every frame
+            GRT::MatrixDouble &time_series = context.time_series;
+            const GRT::UINT numFrames = time_series_data.getNumRows();
+            const GRT::UINT numColumns = time_series_data.getNumCols();
+            
+            if (time_series.getNumRows() + 1 != numFrames || time_series.getNumCols() != numColumns)
+            {
+                time_series = time_series_data;
+            }
+            else
+            {
+                time_series.push_back(query);
+                
+                for (GRT::UINT frame = 0; frame + 1 < numFrames; ++frame)
+                {
+                    std::copy(time_series_data[frame], time_series_data[frame] + numColumns, time_series[frame]);
+                }
+            }
+            
+            success = predict_time_series(classifier, time_series, classification);
         }
         else
         {
-            success = classifier.predict(query);
+            success = classifier.predict_(query);
+            classification = classifier.getPredictedClassLabel();
         }
         
         if (success == false)
@@ -184,85 +236,378 @@ namespace ml
         
         if (probs)
         {
-            GRT::VectorDouble likelihoods = classifier.getClassLikelihoods();
-            AtomList probs_l;
+            const GRT::VectorDouble &likelihoods = classifier_access::get_class_likelihoods(classifier);
+            std::vector<t_atom> &probs_l = context.output;
+            const size_t stride = context.labels.empty() ? 1 : 2;
+            
+            if (likelihoods.size() * stride != probs_l.size())
+            {
+                error("labels / likelihoods size mismatch");
+            }
+            else
+            {
+                for (uint16_t count = 0; count < likelihoods.size(); ++count)
+                {
+                    SetFloat(probs_l[count * stride + stride - 1], static_cast<float>(likelihoods[count]));
+                }
+                ToOutAnything(1, get_s_probs(), (int)probs_l.size(), probs_l.data());
+            }
+        }
+        
+        ToOutInt(0, classification);
+    }
+    
+    void classification::map_batch(int argc, const t_atom *argv)
+    {
+        const uint32_t generation = get_active_generation();
+        GRT::Classifier *active_classifier = static_cast<GRT::Classifier *>(get_active_MLBase_instance());
+        
+        if (active_classifier == NULL || active_classifier->getTrained() == false)
+        {
+            error("model has not been trained, use 'train' to train the model");
+            return;
+        }
+        
+        GRT::Classifier &classifier = *active_classifier;
+        
+        if (classifier.getNumClasses() == 0)
+        {
+            error("no classes in the trained model, use 'add' to add more training data");
+            return;
+        }
+        
+        if (recording)
+        {
+            error("batch classification not available while recording, send 'record 0' to stop recording");
+            return;
+        }
+        
+        if (context.generation != generation)
+        {
+            prepare_inference_context(classifier, generation);
+        }
+        
+        GRT::VectorDouble &query = context.query;
+        GRT::UINT numInputFeatures = query.size();
+        GRT::UINT numRows = 0;
+        
+        if (!get_batch_num_rows(argc, argv, numInputFeatures, numRows))
+        {
+            return;
+        }
+        
+        // Only grows, so repeated batches of the same size don't allocate
+        std::vector<t_atom> &labels = context.batch_output;
+        labels.resize(numRows);
+        
+        const t_atom *row = argv + 1;
+        
+        for (GRT::UINT rowIndex = 0; rowIndex < numRows; ++rowIndex, row += numInputFeatures)
+        {
+            for (GRT::UINT index = 0; index < numInputFeatures; ++index)
+            {
+                query[index] = GetAFloat(row[index]);
+            }
             
-            if (data_type == LABELLED_CLASSIFICATION || data_type == LABELLED_TIME_SERIES_CLASSIFICATION)
+            if (!classifier.predict_(query))
             {
-                GRT::Vector<GRT::UINT> labels;
+                error("unable to map input " + std::to_string(rowIndex));
+                return;
+            }
+            
+            SetInt(labels[rowIndex], classifier.getPredictedClassLabel());
+        }
+        
+        ToOutList(0, (int)numRows, labels.data());
+    }
+    
+    bool classification::predict_time_series(GRT::Classifier &classifier, GRT::MatrixDouble &time_series, GRT::UINT &label)
+    {
+        if (!classifier.predict_(time_series))
+        {
+            return false;
+        }
+        
+        label = classifier.getPredictedClassLabel();
+        
+        return true;
+    }
+    
+    // pure virtual method implementation
+    GRT::MLBase &classification::get_MLBase_instance()
+    {
+        return get_Classifier_instance();
+    }
+    
+    const GRT::MLBase &classification::get_MLBase_instance() const
+    {
+        return get_Classifier_instance();
+    }
+    
+    GRT::MLBase *classification::copy_MLBase_instance(const GRT::MLBase &instance) const
+    {
+        return static_cast<const GRT::Classifier &>(instance).deepCopyClassifier();
+    }
+    
+    bool classification::set_MLBase_instance(const GRT::MLBase &instance)
+    {
+        return get_Classifier_instance().deepCopyFrom(static_cast<const GRT::Classifier *>(&instance));
+    }
+    
+    void classification::cross_validate(int num_folds)
+    {
+        if (check_busy_with_error())
+        {
+            return;
+        }
+        
+        const data_type data_type = get_data_type();
+        
+        if (data_type != LABELLED_CLASSIFICATION && data_type != LABELLED_TIME_SERIES_CLASSIFICATION)
+        {
+            error("cross validation is only available for labelled classification and time series data");
+            return;
+        }
+        
+        if (num_folds < 2)
+        {
+            error("number of folds must be 2 or greater");
+            return;
+        }
+        
+        if (get_num_samples() == 0)
+        {
+            error("no observations added, use 'add' to add training data");
+            return;
+        }
+        
+        // The folds train copies of the staging model, so its attributes are used and the active model keeps answering 'map'
+        std::shared_ptr<cross_validation_job> job = std::make_shared<cross_validation_job>(get_s_cross_validate(), data_type, num_folds);
+        
+        job->uses_staging = false;
+        job->model.reset(copy_MLBase_instance(get_MLBase_instance()));
+        
+        if (!job->model)
+        {
+            error("unable to copy model for cross validation");
+            return;
+        }
+        
+        if (data_type == LABELLED_CLASSIFICATION)
+        {
+            job->classification_data = classification_data;
+        }
+        else
+        {
+            job->time_series_classification_data = time_series_classification_data;
+        }
+        
+        start_job(job);
+    }
+    
+    template <class T>
+    void classification::cross_validate_dataset(const T &dataset, cross_validation_job &job) const
+    {
+        const GRT::Classifier &prototype = static_cast<const GRT::Classifier &>(*job.model);
+        const GRT::Vector<GRT::ClassTracker> class_tracker = dataset.getClassTracker();
+        const GRT::UINT num_folds = job.num_folds;
+        std::map<GRT::UINT, GRT::UINT> label_indices;
+        
+        for (GRT::UINT index = 0; index < class_tracker.size(); ++index)
+        {
+            job.labels.push_back(class_tracker[index].classLabel);
+            label_indices[class_tracker[index].classLabel] = index;
+        }
+        
+        job.null_column = prototype.getNullRejectionEnabled();
+        
+        const GRT::UINT num_columns = job.labels.size() + (job.null_column ? 1 : 0);
+        std::vector<std::vector<GRT::UINT> > confusions(num_folds, std::vector<GRT::UINT>(job.labels.size() * num_columns, 0));
+        std::vector<double> accuracies(num_folds, 0);
+        std::vector<char> successes(num_folds, false);
+        thread_pool pool;
+        
+        // Every fold has its own training set and model, so they train concurrently, one per core
+        pool.set_num_threads(std::max(1U, std::min<unsigned>(num_folds, std::thread::hardware_concurrency())));
+        
+        pool.parallel_for(num_folds, [&](size_t fold, unsigned thread)
+        {
+            const T training_data = dataset.getTrainingFoldData(fold);
+            const T test_data = dataset.getTestFoldData(fold);
+            std::unique_ptr<GRT::MLBase> model(copy_MLBase_instance(prototype));
+            
+            if (!model || !model->train(training_data) || test_data.getNumSamples() == 0)
+            {
+                return;
+            }
+            
+            GRT::Classifier &classifier = static_cast<GRT::Classifier &>(*model);
+            std::vector<GRT::UINT> &confusion = confusions[fold];
+            GRT::UINT num_correct = 0;
+            
+            for (GRT::UINT sample = 0; sample < test_data.getNumSamples(); ++sample)
+            {
+                const GRT::UINT label = test_data[sample].getClassLabel();
                 
-                if (data_type == LABELLED_CLASSIFICATION)
+                if (!classifier.predict(get_sample_data(test_data[sample])))
                 {
-                    labels = classification_data.getClassLabels();
+                    return;
                 }
-                else if (data_type == LABELLED_TIME_SERIES_CLASSIFICATION)
+                
+                const GRT::UINT predicted_label = classifier.getPredictedClassLabel();
+                const GRT::UINT row = label_indices.find(label)->second * num_columns;
+                std::map<GRT::UINT, GRT::UINT>::const_iterator column = label_indices.find(predicted_label);
+                
+                if (predicted_label == label)
                 {
-                    // For some reason getClassLabels() isn't implemented for TimeSeriesClassificationData so we do this manually
-                    std::vector<GRT::ClassTracker> classTracker = time_series_classification_data.getClassTracker();
-                    for (uint16_t index = 0; index < classTracker.size(); ++index)
-                    {
-                        labels.push_back(classTracker[index].classLabel);
-                    }
+                    ++num_correct;
                 }
                 
-                if (likelihoods.size() != labels.size())
+                if (column != label_indices.end())
                 {
-                    error("labels / likelihoods size mismatch");
+                    ++confusion[row + column->second];
                 }
-                else
+                else if (job.null_column)
                 {
-                    for (uint16_t count = 0; count < labels.size(); ++count)
-                    {
-                        t_atom label_a;
-                        t_atom likelihood_a;
-                        
-                        SetFloat(likelihood_a, static_cast<float>(likelihoods[count]));
-                        SetInt(label_a, labels[count]);
-                        
-                        probs_l.Append(label_a);
-                        probs_l.Append(likelihood_a);
-                    }
+                    ++confusion[row + num_columns - 1];
                 }
-                
-                
             }
-            else if (data_type == UNLABELLED_CLASSIFICATION)
+            
+            accuracies[fold] = static_cast<double>(num_correct) / test_data.getNumSamples();
+            successes[fold] = true;
+        });
+        
+        if (std::find(successes.begin(), successes.end(), false) != successes.end())
+        {
+            return;
+        }
+        
+        job.accuracies = accuracies;
+        job.confusion.assign(job.labels.size() * num_columns, 0);
+        
+        for (GRT::UINT fold = 0; fold < num_folds; ++fold)
+        {
+            for (GRT::UINT cell = 0; cell < job.confusion.size(); ++cell)
             {
-                for (uint16_t count = 0; count < likelihoods.size(); ++count)
-                {
-                    t_atom likelihood_a;
-                    
-                    SetFloat(likelihood_a, static_cast<float>(likelihoods[count]));
-                    probs_l.Append(likelihood_a);
-                }
+                job.confusion[cell] += confusions[fold][cell];
             }
+        }
+        
+        job.model_success = true;
+    }
+    
+    void classification::run_job(background_job &job)
+    {
+        if (job.selector != get_s_cross_validate())
+        {
+            return;
+        }
+        
+        cross_validation_job &cross_validation = static_cast<cross_validation_job &>(job);
+        
+        // Stratified, so that every fold holds roughly the same proportion of each class
+        if (job.data_type_ == LABELLED_CLASSIFICATION)
+        {
+            job.dataset_success = job.classification_data.spiltDataIntoKFolds(cross_validation.num_folds, true);
+            
+            if (job.dataset_success)
+            {
+                cross_validate_dataset(job.classification_data, cross_validation);
+            }
+        }
+        else
+        {
+            job.dataset_success = job.time_series_classification_data.spiltDataIntoKFolds(cross_validation.num_folds, true);
             
-            ToOutAnything(1, get_s_probs(), probs_l);
+            if (job.dataset_success)
+            {
+                cross_validate_dataset(job.time_series_classification_data, cross_validation);
+            }
+        }
+    }
+    
+    // Outputs 'confusion <label> <count>...' per class, columns in the same label order with a last column for rejected samples when NULL rejection is on,
+    // followed by 'cross_validate <mean accuracy> <accuracy standard deviation>'
+    void classification::complete_job(background_job &job)
+    {
+        if (job.selector != get_s_cross_validate())
+        {
+            return;
         }
         
-        GRT::UINT classification = classifier.getPredictedClassLabel();
-        ToOutInt(0, classification);
+        const cross_validation_job &cross_validation = static_cast<const cross_validation_job &>(job);
+        
+        if (!job.dataset_success)
+        {
+            error("unable to split data into " + std::to_string(cross_validation.num_folds) + " folds, each class needs at least that many samples");
+            return;
+        }
+        
+        if (!job.model_success)
+        {
+            error("cross validation failed, unable to train or test a fold");
+            return;
+        }
+        
+        static const t_symbol *s_confusion = flext::MakeSymbol("confusion");
+        const std::vector<double> &accuracies = cross_validation.accuracies;
+        const size_t num_columns = cross_validation.confusion.size() / cross_validation.labels.size();
+        std::vector<t_atom> row(num_columns + 1);
+        
+        for (size_t label = 0; label < cross_validation.labels.size(); ++label)
+        {
+            SetInt(row[0], cross_validation.labels[label]);
+            
+            for (size_t column = 0; column < num_columns; ++column)
+            {
+                SetInt(row[column + 1], cross_validation.confusion[label * num_columns + column]);
+            }
+            ToOutAnything(1, s_confusion, (int)row.size(), row.data());
+        }
+        
+        double mean = 0;
+        double variance = 0;
+        
+        for (size_t fold = 0; fold < accuracies.size(); ++fold)
+        {
+            mean += accuracies[fold];
+        }
+        mean /= accuracies.size();
+        
+        for (size_t fold = 0; fold < accuracies.size(); ++fold)
+        {
+            variance += (accuracies[fold] - mean) * (accuracies[fold] - mean);
+        }
+        variance /= accuracies.size() - 1;
+        
+        t_atom result[2];
+        
+        SetFloat(result[0], static_cast<float>(mean));
+        SetFloat(result[1], static_cast<float>(std::sqrt(variance)));
+        ToOutAnything(1, get_s_cross_validate(), 2, result);
     }
     
-    // pure virtual method implementation
-    GRT::MLBase &classification::get_MLBase_instance()
+    bool classification::is_active_message(const t_symbol *s) const
     {
-        return get_Classifier_instance();
+        return s == get_s_cross_validate() || ml::is_active_message(s);
     }
     
-    const GRT::MLBase &classification::get_MLBase_instance() const
+    // The window only changes what is recorded
+    bool classification::changes_prediction(const t_symbol *s) const
     {
-        return get_Classifier_instance();
+        static const char *const object_settings[] = {"window_size", NULL};
+        
+        return !is_symbol_in(s, object_settings) && ml::changes_prediction(s);
     }
     
-    bool classification::read_specialised_dataset(std::string &path)
+    bool classification::read_specialised_dataset(std::string &path, background_job &job) const
     {
-        return classification_data.loadDatasetFromFile(path);
+        return job.classification_data.loadDatasetFromFile(path);
     }
     
-    bool classification::write_specialised_dataset(std::string &path) const
+    bool classification::write_specialised_dataset(std::string &path, const background_job &job) const
     {
-        return classification_data.saveDatasetToFile(path);
+        return job.classification_data.saveDatasetToFile(path);
     }
     
 }
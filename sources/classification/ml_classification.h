@@ -35,22 +35,29 @@ namespace ml
         {
             FLEXT_CADDATTR_SET(c, "null_rejection", set_null_rejection);
             FLEXT_CADDATTR_SET(c, "null_rejection_coeff", set_null_rejection_coeff);
+            FLEXT_CADDATTR_SET(c, "window_size", set_window_size);
             
             FLEXT_CADDATTR_GET(c, "null_rejection", get_null_rejection);
             FLEXT_CADDATTR_GET(c, "null_rejection_coeff", get_null_rejection_coeff);
+            FLEXT_CADDATTR_GET(c, "window_size", get_window_size);
+            
+            FLEXT_CADDMETHOD_I(c, 0, "cross_validate", cross_validate);
         }
         
         // Methods
-        void train();
         void map(int argc, const t_atom *argv);
+        void map_batch(int argc, const t_atom *argv);
+        void cross_validate(int num_folds);
         
         // Flext attribute setters
         void set_null_rejection(bool null_rejection);
         void set_null_rejection_coeff(float null_rejection_coeff);
+        void set_window_size(int window_size);
         
         // Flext attribute getters
         void get_null_rejection(bool &null_rejection) const;
         void get_null_rejection_coeff(float &null_rejection_coeff) const;
+        void get_window_size(int &window_size) const;
         
         virtual GRT::MLBase &get_MLBase_instance(); // TODO: should be "final" but g++ 4.6.2 doesn't support it
         virtual const GRT::MLBase &get_MLBase_instance() const; // TODO: should be "final" but g++ 4.6.2 doesn't support it
@@ -58,16 +65,48 @@ namespace ml
         virtual GRT::Classifier &get_Classifier_instance() = 0;
         virtual const GRT::Classifier &get_Classifier_instance() const = 0;
         
-        bool read_specialised_dataset(std::string &path);
-        bool write_specialised_dataset(std::string &path) const;
+        // Classifies a recorded time series for 'map', time_series may be modified. Subclasses can override this with a faster search than the classifier's predict()
+        virtual bool predict_time_series(GRT::Classifier &classifier, GRT::MatrixDouble &time_series, GRT::UINT &label);
+        
+        bool read_specialised_dataset(std::string &path, background_job &job) const;
+        bool write_specialised_dataset(std::string &path, const background_job &job) const;
+        
+        GRT::MLBase *copy_MLBase_instance(const GRT::MLBase &instance) const;
+        bool set_MLBase_instance(const GRT::MLBase &instance);
+        
+        bool is_active_message(const t_symbol *s) const;
+        bool changes_prediction(const t_symbol *s) const;
+        void run_job(background_job &job);
+        void complete_job(background_job &job);
         
     private:
-        bool get_num_samples() const;
+        // 'cross_validate' trains a copy of the staging model per fold, so neither the staging nor the active model is touched
+        struct cross_validation_job : background_job
+        {
+            cross_validation_job(const t_symbol *selector, data_type data_type_, GRT::UINT num_folds)
+            : background_job(selector, data_type_), num_folds(num_folds), null_column(false) {}
+            
+            GRT::UINT num_folds;
+            GRT::Vector<GRT::UINT> labels;
+            bool null_column; // a last column counting rejected samples, when NULL rejection is enabled
+            std::vector<double> accuracies; // one per fold
+            std::vector<GRT::UINT> confusion; // row major, a row per true label and a column per predicted label
+        };
+        
+        template <class T>
+        void cross_validate_dataset(const T &dataset, cross_validation_job &job) const;
+        
+        void prepare_inference_context(const GRT::Classifier &classifier, uint32_t generation);
+        
+        // Flext method wrappers
+        FLEXT_CALLBACK_I(cross_validate);
         
         // Flext attribute wrappers
         FLEXT_CALLVAR_B(get_null_rejection, set_null_rejection);
         FLEXT_CALLVAR_F(get_null_rejection_coeff, set_null_rejection_coeff);
+        FLEXT_CALLVAR_I(get_window_size, set_window_size);
         
+        inference_context context;
     };
 }
 
@@ -85,6 +85,8 @@ namespace ml
         GRT::Classifier &get_Classifier_instance();
         const GRT::Classifier &get_Classifier_instance() const;
         
+        bool changes_prediction(const t_symbol *s) const;
+        
     private:
         // Flext Flext attribute wrappers
         FLEXT_CALLVAR_I(get_training_mode, set_training_mode);
@@ -180,6 +182,14 @@ namespace ml
         return grt_dtree;
     }
     
+    // Training settings, these take effect at the next 'train'
+    bool dtree::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const training_settings[] = {"training_mode", "num_splitting_steps", "min_samples_per_node", "max_depth", "remove_features_at_each_split", NULL};
+        
+        return !is_symbol_in(s, training_settings) && classification::changes_prediction(s);
+    }
+    
     typedef class dtree ml0x2edtree;
     
 #ifdef BUILD_AS_LIBRARY
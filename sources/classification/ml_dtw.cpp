@@ -19,17 +19,265 @@
 #include "ml_classification.h"
 
 #include "ml_defaults.h"
+#include "ml_thread_pool.h"
+
+#include <limits>
+#include <cmath>
+#include <fstream>
 
 namespace ml
 {
     const std::string object_name = ML_NAME_PREFIX "dtw";
     
+    // GRT's DTW with a nearest template search that computes GRT's own template distances across a thread pool, skipping the templates
+    // whose lower bound can't match the nearest distance found so far. GRT's distance is the mean accumulated cost along its warping path,
+    // which is at least the cost of the first pair of frames and at least the accumulated cost of the whole path spread over the longest
+    // possible path. The bounds only hold for Euclidean frame distances without the warping path constraint: GRT marks the cells outside its
+    // band unreachable in the order its recursion visits them, so constrained distances are computed for every template
+    class searched_dtw : public GRT::DTW
+    {
+    public:
+        searched_dtw() : num_dimensions(0) {}
+        
+        // False when GRT's predict_() is needed: likelihood based rejection, z-normalisation and smoothing use every template distance
+        bool get_searchable() const;
+        
+        // The label GRT's predict_() would give time_series, which is scaled and offset in place as predict_() does. pruned is the number
+        // of templates skipped by their lower bound
+        bool search(GRT::MatrixDouble &time_series, thread_pool &pool, GRT::UINT &label, GRT::UINT &pruned);
+        
+        bool deepCopyFrom(const GRT::Classifier *classifier);
+        bool train_(GRT::TimeSeriesClassificationData &trainingData);
+        bool load(std::fstream &file);
+        bool clear();
+        
+        using GRT::DTW::train_;
+        using GRT::DTW::load;
+        
+    private:
+        void prepare_envelopes();
+        double get_lower_bound(GRT::UINT index, const GRT::MatrixDouble &time_series) const;
+        
+        // The smallest and largest value of each dimension of each template, a row per template
+        GRT::UINT num_dimensions;
+        std::vector<double> lower;
+        std::vector<double> upper;
+        std::vector<double> distances;
+        std::vector<char> skipped;
+    };
+    
+    bool searched_dtw::get_searchable() const
+    {
+        return getTrained() && !useZNormalisation && !useSmoothing && (!useNullRejection || rejectionMode == TEMPLATE_THRESHOLDS);
+    }
+    
+    // A template is only skipped when its lower bound is strictly worse than the best distance so far, with a margin for the bound
+    // summing the same costs in a different order. A template that ties with the best, which another thread may have found first,
+    // is always computed
+    static inline bool can_prune(double bound, const std::atomic<double> &best_distance)
+    {
+        static const double tolerance = 1 + 1e-9;
+        
+        return bound > best_distance.load(std::memory_order_relaxed) * tolerance;
+    }
+    
+    bool searched_dtw::search(GRT::MatrixDouble &time_series, thread_pool &pool, GRT::UINT &label, GRT::UINT &pruned)
+    {
+        const GRT::UINT numTemplates = templatesBuffer.size();
+        const GRT::UINT numRows = time_series.getNumRows();
+        const GRT::UINT numDimensions = time_series.getNumCols();
+        
+        if (!get_searchable() || numTemplates == 0 || numRows == 0 || numDimensions != num_dimensions)
+        {
+            return false;
+        }
+        
+        // The same preprocessing as GRT's predict_()
+        if (useScaling)
+        {
+            for (GRT::UINT row = 0; row < numRows; ++row)
+            {
+                for (GRT::UINT dimension = 0; dimension < numDimensions; ++dimension)
+                {
+                    time_series[row][dimension] = scale(time_series[row][dimension], ranges[dimension].minValue, ranges[dimension].maxValue, 0, 1);
+                }
+            }
+        }
+        
+        if (offsetUsingFirstSample)
+        {
+            offsetTimeseries(time_series);
+        }
+        
+        const bool bounded = !constrainWarpingPath && distanceMethod == EUCLIDEAN_DIST;
+        std::atomic<double> best_distance(std::numeric_limits<double>::infinity());
+        
+        distanceMatrices.resize(numTemplates);
+        warpPaths.resize(numTemplates);
+        distances.resize(numTemplates);
+        skipped.assign(numTemplates, 0);
+        
+        // Each template has its own distance matrix and warping path, as in predict_(), so they can be computed on any thread
+        pool.parallel_for(numTemplates, [&](size_t index, unsigned thread)
+        {
+            if (bounded && can_prune(get_lower_bound(index, time_series), best_distance))
+            {
+                skipped[index] = 1;
+                return;
+            }
+            
+            const double distance = computeDistance(templatesBuffer[index].timeSeries, time_series, distanceMatrices[index], warpPaths[index]);
+            double best = best_distance.load();
+            
+            while (distance < best && !best_distance.compare_exchange_weak(best, distance))
+            {
+            }
+            distances[index] = distance;
+        });
+        
+        // The first of the nearest templates in template order, as predict_() picks it. It is never skipped (see can_prune()), so the
+        // label doesn't depend on how the work was shared out
+        const double infinity = std::numeric_limits<double>::infinity();
+        GRT::UINT closest = 0;
+        double closest_distance = skipped[0] ? infinity : distances[0];
+        
+        pruned = skipped[0];
+        
+        for (GRT::UINT index = 1; index < numTemplates; ++index)
+        {
+            if (skipped[index])
+            {
+                ++pruned;
+            }
+            else if (distances[index] < closest_distance)
+            {
+                closest_distance = distances[index];
+                closest = index;
+            }
+        }
+        
+        label = templatesBuffer[closest].classLabel;
+        
+        if (useNullRejection && !(closest_distance <= nullRejectionThresholds[closest]))
+        {
+            label = GRT_DEFAULT_NULL_CLASS_LABEL;
+        }
+        
+        return true;
+    }
+    
+    // Every query frame is on the warping path, so the accumulated cost is at least the sum of each query frame's distance to the template's
+    // bounding box. Every cell of the path has accumulated at least the cost of the first frames, and the path has at most M + N - 1 cells
+    double searched_dtw::get_lower_bound(GRT::UINT index, const GRT::MatrixDouble &time_series) const
+    {
+        const GRT::MatrixDouble &frames = templatesBuffer[index].timeSeries;
+        const GRT::UINT numRows = time_series.getNumRows();
+        const GRT::UINT max_path_length = frames.getNumRows() + numRows - 1;
+        const double *template_lower = &lower[index * num_dimensions];
+        const double *template_upper = &upper[index * num_dimensions];
+        double first = 0;
+        double accumulated = 0;
+        
+        for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+        {
+            const double difference = frames[0][dimension] - time_series[0][dimension];
+            first += difference * difference;
+        }
+        first = std::sqrt(first);
+        
+        for (GRT::UINT row = 0; row < numRows; ++row)
+        {
+            double cost = 0;
+            
+            for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+            {
+                const double value = time_series[row][dimension];
+                const double difference = value > template_upper[dimension] ? value - template_upper[dimension] : value < template_lower[dimension] ? template_lower[dimension] - value : 0;
+                cost += difference * difference;
+            }
+            accumulated += std::sqrt(cost);
+        }
+        
+        return (std::max(accumulated, first) + (max_path_length - 1) * first) / max_path_length;
+    }
+    
+    void searched_dtw::prepare_envelopes()
+    {
+        const GRT::UINT numTemplates = templatesBuffer.size();
+        
+        num_dimensions = numTemplates == 0 ? 0 : templatesBuffer[0].timeSeries.getNumCols();
+        lower.assign(numTemplates * num_dimensions, std::numeric_limits<double>::infinity());
+        upper.assign(numTemplates * num_dimensions, -std::numeric_limits<double>::infinity());
+        
+        for (GRT::UINT index = 0; index < numTemplates; ++index)
+        {
+            const GRT::MatrixDouble &frames = templatesBuffer[index].timeSeries;
+            double *template_lower = &lower[index * num_dimensions];
+            double *template_upper = &upper[index * num_dimensions];
+            
+            for (GRT::UINT row = 0; row < frames.getNumRows(); ++row)
+            {
+                for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+                {
+                    template_lower[dimension] = std::min(template_lower[dimension], frames[row][dimension]);
+                    template_upper[dimension] = std::max(template_upper[dimension], frames[row][dimension]);
+                }
+            }
+        }
+    }
+    
+    bool searched_dtw::deepCopyFrom(const GRT::Classifier *classifier)
+    {
+        if (!GRT::DTW::deepCopyFrom(classifier))
+        {
+            return false;
+        }
+        
+        prepare_envelopes();
+        
+        return true;
+    }
+    
+    bool searched_dtw::train_(GRT::TimeSeriesClassificationData &trainingData)
+    {
+        if (!GRT::DTW::train_(trainingData))
+        {
+            return false;
+        }
+        
+        prepare_envelopes();
+        
+        return true;
+    }
+    
+    bool searched_dtw::load(std::fstream &file)
+    {
+        if (!GRT::DTW::load(file))
+        {
+            return false;
+        }
+        
+        prepare_envelopes();
+        
+        return true;
+    }
+    
+    bool searched_dtw::clear()
+    {
+        lower.clear();
+        upper.clear();
+        num_dimensions = 0;
+        
+        return GRT::DTW::clear();
+    }
+    
     class dtw : classification
     {
         FLEXT_HEADER_S(dtw, classification, setup);
         
     public:
         dtw()
+        : streaming(false), streaming_generation(0), streaming_time(0), pruned_templates(0)
         {
             post("Dynamic Time Warping based on the GRT library version " + GRT::GRTBase::getGRTVersion());
             set_scaling(defaults::scaling);
@@ -47,6 +295,8 @@ namespace ml
             FLEXT_CADDATTR_SET(c, "constrain_warping_path", set_constrain_warping_path);
             FLEXT_CADDATTR_SET(c, "enable_z_normalization", set_enable_z_normalization);
             FLEXT_CADDATTR_SET(c, "enable_trim_training_data", set_enable_trim_training_data);
+            FLEXT_CADDATTR_SET(c, "streaming", set_streaming);
+            FLEXT_CADDATTR_SET(c, "num_threads", set_num_threads);
             
             FLEXT_CADDATTR_GET(c, "rejection_mode", get_rejection_mode);
             FLEXT_CADDATTR_GET(c, "warping_radius", get_warping_radius);
@@ -54,6 +304,9 @@ namespace ml
             FLEXT_CADDATTR_GET(c, "constrain_warping_path", get_constrain_warping_path);
             FLEXT_CADDATTR_GET(c, "enable_z_normalization", get_enable_z_normalization);
             FLEXT_CADDATTR_GET(c, "enable_trim_training_data", get_enable_trim_training_data);
+            FLEXT_CADDATTR_GET(c, "streaming", get_streaming);
+            FLEXT_CADDATTR_GET(c, "pruned_templates", get_pruned_templates);
+            FLEXT_CADDATTR_GET(c, "num_threads", get_num_threads);
             
             DefineHelp(c, object_name.c_str());
         }
@@ -65,7 +318,8 @@ namespace ml
         void set_constrain_warping_path(bool constrain_warping_path);
         void set_enable_z_normalization(bool enable_z_normalization);
         void set_enable_trim_training_data(bool enable_trim_training_data);
-
+        void set_streaming(bool streaming);
+        void set_num_threads(int num_threads);
         
         // Flext attribute getters
         void get_rejection_mode(int &rejection_mode) const;
@@ -74,14 +328,44 @@ namespace ml
         void get_constrain_warping_path(bool &constrain_warping_path) const;
         void get_enable_z_normalization(bool &enable_z_normalization) const;
         void get_enable_trim_training_data(bool &enable_trim_training_data) const;
+        void get_streaming(bool &streaming) const;
+        void get_pruned_templates(int &pruned_templates) const;
+        void get_num_threads(int &num_threads) const;
+        
+        // Methods
+        void map(int argc, const t_atom *argv);
+        
+        bool predict_time_series(GRT::Classifier &classifier, GRT::MatrixDouble &time_series, GRT::UINT &label);
         
         // Implement pure virtual methods
         GRT::Classifier &get_Classifier_instance();
         const GRT::Classifier &get_Classifier_instance() const;
-        bool read_specialised_dataset(std::string &path);
-        bool write_specialised_dataset(std::string &path) const;
+        
+        GRT::MLBase *copy_MLBase_instance(const GRT::MLBase &instance) const;
+        
+        bool changes_prediction(const t_symbol *s) const;
+        bool read_specialised_dataset(std::string &path, background_job &job) const;
+        bool write_specialised_dataset(std::string &path, const background_job &job) const;
         
     private:
+        // Subsequence matching state for one template (SPRING, Sakurai et al. 2007), the DTW column is updated once per frame
+        struct spring_template
+        {
+            GRT::UINT label;
+            GRT::MatrixDouble frames;
+            double threshold;
+            std::vector<double> distances;
+            std::vector<double> previous_distances;
+            std::vector<uint64_t> starts;
+            std::vector<uint64_t> previous_starts;
+            double match_distance;
+            uint64_t match_start;
+            uint64_t match_end;
+        };
+        
+        bool prepare_streaming(GRT::DTW &classifier, uint32_t generation);
+        bool update_streaming(spring_template &spring, const GRT::VectorDouble &frame);
+        
         // Flext attribute wrappers
         FLEXT_CALLVAR_I(get_rejection_mode, set_rejection_mode);
         FLEXT_CALLVAR_F(get_warping_radius, set_warping_radius);
@@ -89,12 +373,26 @@ namespace ml
         FLEXT_CALLVAR_B(get_constrain_warping_path, set_constrain_warping_path);
         FLEXT_CALLVAR_B(get_enable_z_normalization, set_enable_z_normalization);
         FLEXT_CALLVAR_B(get_enable_trim_training_data, set_enable_trim_training_data);
+        FLEXT_CALLVAR_B(get_streaming, set_streaming);
+        FLEXT_CALLGET_I(get_pruned_templates);
+        FLEXT_CALLVAR_I(get_num_threads, set_num_threads);
         
         
         // Virtual method override
         virtual const std::string get_object_name(void) const { return object_name; };
         
-        GRT::DTW classifier;
+        searched_dtw classifier;
+        
+        bool streaming;
+        uint32_t streaming_generation;
+        uint64_t streaming_time;
+        bool streaming_scaling;
+        GRT::VectorDouble streaming_frame;
+        GRT::Vector<GRT::MinMax> streaming_ranges;
+        std::vector<spring_template> spring_templates;
+        
+        thread_pool search_pool;
+        GRT::UINT pruned_templates;
     };
     
     // Flext attribute setters
@@ -162,6 +460,23 @@ namespace ml
         }
     }
     
+    void dtw::set_streaming(bool streaming)
+    {
+        this->streaming = streaming;
+        streaming_generation = 0;
+    }
+    
+    void dtw::set_num_threads(int num_threads)
+    {
+        if (num_threads < 1)
+        {
+            error("number of threads must be 1 or greater");
+            return;
+        }
+        
+        search_pool.set_num_threads(num_threads);
+    }
+    
     // Flext attribute getters
     void dtw::get_rejection_mode(int &rejection_mode) const
     {
@@ -197,6 +512,235 @@ namespace ml
         error("function not implemented");
     }
     
+    void dtw::get_streaming(bool &streaming) const
+    {
+        streaming = this->streaming;
+    }
+    
+    void dtw::get_pruned_templates(int &pruned_templates) const
+    {
+        pruned_templates = this->pruned_templates;
+    }
+    
+    void dtw::get_num_threads(int &num_threads) const
+    {
+        num_threads = search_pool.get_num_threads();
+    }
+    
+    // Methods
+    bool dtw::predict_time_series(GRT::Classifier &classifier, GRT::MatrixDouble &time_series, GRT::UINT &label)
+    {
+        searched_dtw &active_dtw = static_cast<searched_dtw &>(classifier);
+        
+        pruned_templates = 0;
+        
+        // The likelihoods output with probs need every template distance, GRT computes those itself
+        if (probs || !active_dtw.get_searchable())
+        {
+            return classification::predict_time_series(classifier, time_series, label);
+        }
+        
+        return active_dtw.search(time_series, search_pool, label, pruned_templates);
+    }
+    
+    void dtw::map(int argc, const t_atom *argv)
+    {
+        if (!streaming)
+        {
+            classification::map(argc, argv);
+            return;
+        }
+        
+        const uint32_t generation = get_active_generation();
+        GRT::DTW *active_dtw = static_cast<GRT::DTW *>(get_active_MLBase_instance());
+        
+        if (active_dtw == NULL || active_dtw->getTrained() == false)
+        {
+            error("model has not been trained, use 'train' to train the model");
+            return;
+        }
+        
+        if (streaming_generation != generation && !prepare_streaming(*active_dtw, generation))
+        {
+            return;
+        }
+        
+        if (argc < 0 || (unsigned)argc != streaming_frame.size())
+        {
+            error("invalid input length, expected " + std::to_string(streaming_frame.size()) + ", got " + std::to_string(argc));
+            return;
+        }
+        
+        for (uint32_t index = 0; index < (uint32_t)argc; ++index)
+        {
+            double value = GetAFloat(argv[index]);
+            
+            // Match the [0, 1] scaling GRT applies to the templates
+            if (streaming_scaling)
+            {
+                const GRT::MinMax &range = streaming_ranges[index];
+                double span = range.maxValue - range.minValue;
+                value = span == 0 ? 0 : (value - range.minValue) / span;
+            }
+            streaming_frame[index] = value;
+        }
+        
+        ++streaming_time;
+        
+        for (std::vector<spring_template>::iterator spring = spring_templates.begin(); spring != spring_templates.end(); ++spring)
+        {
+            if (update_streaming(*spring, streaming_frame))
+            {
+                ToOutInt(0, spring->label);
+            }
+        }
+    }
+    
+    bool dtw::prepare_streaming(GRT::DTW &classifier, uint32_t generation)
+    {
+        if (classifier.getZNormalisationEnabled() || classifier.getOffsetTimeseriesUsingFirstSample())
+        {
+            error("streaming is not available with z-normalization or offset_time_series, the start of a match isn't known in advance");
+            return false;
+        }
+        
+        const double infinity = std::numeric_limits<double>::infinity();
+        const double null_rejection_coeff = classifier.getNullRejectionCoeff();
+        GRT::Vector<GRT::DTWTemplate> templates = classifier.getModels();
+        
+        streaming_scaling = classifier.getScalingEnabled();
+        streaming_ranges = classifier.getRanges();
+        streaming_frame.resize(classifier.getNumInputFeatures());
+        spring_templates.resize(templates.size());
+        
+        for (GRT::UINT index = 0; index < templates.size(); ++index)
+        {
+            const GRT::DTWTemplate &dtw_template = templates[index];
+            spring_template &spring = spring_templates[index];
+            const GRT::UINT length = dtw_template.timeSeries.getNumRows();
+            
+            spring.label = dtw_template.classLabel;
+            spring.frames = dtw_template.timeSeries;
+            spring.threshold = dtw_template.trainingMu + dtw_template.trainingSigma * null_rejection_coeff;
+            spring.distances.assign(length + 1, infinity);
+            spring.previous_distances.assign(length + 1, infinity);
+            spring.starts.assign(length + 1, 0);
+            spring.previous_starts.assign(length + 1, 0);
+            spring.match_distance = infinity;
+            spring.match_start = 0;
+            spring.match_end = 0;
+        }
+        
+        streaming_time = 0;
+        streaming_generation = generation;
+        
+        return true;
+    }
+    
+    // Returns true when a match has been confirmed, i.e. no warping path still in progress can improve on it or overlap it
+    bool dtw::update_streaming(spring_template &spring, const GRT::VectorDouble &frame)
+    {
+        const double infinity = std::numeric_limits<double>::infinity();
+        const GRT::UINT length = spring.frames.getNumRows();
+        const GRT::UINT numDimensions = frame.size();
+        
+        std::swap(spring.distances, spring.previous_distances);
+        std::swap(spring.starts, spring.previous_starts);
+        
+        std::vector<double> &distances = spring.distances;
+        std::vector<uint64_t> &starts = spring.starts;
+        const std::vector<double> &previous_distances = spring.previous_distances;
+        const std::vector<uint64_t> &previous_starts = spring.previous_starts;
+        
+        // A match can start at any frame
+        distances[0] = 0;
+        starts[0] = streaming_time;
+        
+        for (GRT::UINT index = 1; index <= length; ++index)
+        {
+            const double *template_frame = spring.frames[index - 1];
+            double cost = 0;
+            
+            for (GRT::UINT dimension = 0; dimension < numDimensions; ++dimension)
+            {
+                double difference = frame[dimension] - template_frame[dimension];
+                cost += difference * difference;
+            }
+            
+            double best = distances[index - 1];
+            uint64_t start = starts[index - 1];
+            
+            if (previous_distances[index - 1] < best)
+            {
+                best = previous_distances[index - 1];
+                start = previous_starts[index - 1];
+            }
+            
+            if (previous_distances[index] < best)
+            {
+                best = previous_distances[index];
+                start = previous_starts[index];
+            }
+            
+            distances[index] = std::sqrt(cost) + best;
+            starts[index] = start;
+        }
+        
+        // The thresholds are per frame, the accumulated distance grows with the template length
+        const double threshold = spring.threshold * length;
+        bool matched = false;
+        
+        if (spring.match_distance <= threshold)
+        {
+            matched = true;
+            
+            for (GRT::UINT index = 1; index <= length; ++index)
+            {
+                if (distances[index] < spring.match_distance && starts[index] <= spring.match_end)
+                {
+                    matched = false;
+                    break;
+                }
+            }
+            
+            if (matched)
+            {
+                spring.match_distance = infinity;
+                
+                for (GRT::UINT index = 1; index <= length; ++index)
+                {
+                    if (starts[index] <= spring.match_end)
+                    {
+                        distances[index] = infinity;
+                    }
+                }
+            }
+        }
+        
+        if (distances[length] <= threshold && distances[length] < spring.match_distance)
+        {
+            spring.match_distance = distances[length];
+            spring.match_start = starts[length];
+            spring.match_end = streaming_time;
+        }
+        
+        return matched;
+    }
+    
+    // The GRT classifier factory would copy a plain GRT::DTW, without the search
+    GRT::MLBase *dtw::copy_MLBase_instance(const GRT::MLBase &instance) const
+    {
+        searched_dtw *copy = new searched_dtw;
+        
+        if (!copy->deepCopyFrom(static_cast<const GRT::Classifier *>(&instance)))
+        {
+            delete copy;
+            return NULL;
+        }
+        
+        return copy;
+    }
+    
     // Implement pure virtual methods
     GRT::Classifier &dtw::get_Classifier_instance()
     {
@@ -208,14 +752,22 @@ namespace ml
         return classifier;
     }
     
-    bool dtw::read_specialised_dataset(std::string &path)
+    bool dtw::read_specialised_dataset(std::string &path, background_job &job) const
+    {
+        return job.time_series_classification_data.loadDatasetFromFile(path);
+    }
+    
+    bool dtw::write_specialised_dataset(std::string &path, const background_job &job) const
     {
-        return time_series_classification_data.loadDatasetFromFile(path);
+        return job.time_series_classification_data.saveDatasetToFile(path);
     }
     
-    bool dtw::write_specialised_dataset(std::string &path) const
+    // Training settings, which take effect at the next 'train', and settings of this object rather than its model
+    bool dtw::changes_prediction(const t_symbol *s) const
     {
-        return time_series_classification_data.saveDatasetToFile(path);
+        static const char *const training_settings[] = {"enable_trim_training_data", "streaming", "num_threads", NULL};
+        
+        return !is_symbol_in(s, training_settings) && classification::changes_prediction(s);
     }
     
     typedef class dtw ml0x2edtw;
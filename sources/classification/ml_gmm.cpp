@@ -58,6 +58,8 @@ namespace ml
         GRT::Classifier &get_Classifier_instance();
         const GRT::Classifier &get_Classifier_instance() const;
         
+        bool changes_prediction(const t_symbol *s) const;
+        
     private:
         // Flext Flext attribute wrappers
         FLEXT_CALLVAR_I(get_num_mixture_models, set_num_mixture_models);
@@ -92,6 +94,14 @@ namespace ml
         return grt_gmm;
     }
     
+    // Training settings, these take effect at the next 'train'
+    bool gmm::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const training_settings[] = {"num_mixture_models", NULL};
+        
+        return !is_symbol_in(s, training_settings) && classification::changes_prediction(s);
+    }
+    
     typedef class gmm ml0x2egmm;
     
 #ifdef BUILD_AS_LIBRARY
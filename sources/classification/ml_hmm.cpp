@@ -20,16 +20,357 @@
 
 #include "ml_defaults.h"
 
+#include <cmath>
+#include <limits>
+#include <fstream>
+#include <algorithm>
+#include <iomanip>
+
 namespace ml
 {
     const std::string object_name = ML_NAME_PREFIX "hmm";
     
+    // k-means codebook mapping continuous frames to the observation symbols of a discrete HMM
+    class vector_quantizer
+    {
+    public:
+        vector_quantizer() : num_dimensions(0), num_centroids(0) {}
+        
+        bool train(GRT::MatrixDouble &frames, GRT::UINT num_centroids);
+        void clear();
+        
+        // Index of the nearest centroid
+        GRT::UINT quantize(const double *frame);
+        
+        bool save(std::fstream &file) const;
+        bool load(std::fstream &file);
+        
+        bool empty() const { return num_centroids == 0; }
+        GRT::UINT get_num_dimensions() const { return num_dimensions; }
+        
+    private:
+        void set_centroids(const GRT::MatrixDouble &clusters);
+        
+        GRT::UINT num_dimensions;
+        GRT::UINT num_centroids;
+        std::vector<double> centroids; // dimension-major, the inner loop of quantize() runs over all centroids at once and vectorises
+        std::vector<double> distances;
+    };
+    
+    // GRT::HMM with an optional vector_quantizer in front. The codebook is trained with the model, copied with it and saved in the same '.model' file
+    class quantized_hmm : public GRT::HMM
+    {
+    public:
+        quantized_hmm() : quantize(false) {}
+        
+        void set_quantize(bool quantize) { this->quantize = quantize; }
+        bool get_quantize() const { return quantize; }
+        const vector_quantizer &get_quantizer() const { return quantizer; }
+        
+        bool deepCopyFrom(const GRT::Classifier *classifier);
+        bool train_(GRT::TimeSeriesClassificationData &trainingData);
+        bool predict_(GRT::VectorDouble &inputVector);
+        bool predict_(GRT::MatrixDouble &timeseries);
+        bool save(std::fstream &file) const;
+        bool load(std::fstream &file);
+        bool clear();
+        
+        using GRT::HMM::train_;
+        using GRT::HMM::save;
+        using GRT::HMM::load;
+        
+    private:
+        bool quantize;
+        vector_quantizer quantizer;
+        GRT::VectorDouble symbol;
+        GRT::MatrixDouble symbols;
+    };
+    
+    bool vector_quantizer::train(GRT::MatrixDouble &frames, GRT::UINT num_centroids)
+    {
+        GRT::KMeans kmeans;
+        
+        kmeans.enableScaling(false);
+        
+        if (!kmeans.setNumClusters(num_centroids) || !kmeans.train_(frames))
+        {
+            return false;
+        }
+        
+        set_centroids(kmeans.getClusters());
+        
+        return true;
+    }
+    
+    void vector_quantizer::set_centroids(const GRT::MatrixDouble &clusters)
+    {
+        num_centroids = clusters.getNumRows();
+        num_dimensions = clusters.getNumCols();
+        centroids.resize(num_dimensions * num_centroids);
+        distances.resize(num_centroids);
+        
+        for (GRT::UINT centroid = 0; centroid < num_centroids; ++centroid)
+        {
+            for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+            {
+                centroids[dimension * num_centroids + centroid] = clusters[centroid][dimension];
+            }
+        }
+    }
+    
+    void vector_quantizer::clear()
+    {
+        num_dimensions = 0;
+        num_centroids = 0;
+        centroids.clear();
+        distances.clear();
+    }
+    
+    GRT::UINT vector_quantizer::quantize(const double *frame)
+    {
+        double *distance = distances.data();
+        
+        std::fill(distances.begin(), distances.end(), 0.0);
+        
+        for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+        {
+            const double value = frame[dimension];
+            const double *centroid = &centroids[dimension * num_centroids];
+            
+            for (GRT::UINT index = 0; index < num_centroids; ++index)
+            {
+                const double difference = value - centroid[index];
+                distance[index] += difference * difference;
+            }
+        }
+        
+        return std::min_element(distances.begin(), distances.end()) - distances.begin();
+    }
+    
+    bool vector_quantizer::save(std::fstream &file) const
+    {
+        file << "VectorQuantizer: " << num_centroids << " " << num_dimensions << std::endl;
+        file << std::setprecision(std::numeric_limits<double>::max_digits10);
+        
+        for (GRT::UINT centroid = 0; centroid < num_centroids; ++centroid)
+        {
+            for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+            {
+                file << centroids[dimension * num_centroids + centroid] << (dimension + 1 < num_dimensions ? " " : "\n");
+            }
+        }
+        
+        return file.good();
+    }
+    
+    bool vector_quantizer::load(std::fstream &file)
+    {
+        std::string word;
+        GRT::UINT rows = 0;
+        GRT::UINT cols = 0;
+        
+        clear();
+        
+        // Models saved without a codebook end here
+        if (!(file >> word))
+        {
+            file.clear();
+            return true;
+        }
+        
+        if (word != "VectorQuantizer:" || !(file >> rows >> cols))
+        {
+            return false;
+        }
+        
+        GRT::MatrixDouble clusters(rows, cols);
+        
+        for (GRT::UINT row = 0; row < rows; ++row)
+        {
+            for (GRT::UINT col = 0; col < cols; ++col)
+            {
+                if (!(file >> clusters[row][col]))
+                {
+                    return false;
+                }
+            }
+        }
+        
+        if (rows > 0)
+        {
+            set_centroids(clusters);
+        }
+        
+        return true;
+    }
+    
+    bool quantized_hmm::deepCopyFrom(const GRT::Classifier *classifier)
+    {
+        if (!GRT::HMM::deepCopyFrom(classifier))
+        {
+            return false;
+        }
+        
+        const quantized_hmm *source = dynamic_cast<const quantized_hmm *>(classifier);
+        
+        if (source != NULL)
+        {
+            quantize = source->quantize;
+            quantizer = source->quantizer;
+        }
+        else
+        {
+            quantizer.clear();
+        }
+        
+        return true;
+    }
+    
+    bool quantized_hmm::train_(GRT::TimeSeriesClassificationData &trainingData)
+    {
+        quantizer.clear();
+        
+        if (!quantize)
+        {
+            return GRT::HMM::train_(trainingData);
+        }
+        
+        const GRT::UINT numSamples = trainingData.getNumSamples();
+        GRT::MatrixDouble frames;
+        
+        for (GRT::UINT sample = 0; sample < numSamples; ++sample)
+        {
+            const GRT::MatrixDouble &data = trainingData[sample].getData();
+            
+            for (GRT::UINT row = 0; row < data.getNumRows(); ++row)
+            {
+                frames.push_back(data.getRowVector(row));
+            }
+        }
+        
+        if (frames.getNumRows() < getNumSymbols())
+        {
+            errorLog << "train_(TimeSeriesClassificationData &trainingData) - need at least num_symbols frames to train the codebook" << std::endl;
+            return false;
+        }
+        
+        if (!quantizer.train(frames, getNumSymbols()))
+        {
+            errorLog << "train_(TimeSeriesClassificationData &trainingData) - failed to train the codebook" << std::endl;
+            return false;
+        }
+        
+        GRT::TimeSeriesClassificationData quantizedData(1);
+        
+        for (GRT::UINT sample = 0; sample < numSamples; ++sample)
+        {
+            const GRT::MatrixDouble &data = trainingData[sample].getData();
+            GRT::MatrixDouble sequence(data.getNumRows(), 1);
+            
+            for (GRT::UINT row = 0; row < data.getNumRows(); ++row)
+            {
+                sequence[row][0] = quantizer.quantize(data[row]);
+            }
+            quantizedData.addSample(trainingData[sample].getClassLabel(), sequence);
+        }
+        
+        if (!GRT::HMM::train_(quantizedData))
+        {
+            quantizer.clear();
+            return false;
+        }
+        
+        // 'map' takes the continuous frames
+        numInputDimensions = quantizer.get_num_dimensions();
+        
+        return true;
+    }
+    
+    bool quantized_hmm::predict_(GRT::VectorDouble &inputVector)
+    {
+        if (quantizer.empty())
+        {
+            return GRT::HMM::predict_(inputVector);
+        }
+        
+        if (inputVector.size() != quantizer.get_num_dimensions())
+        {
+            errorLog << "predict_(VectorDouble &inputVector) - the size of the input vector does not match the codebook" << std::endl;
+            return false;
+        }
+        
+        symbol.resize(1);
+        symbol[0] = quantizer.quantize(inputVector.data());
+        
+        // GRT checks the input size against numInputDimensions, which is the frame size rather than 1 symbol
+        numInputDimensions = 1;
+        bool success = GRT::HMM::predict_(symbol);
+        numInputDimensions = quantizer.get_num_dimensions();
+        
+        return success;
+    }
+    
+    bool quantized_hmm::predict_(GRT::MatrixDouble &timeseries)
+    {
+        if (quantizer.empty())
+        {
+            return GRT::HMM::predict_(timeseries);
+        }
+        
+        if (timeseries.getNumCols() != quantizer.get_num_dimensions())
+        {
+            errorLog << "predict_(MatrixDouble &timeseries) - the number of columns does not match the codebook" << std::endl;
+            return false;
+        }
+        
+        symbols.resize(timeseries.getNumRows(), 1);
+        
+        for (GRT::UINT row = 0; row < timeseries.getNumRows(); ++row)
+        {
+            symbols[row][0] = quantizer.quantize(timeseries[row]);
+        }
+        
+        numInputDimensions = 1;
+        bool success = GRT::HMM::predict_(symbols);
+        numInputDimensions = quantizer.get_num_dimensions();
+        
+        return success;
+    }
+    
+    bool quantized_hmm::save(std::fstream &file) const
+    {
+        return GRT::HMM::save(file) && quantizer.save(file);
+    }
+    
+    bool quantized_hmm::load(std::fstream &file)
+    {
+        if (!GRT::HMM::load(file) || !quantizer.load(file))
+        {
+            return false;
+        }
+        
+        if (!quantizer.empty())
+        {
+            numInputDimensions = quantizer.get_num_dimensions();
+        }
+        
+        return true;
+    }
+    
+    bool quantized_hmm::clear()
+    {
+        quantizer.clear();
+        
+        return GRT::HMM::clear();
+    }
+    
     class hmm : classification
     {
         FLEXT_HEADER_S(hmm, classification, setup);
         
     public:
         hmm()
+        : online(false), online_generation(0), online_frames(0)
         {
             post("Hidden Markov Model based on the GRT library version " + GRT::GRTBase::getGRTVersion());
             set_scaling(defaults::scaling);
@@ -47,12 +388,16 @@ namespace ml
             FLEXT_CADDATTR_SET(c, "delta", set_delta);
             FLEXT_CADDATTR_SET(c, "max_num_iterations", set_max_num_iterations);
             FLEXT_CADDATTR_SET(c, "num_random_training_iterations", set_num_random_training_iterations);
+            FLEXT_CADDATTR_SET(c, "online", set_online);
+            FLEXT_CADDATTR_SET(c, "quantize", set_quantize);
 
             FLEXT_CADDATTR_GET(c, "num_states", get_num_states);
             FLEXT_CADDATTR_GET(c, "num_symbols", get_num_symbols);
             FLEXT_CADDATTR_GET(c, "num_symbols", get_model_type);
             FLEXT_CADDATTR_GET(c, "delta", get_delta);
             FLEXT_CADDATTR_GET(c, "max_num_iterations", get_max_num_iterations);
+            FLEXT_CADDATTR_GET(c, "online", get_online);
+            FLEXT_CADDATTR_GET(c, "quantize", get_quantize);
             
             DefineHelp(c, object_name.c_str());
         }
@@ -64,6 +409,8 @@ namespace ml
         void set_delta(int delta);
         void set_max_num_iterations(int max_num_iterations);
         void set_num_random_training_iterations(int num_random_training_iterations);
+        void set_online(bool online);
+        void set_quantize(bool quantize);
         
         // Flext attribute getters
         void get_num_states(int &num_states) const;
@@ -72,14 +419,40 @@ namespace ml
         void get_delta(int &delta) const;
         void get_max_num_iterations(int &max_num_iterations) const;
         void get_num_random_training_iterations(int &num_random_training_iterations) const;
+        void get_online(bool &online) const;
+        void get_quantize(bool &quantize) const;
+        
+        // Methods
+        void map(int argc, const t_atom *argv);
+        
+        void reset_recording_state();
+        
+        GRT::MLBase *copy_MLBase_instance(const GRT::MLBase &instance) const;
         
         // Implement pure virtual methods
         GRT::Classifier &get_Classifier_instance();
         const GRT::Classifier &get_Classifier_instance() const;
-        bool read_specialised_dataset(std::string &path);
-        bool write_specialised_dataset(std::string &path) const;
+        
+        bool changes_prediction(const t_symbol *s) const;
+        bool read_specialised_dataset(std::string &path, background_job &job) const;
+        bool write_specialised_dataset(std::string &path, const background_job &job) const;
         
     private:
+        // Scaled forward variables for one class model, alpha is renormalised every frame and the log of the scale factors is accumulated
+        struct forward_model
+        {
+            GRT::UINT num_states;
+            std::vector<double> transitions; // row-major, num_states x num_states
+            std::vector<double> emissions; // row-major, num_symbols x num_states so one observation reads a contiguous row
+            std::vector<double> pi;
+            std::vector<double> alpha;
+            std::vector<double> next_alpha;
+            double log_likelihood;
+        };
+        
+        bool prepare_online(quantized_hmm &classifier, uint32_t generation);
+        void update_forward(forward_model &model, GRT::UINT symbol, bool first) const;
+        
         // Flext attribute wrappers
         FLEXT_CALLVAR_I(get_num_states, set_num_states);
         FLEXT_CALLVAR_I(get_num_symbols, set_num_symbols);
@@ -87,12 +460,26 @@ namespace ml
         FLEXT_CALLVAR_I(get_delta, set_delta);
         FLEXT_CALLVAR_I(get_max_num_iterations, set_max_num_iterations);
         FLEXT_CALLVAR_I(get_num_random_training_iterations, set_num_random_training_iterations);
+        FLEXT_CALLVAR_B(get_online, set_online);
+        FLEXT_CALLVAR_B(get_quantize, set_quantize);
         
         // Virtual method override
         virtual const std::string get_object_name(void) const { return object_name; };
         
         // Instance variables
-        GRT::HMM classifier;
+        quantized_hmm classifier;
+        
+        bool online;
+        uint32_t online_generation;
+        GRT::UINT online_frames;
+        GRT::UINT online_num_symbols;
+        vector_quantizer online_quantizer;
+        GRT::VectorDouble online_frame;
+        bool online_null_rejection;
+        GRT::Vector<GRT::UINT> online_labels;
+        GRT::VectorDouble online_thresholds;
+        std::vector<forward_model> forward_models;
+        std::vector<t_atom> online_probs;
     };
     
     // Flext attribute setters
@@ -156,6 +543,17 @@ namespace ml
         }
     }
     
+    void hmm::set_online(bool online)
+    {
+        this->online = online;
+        online_generation = 0;
+    }
+    
+    void hmm::set_quantize(bool quantize)
+    {
+        classifier.set_quantize(quantize);
+    }
+    
     // Flext attribute getters
     void hmm::get_num_states(int &num_states) const
     {
@@ -187,6 +585,266 @@ namespace ml
         num_random_training_iterations = classifier.getNumRandomTrainingIterations();
     }
     
+    void hmm::get_online(bool &online) const
+    {
+        online = this->online;
+    }
+    
+    void hmm::get_quantize(bool &quantize) const
+    {
+        quantize = classifier.get_quantize();
+    }
+    
+    // Methods
+    void hmm::map(int argc, const t_atom *argv)
+    {
+        if (!online || !recording)
+        {
+            classification::map(argc, argv);
+            return;
+        }
+        
+        const uint32_t generation = get_active_generation();
+        quantized_hmm *active_hmm = static_cast<quantized_hmm *>(get_active_MLBase_instance());
+        
+        if (active_hmm == NULL || active_hmm->getTrained() == false)
+        {
+            error("model has not been trained, use 'train' to train the model");
+            return;
+        }
+        
+        if (online_generation != generation && !prepare_online(*active_hmm, generation))
+        {
+            return;
+        }
+        
+        if (argc < 0 || (unsigned)argc != online_frame.size())
+        {
+            error("invalid input length, expected " + std::to_string(online_frame.size()) + ", got " + std::to_string(argc));
+            return;
+        }
+        
+        for (uint32_t index = 0; index < (uint32_t)argc; ++index)
+        {
+            online_frame[index] = GetAFloat(argv[index]);
+        }
+        
+        GRT::UINT symbol = 0;
+        
+        if (online_quantizer.empty())
+        {
+            if (online_frame[0] < 0 || online_frame[0] >= online_num_symbols)
+            {
+                error("invalid symbol, expected 0 to " + std::to_string(online_num_symbols - 1));
+                return;
+            }
+            symbol = static_cast<GRT::UINT>(online_frame[0]);
+        }
+        else
+        {
+            symbol = online_quantizer.quantize(online_frame.data());
+        }
+        
+        const double infinity = std::numeric_limits<double>::infinity();
+        double best_log_likelihood = -infinity;
+        GRT::UINT best_index = 0;
+        
+        for (GRT::UINT index = 0; index < forward_models.size(); ++index)
+        {
+            forward_model &model = forward_models[index];
+            update_forward(model, symbol, online_frames == 0);
+            
+            if (model.log_likelihood > best_log_likelihood)
+            {
+                best_log_likelihood = model.log_likelihood;
+                best_index = index;
+            }
+        }
+        
+        ++online_frames;
+        
+        GRT::UINT label = GRT_DEFAULT_NULL_CLASS_LABEL;
+        
+        // Same decision as GRT::HMM: the likelihoods are the normalised antilogs of the log-likelihoods, shifted by the best one so they don't underflow
+        if (best_log_likelihood > -infinity)
+        {
+            double sum = 0;
+            
+            for (GRT::UINT index = 0; index < forward_models.size(); ++index)
+            {
+                sum += std::exp(forward_models[index].log_likelihood - best_log_likelihood);
+            }
+            
+            const double max_likelihood = 1.0 / sum;
+            
+            if (!online_null_rejection || max_likelihood > online_thresholds[best_index])
+            {
+                label = online_labels[best_index];
+            }
+        }
+        
+        if (probs)
+        {
+            for (GRT::UINT index = 0; index < forward_models.size(); ++index)
+            {
+                SetFloat(online_probs[index * 2 + 1], static_cast<float>(forward_models[index].log_likelihood));
+            }
+            ToOutAnything(1, get_s_probs(), (int)online_probs.size(), online_probs.data());
+        }
+        
+        ToOutInt(0, label);
+    }
+    
+    void hmm::reset_recording_state()
+    {
+        online_frames = 0;
+    }
+    
+    bool hmm::prepare_online(quantized_hmm &classifier, uint32_t generation)
+    {
+        if (classifier.getHMMType() != HMM_DISCRETE)
+        {
+            error("online recognition is only available for discrete HMMs");
+            return false;
+        }
+        
+        GRT::Vector<GRT::DiscreteHiddenMarkovModel> models = classifier.getDiscreteModels();
+        
+        online_num_symbols = classifier.getNumSymbols();
+        online_quantizer = classifier.get_quantizer();
+        online_frame.resize(online_quantizer.empty() ? 1 : online_quantizer.get_num_dimensions());
+        online_null_rejection = classifier.getNullRejectionEnabled();
+        online_labels = classifier.getClassLabels();
+        online_thresholds = classifier.getNullRejectionThresholds();
+        forward_models.resize(models.size());
+        online_probs.resize(models.size() * 2);
+        
+        if (online_labels.size() != models.size() || (online_null_rejection && online_thresholds.size() != models.size()))
+        {
+            error("labels / models size mismatch");
+            return false;
+        }
+        
+        for (GRT::UINT index = 0; index < models.size(); ++index)
+        {
+            const GRT::DiscreteHiddenMarkovModel &source = models[index];
+            forward_model &model = forward_models[index];
+            const GRT::UINT num_states = source.numStates;
+            
+            model.num_states = num_states;
+            model.transitions.resize(num_states * num_states);
+            model.emissions.resize(online_num_symbols * num_states);
+            model.pi.resize(num_states);
+            model.alpha.assign(num_states, 0);
+            model.next_alpha.assign(num_states, 0);
+            model.log_likelihood = 0;
+            
+            for (GRT::UINT state = 0; state < num_states; ++state)
+            {
+                model.pi[state] = source.pi[state];
+                
+                for (GRT::UINT next = 0; next < num_states; ++next)
+                {
+                    model.transitions[state * num_states + next] = source.a[state][next];
+                }
+                
+                for (GRT::UINT symbol = 0; symbol < online_num_symbols; ++symbol)
+                {
+                    model.emissions[symbol * num_states + state] = source.b[state][symbol];
+                }
+            }
+            
+            SetInt(online_probs[index * 2], online_labels[index]);
+        }
+        
+        // A new model can't continue the old model's forward variables
+        online_frames = 0;
+        online_generation = generation;
+        
+        return true;
+    }
+    
+    // One step of the forward algorithm, O(num_states^2)
+    void hmm::update_forward(forward_model &model, GRT::UINT symbol, bool first) const
+    {
+        const GRT::UINT num_states = model.num_states;
+        const double *emission = &model.emissions[symbol * num_states];
+        std::vector<double> &next_alpha = model.next_alpha;
+        double sum = 0;
+        
+        if (first)
+        {
+            model.log_likelihood = 0;
+            
+            for (GRT::UINT state = 0; state < num_states; ++state)
+            {
+                next_alpha[state] = model.pi[state] * emission[state];
+            }
+        }
+        else
+        {
+            std::fill(next_alpha.begin(), next_alpha.end(), 0.0);
+            
+            for (GRT::UINT state = 0; state < num_states; ++state)
+            {
+                const double alpha = model.alpha[state];
+                
+                // Left-right models leave most of alpha at zero
+                if (alpha == 0)
+                {
+                    continue;
+                }
+                
+                const double *transitions = &model.transitions[state * num_states];
+                
+                for (GRT::UINT next = 0; next < num_states; ++next)
+                {
+                    next_alpha[next] += alpha * transitions[next];
+                }
+            }
+            
+            for (GRT::UINT state = 0; state < num_states; ++state)
+            {
+                next_alpha[state] *= emission[state];
+            }
+        }
+        
+        for (GRT::UINT state = 0; state < num_states; ++state)
+        {
+            sum += next_alpha[state];
+        }
+        
+        std::swap(model.alpha, next_alpha);
+        
+        // The observation is impossible under this model, alpha stays at zero so the likelihood stays at zero too
+        if (sum <= 0)
+        {
+            model.log_likelihood = -std::numeric_limits<double>::infinity();
+            return;
+        }
+        
+        for (GRT::UINT state = 0; state < num_states; ++state)
+        {
+            model.alpha[state] /= sum;
+        }
+        
+        model.log_likelihood += std::log(sum);
+    }
+    
+    
+    // The GRT classifier factory would copy a plain GRT::HMM, losing the codebook
+    GRT::MLBase *hmm::copy_MLBase_instance(const GRT::MLBase &instance) const
+    {
+        quantized_hmm *copy = new quantized_hmm;
+        
+        if (!copy->deepCopyFrom(static_cast<const GRT::Classifier *>(&instance)))
+        {
+            delete copy;
+            return NULL;
+        }
+        
+        return copy;
+    }
     
     // Implement pure virtual methods
     GRT::Classifier &hmm::get_Classifier_instance()
@@ -199,14 +857,22 @@ namespace ml
         return classifier;
     }
     
-    bool hmm::read_specialised_dataset(std::string &path)
+    bool hmm::read_specialised_dataset(std::string &path, background_job &job) const
     {
-        return time_series_classification_data.loadDatasetFromFile(path);
+        return job.time_series_classification_data.loadDatasetFromFile(path);
     }
 
-    bool hmm::write_specialised_dataset(std::string &path) const
+    bool hmm::write_specialised_dataset(std::string &path, const background_job &job) const
     {
-        return time_series_classification_data.saveDatasetToFile(path);
+        return job.time_series_classification_data.saveDatasetToFile(path);
+    }
+    
+    // Training settings, which take effect at the next 'train', and settings of this object rather than its model
+    bool hmm::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const training_settings[] = {"delta", "max_num_iterations", "num_random_training_iterations", "online", NULL};
+        
+        return !is_symbol_in(s, training_settings) && classification::changes_prediction(s);
     }
     
     typedef class hmm ml0x2ehmm;
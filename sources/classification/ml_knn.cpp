@@ -19,17 +19,1665 @@
 #include "ml_classification.h"
 
 #include "ml_defaults.h"
+#include "ml_thread_pool.h"
+
+#include <cmath>
+#include <limits>
+#include <fstream>
+#include <iomanip>
+#include <deque>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <thread>
 
 namespace ml
 {
     static const std::string object_name = ML_NAME_PREFIX "knn";
     
+    // Exact k nearest neighbour search over the (scaled) training samples, a KD-tree with a bounding box per node or a ball tree with a centre and radius per node
+    class spatial_index
+    {
+    public:
+        enum index_type
+        {
+            BRUTE_FORCE,
+            AUTOMATIC,
+            KD_TREE,
+            BALL_TREE,
+            NUM_INDEX_TYPES
+        };
+        
+        struct neighbour
+        {
+            double distance;
+            GRT::UINT index;
+            
+            // Ties go to the earlier sample
+            bool operator<(const neighbour &rhs) const
+            {
+                return distance < rhs.distance || (distance == rhs.distance && index < rhs.index);
+            }
+        };
+        
+        spatial_index() : type(BRUTE_FORCE), manhattan(false), num_dimensions(0), bound_size(0) {}
+        
+        // type must be KD_TREE or BALL_TREE, distance_method is GRT::KNN::EUCLIDEAN_DISTANCE or GRT::KNN::MANHATTAN_DISTANCE
+        void build(const GRT::ClassificationData &data, index_type type, GRT::UINT distance_method);
+        void clear();
+        
+        // Adds one (scaled) sample after build() in O(log n): it goes into the leaf it is nearest to, which is split once it holds twice leaf_size points
+        void insert(GRT::UINT sample, const double *values);
+        
+        // Inserted points can leave the tree unbalanced, rebuilding once they outnumber the built ones keeps the amortised cost per sample at O(log n)
+        bool needs_rebuild() const { return inserted_order.size() > order.size(); }
+        bool has_inserted() const { return !inserted_order.empty(); }
+        
+        // The k nearest samples sorted by distance, indices refer to the samples in the data passed to build() and insert(). Safe to call from several threads
+        void search(const double *query, GRT::UINT k, std::vector<neighbour> &neighbours) const;
+        
+        // Only valid without inserted points, a tree with inserted points is rebuilt before saving
+        bool save(std::fstream &file) const;
+        bool load(std::fstream &file, const GRT::ClassificationData &data);
+        
+        bool empty() const { return nodes.empty(); }
+        index_type get_type() const { return type; }
+        
+        static const GRT::UINT leaf_size = 16;
+        
+    private:
+        // Children are stored at left and left + 1, leaves have left == 0
+        struct node
+        {
+            GRT::UINT begin;
+            GRT::UINT end;
+            GRT::UINT left;
+        };
+        
+        void copy_points(const GRT::ClassificationData &data);
+        void build_node(GRT::UINT node_index, GRT::UINT begin, GRT::UINT end);
+        void set_bounds(GRT::UINT node_index);
+        void extend_bounds(GRT::UINT node_index, const double *values);
+        void split_leaf(GRT::UINT node_index);
+        void search_node(const double *query, GRT::UINT k, std::vector<neighbour> &neighbours, GRT::UINT node_index, double bound) const;
+        double get_bound(const double *query, GRT::UINT node_index) const;
+        double get_distance(const double *a, const double *b) const;
+        
+        // Points are numbered in tree order, then in insertion order after the built ones
+        const double *get_point(GRT::UINT point) const { return point < order.size() ? &points[point * num_dimensions] : &inserted_points[(point - order.size()) * num_dimensions]; }
+        GRT::UINT get_sample(GRT::UINT point) const { return point < order.size() ? order[point] : inserted_order[point - order.size()]; }
+        
+        // A node holds its built points [begin, end) followed by its inserted points
+        GRT::UINT get_node_size(GRT::UINT node_index) const { return nodes[node_index].end - nodes[node_index].begin + inserted[node_index].size(); }
+        GRT::UINT get_node_point(GRT::UINT node_index, GRT::UINT position) const
+        {
+            const GRT::UINT num_built = nodes[node_index].end - nodes[node_index].begin;
+            return position < num_built ? nodes[node_index].begin + position : inserted[node_index][position - num_built];
+        }
+        
+        // Distances are compared squared for the euclidean distance
+        double to_distance(double reduced) const { return manhattan ? reduced : std::sqrt(reduced); }
+        double to_reduced(double distance) const { return manhattan ? distance : distance * distance; }
+        
+        index_type type;
+        bool manhattan;
+        GRT::UINT num_dimensions;
+        GRT::UINT bound_size;
+        std::vector<node> nodes;
+        std::vector<GRT::UINT> order; // sample index of each point
+        std::vector<double> points; // row-major in tree order so that a leaf is contiguous
+        std::vector<double> bounds; // per node, lower and upper corners for a KD-tree, centre and radius for a ball tree
+        std::vector<std::vector<GRT::UINT> > inserted; // per node, the points inserted into it since build()
+        std::vector<GRT::UINT> inserted_order; // sample index of each inserted point
+        std::vector<double> inserted_points; // row-major in insertion order
+    };
+    
+    // Approximate k nearest neighbour search on a hierarchical navigable small world graph (Malkov and Yashunin 2016)
+    class hnsw_index
+    {
+    public:
+        hnsw_index() : manhattan(false), num_dimensions(0), max_connections(16), ef_search(50), entry_point(0), max_level(0), visit_tag(0) {}
+        
+        // distance_method is GRT::KNN::EUCLIDEAN_DISTANCE or GRT::KNN::MANHATTAN_DISTANCE
+        void build(const GRT::ClassificationData &data, GRT::UINT distance_method, GRT::UINT max_connections);
+        void clear();
+        
+        // Adds one (scaled) sample after build(), the same O(log n) insertion that build() does for every sample
+        void add(const double *values);
+        
+        // The (approximately) k nearest samples sorted by distance, indices refer to the samples in the data passed to build() and add()
+        void search(const double *query, GRT::UINT k, std::vector<spatial_index::neighbour> &neighbours);
+        
+        // Linear scan over the same points, the reference for the recall report
+        void search_exact(const double *query, GRT::UINT k, std::vector<spatial_index::neighbour> &neighbours) const;
+        
+        bool save(std::fstream &file) const;
+        bool load(std::fstream &file, const GRT::ClassificationData &data);
+        
+        void set_ef_search(GRT::UINT ef_search) { this->ef_search = ef_search; }
+        GRT::UINT get_ef_search() const { return ef_search; }
+        GRT::UINT get_max_connections() const { return max_connections; }
+        bool empty() const { return levels.empty(); }
+        const double *get_point(GRT::UINT point) const { return &points[point * num_dimensions]; }
+        
+        static const GRT::UINT ef_construction = 100;
+        
+    private:
+        typedef std::pair<double, GRT::UINT> candidate; // reduced distance, point
+        
+        void insert(GRT::UINT point, GRT::UINT level);
+        GRT::UINT get_random_level();
+        GRT::UINT *get_links(GRT::UINT point, GRT::UINT level);
+        const GRT::UINT *get_links(GRT::UINT point, GRT::UINT level) const;
+        GRT::UINT get_max_links(GRT::UINT level) const { return level == 0 ? max_connections * 2 : max_connections; }
+        GRT::UINT search_greedy(const double *query, GRT::UINT point, double &distance, GRT::UINT level);
+        void search_layer(const double *query, GRT::UINT ef, GRT::UINT level, std::vector<candidate> &results);
+        void select_neighbours(std::vector<candidate> &candidates, GRT::UINT max_links) const;
+        double get_distance(const double *a, const double *b) const;
+        double to_distance(double reduced) const { return manhattan ? reduced : std::sqrt(reduced); }
+        
+        bool manhattan;
+        GRT::UINT num_dimensions;
+        GRT::UINT max_connections;
+        GRT::UINT ef_search;
+        GRT::UINT entry_point;
+        GRT::UINT max_level;
+        std::vector<double> points; // row-major in sample order
+        std::vector<GRT::UINT> levels; // top level of each point
+        std::vector<GRT::UINT> base_links; // level 0, a count followed by max_connections * 2 slots per point
+        std::vector<std::vector<GRT::UINT> > upper_links; // levels 1 and up, a count followed by max_connections slots per level
+        std::mt19937 random;
+        
+        // Search state
+        GRT::UINT visit_tag;
+        std::vector<GRT::UINT> visited;
+        std::vector<candidate> candidates;
+    };
+    
+    // GRT::KNN answering 'map' from a spatial_index built at train time, falls back to GRT's linear scan for the cosine distance
+    class indexed_knn : public GRT::KNN
+    {
+    public:
+        indexed_knn() : index_type(spatial_index::AUTOMATIC), approximate(false), max_connections(16) {}
+        
+        void set_index_type(spatial_index::index_type index_type) { this->index_type = index_type; }
+        spatial_index::index_type get_index_type() const { return index_type; }
+        void set_approximate(bool approximate) { this->approximate = approximate; }
+        bool get_approximate() const { return approximate; }
+        void set_max_connections(GRT::UINT max_connections) { this->max_connections = max_connections; }
+        GRT::UINT get_max_connections() const { return max_connections; }
+        void set_ef_search(GRT::UINT ef_search) { graph.set_ef_search(ef_search); }
+        GRT::UINT get_ef_search() const { return graph.get_ef_search(); }
+        
+        // Measures recall@K of the approximate search against the exact search for each ef_search value, queries are midpoints of pairs of training samples
+        bool get_recall(GRT::UINT num_queries, const std::vector<GRT::UINT> &ef_search_values, std::vector<double> &recall, std::vector<double> &approximate_time, double &exact_time);
+        
+        // Adds a sample to the trained model and its index without retraining. A new class label sets labels_changed, new classes can't be added with null rejection enabled
+        bool add_sample(GRT::UINT label, const GRT::VectorDouble &sample, bool &labels_changed);
+        
+        bool deepCopyFrom(const GRT::Classifier *classifier);
+        bool train_(GRT::ClassificationData &trainingData);
+        bool predict_(GRT::VectorDouble &inputVector);
+        bool save(std::fstream &file) const;
+        bool load(std::fstream &file);
+        bool clear();
+        
+        using GRT::KNN::train_;
+        using GRT::KNN::predict_;
+        using GRT::KNN::save;
+        using GRT::KNN::load;
+        
+    private:
+        void build_index();
+        void prepare_sample_classes();
+        bool search_best_k(const GRT::ClassificationData &trainingData, GRT::UINT &best_k) const;
+        
+        spatial_index::index_type index_type;
+        bool approximate;
+        GRT::UINT max_connections;
+        spatial_index index;
+        hnsw_index graph;
+        std::vector<GRT::UINT> sample_classes; // index into classLabels for each training sample
+        std::vector<spatial_index::neighbour> neighbours;
+    };
+    
+    void spatial_index::build(const GRT::ClassificationData &data, index_type type, GRT::UINT distance_method)
+    {
+        clear();
+        
+        this->type = type;
+        manhattan = distance_method == GRT::KNN::MANHATTAN_DISTANCE;
+        num_dimensions = data.getNumDimensions();
+        bound_size = type == KD_TREE ? num_dimensions * 2 : num_dimensions + 1;
+        
+        const GRT::UINT numSamples = data.getNumSamples();
+        
+        if (numSamples == 0)
+        {
+            return;
+        }
+        
+        order.resize(numSamples);
+        
+        for (GRT::UINT index = 0; index < numSamples; ++index)
+        {
+            order[index] = index;
+        }
+        
+        copy_points(data);
+        nodes.reserve(2 * (numSamples / leaf_size + 1));
+        nodes.resize(1);
+        build_node(0, 0, numSamples);
+        
+        // build_node() partitions the sample order, the points follow it once at the end
+        copy_points(data);
+        bounds.resize(nodes.size() * bound_size);
+        
+        inserted.resize(nodes.size());
+        
+        for (GRT::UINT node_index = 0; node_index < nodes.size(); ++node_index)
+        {
+            set_bounds(node_index);
+        }
+    }
+    
+    void spatial_index::clear()
+    {
+        nodes.clear();
+        order.clear();
+        points.clear();
+        bounds.clear();
+        inserted.clear();
+        inserted_order.clear();
+        inserted_points.clear();
+    }
+    
+    void spatial_index::copy_points(const GRT::ClassificationData &data)
+    {
+        points.resize(order.size() * num_dimensions);
+        
+        for (GRT::UINT point = 0; point < order.size(); ++point)
+        {
+            const GRT::VectorDouble &sample = data[order[point]].getSample();
+            std::copy(sample.begin(), sample.end(), points.begin() + point * num_dimensions);
+        }
+    }
+    
+    // Split at the median of the dimension with the largest spread, the same construction for both tree types
+    void spatial_index::build_node(GRT::UINT node_index, GRT::UINT begin, GRT::UINT end)
+    {
+        nodes[node_index].begin = begin;
+        nodes[node_index].end = end;
+        nodes[node_index].left = 0;
+        
+        if (end - begin <= leaf_size)
+        {
+            return;
+        }
+        
+        // points are still in sample order here
+        GRT::UINT split_dimension = 0;
+        double largest_spread = -1;
+        
+        for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+        {
+            double minimum = std::numeric_limits<double>::infinity();
+            double maximum = -minimum;
+            
+            for (GRT::UINT point = begin; point < end; ++point)
+            {
+                const double value = points[order[point] * num_dimensions + dimension];
+                minimum = std::min(minimum, value);
+                maximum = std::max(maximum, value);
+            }
+            
+            if (maximum - minimum > largest_spread)
+            {
+                largest_spread = maximum - minimum;
+                split_dimension = dimension;
+            }
+        }
+        
+        // All points are equal
+        if (largest_spread <= 0)
+        {
+            return;
+        }
+        
+        const GRT::UINT middle = begin + (end - begin) / 2;
+        const std::vector<double> &values = points;
+        const GRT::UINT stride = num_dimensions;
+        
+        std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&values, stride, split_dimension](GRT::UINT a, GRT::UINT b)
+        {
+            return values[a * stride + split_dimension] < values[b * stride + split_dimension];
+        });
+        
+        const GRT::UINT left = nodes.size();
+        
+        nodes[node_index].left = left;
+        nodes.resize(left + 2);
+        build_node(left, begin, middle);
+        build_node(left + 1, middle, end);
+    }
+    
+    void spatial_index::set_bounds(GRT::UINT node_index)
+    {
+        const GRT::UINT size = get_node_size(node_index);
+        double *bound = &bounds[node_index * bound_size];
+        
+        if (type == KD_TREE)
+        {
+            double *lower = bound;
+            double *upper = bound + num_dimensions;
+            
+            std::fill(lower, upper, std::numeric_limits<double>::infinity());
+            std::fill(upper, upper + num_dimensions, -std::numeric_limits<double>::infinity());
+            
+            for (GRT::UINT position = 0; position < size; ++position)
+            {
+                const double *values = get_point(get_node_point(node_index, position));
+                
+                for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+                {
+                    lower[dimension] = std::min(lower[dimension], values[dimension]);
+                    upper[dimension] = std::max(upper[dimension], values[dimension]);
+                }
+            }
+        }
+        else
+        {
+            double *centre = bound;
+            double &radius = bound[num_dimensions];
+            const double count = size;
+            
+            std::fill(centre, centre + num_dimensions, 0.0);
+            radius = 0;
+            
+            for (GRT::UINT position = 0; position < size; ++position)
+            {
+                const double *values = get_point(get_node_point(node_index, position));
+                
+                for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+                {
+                    centre[dimension] += values[dimension] / count;
+                }
+            }
+            
+            for (GRT::UINT position = 0; position < size; ++position)
+            {
+                radius = std::max(radius, to_distance(get_distance(centre, get_point(get_node_point(node_index, position)))));
+            }
+        }
+    }
+    
+    // Grows the bound to take in one more point, the ball keeps its centre
+    void spatial_index::extend_bounds(GRT::UINT node_index, const double *values)
+    {
+        double *bound = &bounds[node_index * bound_size];
+        
+        if (type == KD_TREE)
+        {
+            for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+            {
+                bound[dimension] = std::min(bound[dimension], values[dimension]);
+                bound[num_dimensions + dimension] = std::max(bound[num_dimensions + dimension], values[dimension]);
+            }
+        }
+        else
+        {
+            bound[num_dimensions] = std::max(bound[num_dimensions], to_distance(get_distance(bound, values)));
+        }
+    }
+    
+    void spatial_index::insert(GRT::UINT sample, const double *values)
+    {
+        const GRT::UINT point = order.size() + inserted_order.size();
+        GRT::UINT node_index = 0;
+        
+        inserted_order.push_back(sample);
+        inserted_points.insert(inserted_points.end(), values, values + num_dimensions);
+        
+        // Down to the leaf, through whichever child is nearer
+        while (true)
+        {
+            extend_bounds(node_index, values);
+            
+            const GRT::UINT left = nodes[node_index].left;
+            
+            if (left == 0)
+            {
+                break;
+            }
+            node_index = get_bound(values, left) <= get_bound(values, left + 1) ? left : left + 1;
+        }
+        
+        inserted[node_index].push_back(point);
+        
+        if (get_node_size(node_index) > leaf_size * 2)
+        {
+            split_leaf(node_index);
+        }
+    }
+    
+    // The same median split as build_node(), the children hold all their points as inserted points
+    void spatial_index::split_leaf(GRT::UINT node_index)
+    {
+        const GRT::UINT size = get_node_size(node_index);
+        std::vector<GRT::UINT> leaf_points(size);
+        GRT::UINT split_dimension = 0;
+        double largest_spread = -1;
+        
+        for (GRT::UINT position = 0; position < size; ++position)
+        {
+            leaf_points[position] = get_node_point(node_index, position);
+        }
+        
+        for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+        {
+            double minimum = std::numeric_limits<double>::infinity();
+            double maximum = -minimum;
+            
+            for (GRT::UINT position = 0; position < size; ++position)
+            {
+                const double value = get_point(leaf_points[position])[dimension];
+                minimum = std::min(minimum, value);
+                maximum = std::max(maximum, value);
+            }
+            
+            if (maximum - minimum > largest_spread)
+            {
+                largest_spread = maximum - minimum;
+                split_dimension = dimension;
+            }
+        }
+        
+        // All points are equal
+        if (largest_spread <= 0)
+        {
+            return;
+        }
+        
+        const GRT::UINT middle = size / 2;
+        
+        std::nth_element(leaf_points.begin(), leaf_points.begin() + middle, leaf_points.end(), [this, split_dimension](GRT::UINT a, GRT::UINT b)
+        {
+            return get_point(a)[split_dimension] < get_point(b)[split_dimension];
+        });
+        
+        const GRT::UINT left = nodes.size();
+        const node child = {nodes[node_index].begin, nodes[node_index].begin, 0};
+        
+        nodes[node_index].left = left;
+        nodes.push_back(child);
+        nodes.push_back(child);
+        std::vector<GRT::UINT>().swap(inserted[node_index]);
+        inserted.resize(nodes.size());
+        inserted[left].assign(leaf_points.begin(), leaf_points.begin() + middle);
+        inserted[left + 1].assign(leaf_points.begin() + middle, leaf_points.end());
+        bounds.resize(nodes.size() * bound_size);
+        set_bounds(left);
+        set_bounds(left + 1);
+    }
+    
+    double spatial_index::get_distance(const double *a, const double *b) const
+    {
+        double distance = 0;
+        
+        if (manhattan)
+        {
+            for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+            {
+                distance += std::fabs(a[dimension] - b[dimension]);
+            }
+        }
+        else
+        {
+            for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+            {
+                const double difference = a[dimension] - b[dimension];
+                distance += difference * difference;
+            }
+        }
+        
+        return distance;
+    }
+    
+    // Lower bound on the (reduced) distance from the query to any point in the node
+    double spatial_index::get_bound(const double *query, GRT::UINT node_index) const
+    {
+        const double *bound = &bounds[node_index * bound_size];
+        
+        if (type == BALL_TREE)
+        {
+            // Shrunk slightly so that rounding in the triangle inequality never prunes a point on the surface of the ball
+            const double distance = (to_distance(get_distance(query, bound)) - bound[num_dimensions]) * (1 - 1e-9);
+            return distance > 0 ? to_reduced(distance) : 0;
+        }
+        
+        const double *lower = bound;
+        const double *upper = bound + num_dimensions;
+        double distance = 0;
+        
+        for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+        {
+            const double value = query[dimension];
+            const double gap = value < lower[dimension] ? lower[dimension] - value : value > upper[dimension] ? value - upper[dimension] : 0;
+            
+            distance += manhattan ? gap : gap * gap;
+        }
+        
+        return distance;
+    }
+    
+    void spatial_index::search(const double *query, GRT::UINT k, std::vector<neighbour> &neighbours) const
+    {
+        neighbours.clear();
+        
+        if (!nodes.empty() && k > 0)
+        {
+            search_node(query, k, neighbours, 0, get_bound(query, 0));
+        }
+        
+        std::sort_heap(neighbours.begin(), neighbours.end());
+        
+        for (std::vector<neighbour>::iterator result = neighbours.begin(); result != neighbours.end(); ++result)
+        {
+            result->distance = to_distance(result->distance);
+        }
+    }
+    
+    // neighbours is a max-heap of the best k so far on the reduced distance
+    void spatial_index::search_node(const double *query, GRT::UINT k, std::vector<neighbour> &neighbours, GRT::UINT node_index, double bound) const
+    {
+        if (neighbours.size() == k && bound > neighbours.front().distance)
+        {
+            return;
+        }
+        
+        const node &node = nodes[node_index];
+        
+        if (node.left == 0)
+        {
+            const GRT::UINT size = get_node_size(node_index);
+            
+            for (GRT::UINT position = 0; position < size; ++position)
+            {
+                const GRT::UINT point = get_node_point(node_index, position);
+                neighbour candidate = {get_distance(query, get_point(point)), get_sample(point)};
+                
+                if (neighbours.size() < k)
+                {
+                    neighbours.push_back(candidate);
+                    std::push_heap(neighbours.begin(), neighbours.end());
+                }
+                else if (candidate < neighbours.front())
+                {
+                    std::pop_heap(neighbours.begin(), neighbours.end());
+                    neighbours.back() = candidate;
+                    std::push_heap(neighbours.begin(), neighbours.end());
+                }
+            }
+            return;
+        }
+        
+        // Nearest child first so the second one is more likely to be pruned
+        const double left_bound = get_bound(query, node.left);
+        const double right_bound = get_bound(query, node.left + 1);
+        
+        if (left_bound <= right_bound)
+        {
+            search_node(query, k, neighbours, node.left, left_bound);
+            search_node(query, k, neighbours, node.left + 1, right_bound);
+        }
+        else
+        {
+            search_node(query, k, neighbours, node.left + 1, right_bound);
+            search_node(query, k, neighbours, node.left, left_bound);
+        }
+    }
+    
+    bool spatial_index::save(std::fstream &file) const
+    {
+        file << "SpatialIndex: " << type << " " << manhattan << " " << nodes.size() << " " << order.size() << std::endl;
+        file << std::setprecision(std::numeric_limits<double>::max_digits10);
+        
+        for (GRT::UINT point = 0; point < order.size(); ++point)
+        {
+            file << order[point] << (point + 1 < order.size() ? " " : "\n");
+        }
+        
+        for (GRT::UINT node_index = 0; node_index < nodes.size(); ++node_index)
+        {
+            const node &node = nodes[node_index];
+            
+            file << node.begin << " " << node.end << " " << node.left;
+            
+            for (GRT::UINT index = 0; index < bound_size; ++index)
+            {
+                file << " " << bounds[node_index * bound_size + index];
+            }
+            file << "\n";
+        }
+        
+        return file.good();
+    }
+    
+    bool spatial_index::load(std::fstream &file, const GRT::ClassificationData &data)
+    {
+        std::string word;
+        int type = BRUTE_FORCE;
+        GRT::UINT num_nodes = 0;
+        GRT::UINT num_points = 0;
+        
+        clear();
+        
+        if (!(file >> word) || word != "SpatialIndex:" || !(file >> type >> manhattan >> num_nodes >> num_points))
+        {
+            return false;
+        }
+        
+        if ((type != KD_TREE && type != BALL_TREE) || num_points != data.getNumSamples())
+        {
+            return false;
+        }
+        
+        this->type = static_cast<index_type>(type);
+        num_dimensions = data.getNumDimensions();
+        bound_size = type == KD_TREE ? num_dimensions * 2 : num_dimensions + 1;
+        order.resize(num_points);
+        nodes.resize(num_nodes);
+        bounds.resize(num_nodes * bound_size);
+        inserted.resize(num_nodes);
+        
+        for (GRT::UINT point = 0; point < num_points; ++point)
+        {
+            if (!(file >> order[point]) || order[point] >= num_points)
+            {
+                clear();
+                return false;
+            }
+        }
+        
+        for (GRT::UINT node_index = 0; node_index < num_nodes; ++node_index)
+        {
+            node &node = nodes[node_index];
+            
+            if (!(file >> node.begin >> node.end >> node.left) || node.end > num_points || (node.left != 0 && node.left + 1 >= num_nodes))
+            {
+                clear();
+                return false;
+            }
+            
+            for (GRT::UINT index = 0; index < bound_size; ++index)
+            {
+                file >> bounds[node_index * bound_size + index];
+            }
+        }
+        
+        if (!file)
+        {
+            clear();
+            return false;
+        }
+        
+        copy_points(data);
+        
+        return true;
+    }
+    
+    void hnsw_index::clear()
+    {
+        points.clear();
+        levels.clear();
+        base_links.clear();
+        upper_links.clear();
+        visited.clear();
+        entry_point = 0;
+        max_level = 0;
+    }
+    
+    void hnsw_index::build(const GRT::ClassificationData &data, GRT::UINT distance_method, GRT::UINT max_connections)
+    {
+        clear();
+        
+        const GRT::UINT numSamples = data.getNumSamples();
+        
+        manhattan = distance_method == GRT::KNN::MANHATTAN_DISTANCE;
+        num_dimensions = data.getNumDimensions();
+        this->max_connections = max_connections;
+        points.resize(numSamples * num_dimensions);
+        levels.resize(numSamples);
+        base_links.assign(numSamples * (max_connections * 2 + 1), 0);
+        upper_links.resize(numSamples);
+        visited.assign(numSamples, 0);
+        visit_tag = 0;
+        
+        for (GRT::UINT sample = 0; sample < numSamples; ++sample)
+        {
+            const GRT::VectorDouble &values = data[sample].getSample();
+            std::copy(values.begin(), values.end(), points.begin() + sample * num_dimensions);
+        }
+        
+        // Fixed seed so the same data always gives the same graph
+        random.seed(1);
+        
+        for (GRT::UINT sample = 0; sample < numSamples; ++sample)
+        {
+            insert(sample, get_random_level());
+        }
+    }
+    
+    void hnsw_index::add(const double *values)
+    {
+        const GRT::UINT point = levels.size();
+        
+        points.insert(points.end(), values, values + num_dimensions);
+        levels.push_back(0);
+        base_links.resize(base_links.size() + max_connections * 2 + 1, 0);
+        upper_links.resize(point + 1);
+        visited.push_back(0);
+        insert(point, get_random_level());
+    }
+    
+    // Levels are exponentially distributed so that each level holds about 1 / max_connections of the points below it
+    GRT::UINT hnsw_index::get_random_level()
+    {
+        const double level_scale = 1 / std::log(static_cast<double>(std::max<GRT::UINT>(max_connections, 2)));
+        const double uniform = (random() + 1.0) / (static_cast<double>(std::mt19937::max()) + 2.0);
+        
+        return static_cast<GRT::UINT>(-std::log(uniform) * level_scale);
+    }
+    
+    GRT::UINT *hnsw_index::get_links(GRT::UINT point, GRT::UINT level)
+    {
+        if (level == 0)
+        {
+            return &base_links[point * (max_connections * 2 + 1)];
+        }
+        return &upper_links[point][(level - 1) * (max_connections + 1)];
+    }
+    
+    const GRT::UINT *hnsw_index::get_links(GRT::UINT point, GRT::UINT level) const
+    {
+        return const_cast<hnsw_index *>(this)->get_links(point, level);
+    }
+    
+    double hnsw_index::get_distance(const double *a, const double *b) const
+    {
+        double distance = 0;
+        
+        if (manhattan)
+        {
+            for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+            {
+                distance += std::fabs(a[dimension] - b[dimension]);
+            }
+        }
+        else
+        {
+            for (GRT::UINT dimension = 0; dimension < num_dimensions; ++dimension)
+            {
+                const double difference = a[dimension] - b[dimension];
+                distance += difference * difference;
+            }
+        }
+        
+        return distance;
+    }
+    
+    void hnsw_index::insert(GRT::UINT point, GRT::UINT level)
+    {
+        const double *query = get_point(point);
+        
+        levels[point] = level;
+        upper_links[point].assign(level * (max_connections + 1), 0);
+        
+        if (point == 0)
+        {
+            entry_point = point;
+            max_level = level;
+            return;
+        }
+        
+        GRT::UINT nearest = entry_point;
+        double distance = get_distance(query, get_point(nearest));
+        
+        for (GRT::UINT upper = max_level; upper > level; --upper)
+        {
+            nearest = search_greedy(query, nearest, distance, upper);
+        }
+        
+        std::vector<candidate> results;
+        
+        for (GRT::UINT current = std::min(level, max_level) + 1; current-- > 0;)
+        {
+            results.assign(1, candidate(distance, nearest));
+            search_layer(query, ef_construction, current, results);
+            std::sort(results.begin(), results.end());
+            nearest = results.front().second;
+            distance = results.front().first;
+            
+            const GRT::UINT max_links = get_max_links(current);
+            
+            select_neighbours(results, max_connections);
+            
+            GRT::UINT *links = get_links(point, current);
+            links[0] = results.size();
+            
+            for (GRT::UINT index = 0; index < results.size(); ++index)
+            {
+                const GRT::UINT neighbour = results[index].second;
+                GRT::UINT *neighbour_links = get_links(neighbour, current);
+                
+                links[index + 1] = neighbour;
+                
+                if (neighbour_links[0] < max_links)
+                {
+                    neighbour_links[++neighbour_links[0]] = point;
+                    continue;
+                }
+                
+                // The neighbour is full, keep the most diverse of its links and the new one
+                std::vector<candidate> shrink;
+                const double *neighbour_point = get_point(neighbour);
+                
+                shrink.push_back(candidate(get_distance(neighbour_point, query), point));
+                
+                for (GRT::UINT link = 1; link <= neighbour_links[0]; ++link)
+                {
+                    shrink.push_back(candidate(get_distance(neighbour_point, get_point(neighbour_links[link])), neighbour_links[link]));
+                }
+                
+                std::sort(shrink.begin(), shrink.end());
+                select_neighbours(shrink, max_links);
+                neighbour_links[0] = shrink.size();
+                
+                for (GRT::UINT link = 0; link < shrink.size(); ++link)
+                {
+                    neighbour_links[link + 1] = shrink[link].second;
+                }
+            }
+        }
+        
+        if (level > max_level)
+        {
+            entry_point = point;
+            max_level = level;
+        }
+    }
+    
+    GRT::UINT hnsw_index::search_greedy(const double *query, GRT::UINT point, double &distance, GRT::UINT level)
+    {
+        bool changed = true;
+        
+        while (changed)
+        {
+            changed = false;
+            
+            const GRT::UINT *links = get_links(point, level);
+            
+            for (GRT::UINT link = 1; link <= links[0]; ++link)
+            {
+                const double link_distance = get_distance(query, get_point(links[link]));
+                
+                if (link_distance < distance)
+                {
+                    distance = link_distance;
+                    point = links[link];
+                    changed = true;
+                }
+            }
+        }
+        
+        return point;
+    }
+    
+    // Best first search from the points in results, which returns the ef nearest points found as a max-heap
+    void hnsw_index::search_layer(const double *query, GRT::UINT ef, GRT::UINT level, std::vector<candidate> &results)
+    {
+        if (++visit_tag == 0)
+        {
+            std::fill(visited.begin(), visited.end(), 0);
+            visit_tag = 1;
+        }
+        
+        // Negated distances turn the max-heap into the min-heap of points still to expand
+        candidates.clear();
+        
+        for (std::vector<candidate>::const_iterator result = results.begin(); result != results.end(); ++result)
+        {
+            visited[result->second] = visit_tag;
+            candidates.push_back(candidate(-result->first, result->second));
+        }
+        
+        std::make_heap(results.begin(), results.end());
+        std::make_heap(candidates.begin(), candidates.end());
+        
+        while (!candidates.empty())
+        {
+            const candidate closest = candidates.front();
+            
+            if (-closest.first > results.front().first && results.size() >= ef)
+            {
+                break;
+            }
+            
+            std::pop_heap(candidates.begin(), candidates.end());
+            candidates.pop_back();
+            
+            const GRT::UINT *links = get_links(closest.second, level);
+            
+            for (GRT::UINT link = 1; link <= links[0]; ++link)
+            {
+                const GRT::UINT point = links[link];
+                
+                if (visited[point] == visit_tag)
+                {
+                    continue;
+                }
+                visited[point] = visit_tag;
+                
+                const double distance = get_distance(query, get_point(point));
+                
+                if (results.size() < ef || distance < results.front().first)
+                {
+                    candidates.push_back(candidate(-distance, point));
+                    std::push_heap(candidates.begin(), candidates.end());
+                    results.push_back(candidate(distance, point));
+                    std::push_heap(results.begin(), results.end());
+                    
+                    if (results.size() > ef)
+                    {
+                        std::pop_heap(results.begin(), results.end());
+                        results.pop_back();
+                    }
+                }
+            }
+        }
+    }
+    
+    // The neighbour selection heuristic: candidates sorted nearest first are kept unless an already kept one is closer to them than the base point is
+    void hnsw_index::select_neighbours(std::vector<candidate> &candidates, GRT::UINT max_links) const
+    {
+        GRT::UINT selected = 0;
+        
+        for (GRT::UINT index = 0; index < candidates.size() && selected < max_links; ++index)
+        {
+            const double *point = get_point(candidates[index].second);
+            bool diverse = true;
+            
+            for (GRT::UINT kept = 0; kept < selected && diverse; ++kept)
+            {
+                diverse = get_distance(point, get_point(candidates[kept].second)) >= candidates[index].first;
+            }
+            
+            if (diverse)
+            {
+                candidates[selected++] = candidates[index];
+            }
+        }
+        
+        candidates.resize(selected);
+    }
+    
+    void hnsw_index::search(const double *query, GRT::UINT k, std::vector<spatial_index::neighbour> &neighbours)
+    {
+        neighbours.clear();
+        
+        if (levels.empty() || k == 0)
+        {
+            return;
+        }
+        
+        GRT::UINT nearest = entry_point;
+        double distance = get_distance(query, get_point(nearest));
+        
+        for (GRT::UINT level = max_level; level > 0; --level)
+        {
+            nearest = search_greedy(query, nearest, distance, level);
+        }
+        
+        std::vector<candidate> results(1, candidate(distance, nearest));
+        
+        search_layer(query, std::max(ef_search, k), 0, results);
+        std::sort(results.begin(), results.end());
+        
+        for (GRT::UINT index = 0; index < results.size() && index < k; ++index)
+        {
+            spatial_index::neighbour neighbour = {to_distance(results[index].first), results[index].second};
+            neighbours.push_back(neighbour);
+        }
+    }
+    
+    void hnsw_index::search_exact(const double *query, GRT::UINT k, std::vector<spatial_index::neighbour> &neighbours) const
+    {
+        neighbours.clear();
+        
+        for (GRT::UINT point = 0; point < levels.size(); ++point)
+        {
+            spatial_index::neighbour candidate = {get_distance(query, get_point(point)), point};
+            
+            if (neighbours.size() < k)
+            {
+                neighbours.push_back(candidate);
+                std::push_heap(neighbours.begin(), neighbours.end());
+            }
+            else if (candidate < neighbours.front())
+            {
+                std::pop_heap(neighbours.begin(), neighbours.end());
+                neighbours.back() = candidate;
+                std::push_heap(neighbours.begin(), neighbours.end());
+            }
+        }
+        
+        std::sort_heap(neighbours.begin(), neighbours.end());
+        
+        for (std::vector<spatial_index::neighbour>::iterator neighbour = neighbours.begin(); neighbour != neighbours.end(); ++neighbour)
+        {
+            neighbour->distance = to_distance(neighbour->distance);
+        }
+    }
+    
+    bool hnsw_index::save(std::fstream &file) const
+    {
+        file << "HNSW: " << manhattan << " " << max_connections << " " << ef_search << " " << entry_point << " " << max_level << " " << levels.size() << std::endl;
+        
+        for (GRT::UINT point = 0; point < levels.size(); ++point)
+        {
+            file << levels[point];
+            
+            for (GRT::UINT level = 0; level <= levels[point]; ++level)
+            {
+                const GRT::UINT *links = get_links(point, level);
+                
+                for (GRT::UINT link = 0; link <= links[0]; ++link)
+                {
+                    file << " " << links[link];
+                }
+            }
+            file << "\n";
+        }
+        
+        return file.good();
+    }
+    
+    bool hnsw_index::load(std::fstream &file, const GRT::ClassificationData &data)
+    {
+        std::string word;
+        GRT::UINT num_points = 0;
+        
+        clear();
+        
+        if (!(file >> word) || word != "HNSW:" || !(file >> manhattan >> max_connections >> ef_search >> entry_point >> max_level >> num_points))
+        {
+            return false;
+        }
+        
+        if (num_points != data.getNumSamples() || entry_point >= std::max<GRT::UINT>(num_points, 1) || max_connections == 0)
+        {
+            return false;
+        }
+        
+        // The points come from the training data, which is saved by GRT
+        num_dimensions = data.getNumDimensions();
+        points.resize(num_points * num_dimensions);
+        levels.resize(num_points);
+        base_links.assign(num_points * (max_connections * 2 + 1), 0);
+        upper_links.resize(num_points);
+        visited.assign(num_points, 0);
+        visit_tag = 0;
+        random.seed(num_points + 1);
+        
+        for (GRT::UINT point = 0; point < num_points; ++point)
+        {
+            const GRT::VectorDouble &values = data[point].getSample();
+            std::copy(values.begin(), values.end(), points.begin() + point * num_dimensions);
+            
+            if (!(file >> levels[point]) || levels[point] > max_level)
+            {
+                clear();
+                return false;
+            }
+            
+            upper_links[point].assign(levels[point] * (max_connections + 1), 0);
+            
+            for (GRT::UINT level = 0; level <= levels[point]; ++level)
+            {
+                GRT::UINT *links = get_links(point, level);
+                
+                if (!(file >> links[0]) || links[0] > get_max_links(level))
+                {
+                    clear();
+                    return false;
+                }
+                
+                for (GRT::UINT link = 1; link <= links[0]; ++link)
+                {
+                    if (!(file >> links[link]) || links[link] >= num_points)
+                    {
+                        clear();
+                        return false;
+                    }
+                }
+            }
+        }
+        
+        return true;
+    }
+    
+    bool indexed_knn::deepCopyFrom(const GRT::Classifier *classifier)
+    {
+        if (!GRT::KNN::deepCopyFrom(classifier))
+        {
+            return false;
+        }
+        
+        const indexed_knn *source = dynamic_cast<const indexed_knn *>(classifier);
+        
+        if (source != NULL)
+        {
+            index_type = source->index_type;
+            approximate = source->approximate;
+            max_connections = source->max_connections;
+            index = source->index;
+            graph = source->graph;
+            sample_classes = source->sample_classes;
+        }
+        else
+        {
+            index.clear();
+            graph.clear();
+            sample_classes.clear();
+        }
+        
+        return true;
+    }
+    
+    bool indexed_knn::train_(GRT::ClassificationData &trainingData)
+    {
+        index.clear();
+        graph.clear();
+        
+        GRT::UINT best_k = 0;
+        
+        if (searchForBestKValue && search_best_k(trainingData, best_k))
+        {
+            // The search is done, GRT only has to train with the k it found
+            searchForBestKValue = false;
+            K = best_k;
+            
+            const bool success = GRT::KNN::train_(trainingData);
+            
+            searchForBestKValue = true;
+            
+            if (!success)
+            {
+                return false;
+            }
+        }
+        else if (!GRT::KNN::train_(trainingData))
+        {
+            return false;
+        }
+        
+        build_index();
+        
+        return true;
+    }
+    
+    // Builds from the stored training data, which GRT has already scaled
+    void indexed_knn::build_index()
+    {
+        const GRT::UINT distance_method = getDistanceMethod();
+        spatial_index::index_type type = index_type;
+        
+        index.clear();
+        graph.clear();
+        prepare_sample_classes();
+        
+        if (distance_method == GRT::KNN::COSINE_DISTANCE || trainingData.getNumSamples() <= spatial_index::leaf_size)
+        {
+            return;
+        }
+        
+        if (approximate)
+        {
+            graph.build(trainingData, distance_method, max_connections);
+            return;
+        }
+        
+        if (type == spatial_index::BRUTE_FORCE)
+        {
+            return;
+        }
+        
+        // Bounding boxes stop pruning well at a few tens of dimensions, balls degrade more gracefully
+        if (type == spatial_index::AUTOMATIC)
+        {
+            type = trainingData.getNumDimensions() <= 16 ? spatial_index::KD_TREE : spatial_index::BALL_TREE;
+        }
+        
+        index.build(trainingData, type, distance_method);
+    }
+    
+    // GRT retrains and re-evaluates the validation set for every k, here each validation sample is searched once for the largest k and every k is scored from that one sorted list
+    bool indexed_knn::search_best_k(const GRT::ClassificationData &trainingData, GRT::UINT &best_k) const
+    {
+        const GRT::UINT distance_method = getDistanceMethod();
+        
+        // GRT's own search is left to handle these: the null rejection thresholds depend on k, and the cosine distance has no index
+        if (useNullRejection || distance_method == GRT::KNN::COSINE_DISTANCE || minKSearchValue == 0 || minKSearchValue > maxKSearchValue)
+        {
+            return false;
+        }
+        
+        // The same scaling and 80 / 20 split as GRT
+        GRT::ClassificationData training_set(trainingData);
+        
+        if (useScaling)
+        {
+            training_set.scale(0, 1);
+        }
+        
+        const GRT::ClassificationData validation_set = training_set.partition(80, true);
+        const GRT::UINT numTraining = training_set.getNumSamples();
+        const GRT::UINT numValidation = validation_set.getNumSamples();
+        const GRT::UINT max_k = std::min(maxKSearchValue, numTraining);
+        
+        if (numValidation == 0 || minKSearchValue > max_k)
+        {
+            return false;
+        }
+        
+        const GRT::Vector<GRT::UINT> labels = trainingData.getClassLabels();
+        std::vector<GRT::UINT> training_classes(numTraining);
+        
+        for (GRT::UINT sample = 0; sample < numTraining; ++sample)
+        {
+            training_classes[sample] = std::find(labels.begin(), labels.end(), training_set[sample].getClassLabel()) - labels.begin();
+        }
+        
+        spatial_index search_index;
+        search_index.build(training_set, training_set.getNumDimensions() <= 16 ? spatial_index::KD_TREE : spatial_index::BALL_TREE, distance_method);
+        
+        thread_pool pool;
+        pool.set_num_threads(std::max(1U, std::thread::hardware_concurrency()));
+        
+        const GRT::UINT num_threads = pool.get_num_threads();
+        std::vector<std::vector<spatial_index::neighbour> > neighbours(num_threads);
+        std::vector<std::vector<GRT::UINT> > votes(num_threads, std::vector<GRT::UINT>(labels.size()));
+        std::vector<std::vector<GRT::UINT> > correct(num_threads, std::vector<GRT::UINT>(max_k + 1, 0));
+        const GRT::UINT min_k = minKSearchValue;
+        
+        pool.parallel_for(numValidation, [&](size_t sample, unsigned thread)
+        {
+            std::vector<spatial_index::neighbour> &sample_neighbours = neighbours[thread];
+            std::vector<GRT::UINT> &counts = votes[thread];
+            const GRT::UINT label = validation_set[sample].getClassLabel();
+            GRT::UINT best = 0;
+            
+            search_index.search(validation_set[sample].getSample().data(), max_k, sample_neighbours);
+            std::fill(counts.begin(), counts.end(), 0);
+            
+            // Adding one neighbour at a time gives the vote for each k in turn, ties go to the first class as in GRT
+            for (GRT::UINT k = 1; k <= sample_neighbours.size(); ++k)
+            {
+                const GRT::UINT class_index = training_classes[sample_neighbours[k - 1].index];
+                
+                if (++counts[class_index] > counts[best] || (counts[class_index] == counts[best] && class_index < best))
+                {
+                    best = class_index;
+                }
+                
+                if (k >= min_k && labels[best] == label)
+                {
+                    ++correct[thread][k];
+                }
+            }
+        });
+        
+        // The smallest k with the best accuracy, as GRT picks it
+        GRT::UINT best_correct = 0;
+        
+        for (GRT::UINT k = min_k; k <= max_k; ++k)
+        {
+            GRT::UINT total = 0;
+            
+            for (GRT::UINT thread = 0; thread < num_threads; ++thread)
+            {
+                total += correct[thread][k];
+            }
+            
+            if (total > best_correct)
+            {
+                best_correct = total;
+                best_k = k;
+            }
+        }
+        
+        return best_correct > 0;
+    }
+    
+    void indexed_knn::prepare_sample_classes()
+    {
+        sample_classes.resize(trainingData.getNumSamples());
+        
+        for (GRT::UINT sample = 0; sample < sample_classes.size(); ++sample)
+        {
+            const GRT::UINT label = trainingData[sample].getClassLabel();
+            sample_classes[sample] = std::find(classLabels.begin(), classLabels.end(), label) - classLabels.begin();
+        }
+    }
+    
+    // The same vote as GRT::KNN::predict(), with the neighbours found through the index
+    bool indexed_knn::predict_(GRT::VectorDouble &inputVector)
+    {
+        if (!trained || (index.empty() && graph.empty()))
+        {
+            return GRT::KNN::predict_(inputVector);
+        }
+        
+        if (inputVector.size() != numInputDimensions)
+        {
+            errorLog << "predict_(VectorDouble &inputVector) - the size of the input vector does not match the number of features" << std::endl;
+            return false;
+        }
+        
+        if (K > trainingData.getNumSamples())
+        {
+            errorLog << "predict_(VectorDouble &inputVector) - K is greater than the number of training samples" << std::endl;
+            return false;
+        }
+        
+        if (useScaling)
+        {
+            for (GRT::UINT dimension = 0; dimension < numInputDimensions; ++dimension)
+            {
+                const GRT::MinMax &range = ranges[dimension];
+                inputVector[dimension] = range.minValue == range.maxValue ? 0 : (inputVector[dimension] - range.minValue) / (range.maxValue - range.minValue);
+            }
+        }
+        
+        if (graph.empty())
+        {
+            index.search(inputVector.data(), K, neighbours);
+        }
+        else
+        {
+            graph.search(inputVector.data(), K, neighbours);
+        }
+        
+        classLikelihoods.resize(numClasses);
+        classDistances.resize(numClasses);
+        std::fill(classLikelihoods.begin(), classLikelihoods.end(), 0.0);
+        std::fill(classDistances.begin(), classDistances.end(), 0.0);
+        
+        for (std::vector<spatial_index::neighbour>::const_iterator neighbour = neighbours.begin(); neighbour != neighbours.end(); ++neighbour)
+        {
+            const GRT::UINT class_index = sample_classes[neighbour->index];
+            classLikelihoods[class_index]++;
+            classDistances[class_index] += neighbour->distance;
+        }
+        
+        GRT::UINT max_index = 0;
+        
+        for (GRT::UINT class_index = 1; class_index < numClasses; ++class_index)
+        {
+            if (classLikelihoods[class_index] > classLikelihoods[max_index])
+            {
+                max_index = class_index;
+            }
+        }
+        
+        for (GRT::UINT class_index = 0; class_index < numClasses; ++class_index)
+        {
+            // GRT's BIG_DISTANCE for classes without a neighbour
+            classDistances[class_index] = classLikelihoods[class_index] > 0 ? classDistances[class_index] / classLikelihoods[class_index] : 99e+99;
+            classLikelihoods[class_index] /= neighbours.size();
+        }
+        
+        maxLikelihood = classLikelihoods[max_index];
+        predictedClassLabel = classLabels[max_index];
+        
+        if (useNullRejection && classDistances[max_index] > nullRejectionThresholds[max_index])
+        {
+            predictedClassLabel = GRT_DEFAULT_NULL_CLASS_LABEL;
+        }
+        
+        return true;
+    }
+    
+    bool indexed_knn::save(std::fstream &file) const
+    {
+        if (!GRT::KNN::save(file))
+        {
+            return false;
+        }
+        
+        // An empty index is saved as brute force so that loading doesn't rebuild it
+        if (index.empty())
+        {
+            file << "SpatialIndex: " << spatial_index::BRUTE_FORCE << std::endl;
+        }
+        else if (index.has_inserted())
+        {
+            spatial_index rebuilt;
+            rebuilt.build(trainingData, index.get_type(), getDistanceMethod());
+            
+            if (!rebuilt.save(file))
+            {
+                return false;
+            }
+        }
+        else if (!index.save(file))
+        {
+            return false;
+        }
+        
+        return graph.empty() ? file.good() : graph.save(file);
+    }
+    
+    bool indexed_knn::load(std::fstream &file)
+    {
+        if (!GRT::KNN::load(file))
+        {
+            return false;
+        }
+        
+        std::streampos position = file.tellg();
+        std::string word;
+        int type = spatial_index::BRUTE_FORCE;
+        
+        index.clear();
+        graph.clear();
+        prepare_sample_classes();
+        
+        // Models saved without an index get one built now
+        if (!(file >> word >> type) || word != "SpatialIndex:")
+        {
+            file.clear();
+            build_index();
+            return true;
+        }
+        
+        if (type != spatial_index::BRUTE_FORCE)
+        {
+            file.seekg(position);
+            
+            if (!index.load(file, trainingData))
+            {
+                return false;
+            }
+        }
+        
+        position = file.tellg();
+        
+        if (file >> word && word == "HNSW:")
+        {
+            file.seekg(position);
+            
+            if (!graph.load(file, trainingData))
+            {
+                return false;
+            }
+            approximate = true;
+            max_connections = graph.get_max_connections();
+        }
+        
+        file.clear();
+        
+        return true;
+    }
+    
+    bool indexed_knn::clear()
+    {
+        index.clear();
+        graph.clear();
+        sample_classes.clear();
+        
+        return GRT::KNN::clear();
+    }
+    
+    bool indexed_knn::add_sample(GRT::UINT label, const GRT::VectorDouble &sample, bool &labels_changed)
+    {
+        labels_changed = false;
+        
+        if (!trained || sample.size() != numInputDimensions)
+        {
+            return false;
+        }
+        
+        GRT::UINT class_index = std::find(classLabels.begin(), classLabels.end(), label) - classLabels.begin();
+        
+        if (class_index == numClasses)
+        {
+            // The null rejection threshold of a new class can only come from training
+            if (useNullRejection)
+            {
+                return false;
+            }
+            
+            classLabels.push_back(label);
+            nullRejectionThresholds.resize(++numClasses);
+            labels_changed = true;
+        }
+        
+        GRT::VectorDouble values(sample);
+        
+        if (useScaling)
+        {
+            for (GRT::UINT dimension = 0; dimension < numInputDimensions; ++dimension)
+            {
+                const GRT::MinMax &range = ranges[dimension];
+                values[dimension] = range.minValue == range.maxValue ? 0 : (values[dimension] - range.minValue) / (range.maxValue - range.minValue);
+            }
+        }
+        
+        const GRT::UINT sample_index = trainingData.getNumSamples();
+        
+        trainingData.addSample(label, values);
+        sample_classes.push_back(class_index);
+        
+        if (!graph.empty())
+        {
+            graph.add(values.data());
+        }
+        else if (!index.empty())
+        {
+            index.insert(sample_index, values.data());
+            
+            if (index.needs_rebuild())
+            {
+                build_index();
+            }
+        }
+        else if (trainingData.getNumSamples() == spatial_index::leaf_size + 1)
+        {
+            // Models too small for an index get one as soon as they are big enough
+            build_index();
+        }
+        
+        return true;
+    }
+    
+    bool indexed_knn::get_recall(GRT::UINT num_queries, const std::vector<GRT::UINT> &ef_search_values, std::vector<double> &recall, std::vector<double> &approximate_time, double &exact_time)
+    {
+        const GRT::UINT numSamples = trainingData.getNumSamples();
+        
+        if (!trained || graph.empty() || numSamples < K)
+        {
+            return false;
+        }
+        
+        const GRT::UINT ef_search = graph.get_ef_search();
+        std::vector<double> queries(num_queries * numInputDimensions);
+        std::vector<GRT::UINT> exact(num_queries * K);
+        std::mt19937 random(1);
+        
+        for (GRT::UINT query = 0; query < num_queries; ++query)
+        {
+            const double *a = graph.get_point(random() % numSamples);
+            const double *b = graph.get_point(random() % numSamples);
+            
+            for (GRT::UINT dimension = 0; dimension < numInputDimensions; ++dimension)
+            {
+                queries[query * numInputDimensions + dimension] = (a[dimension] + b[dimension]) / 2;
+            }
+        }
+        
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        
+        for (GRT::UINT query = 0; query < num_queries; ++query)
+        {
+            graph.search_exact(&queries[query * numInputDimensions], K, neighbours);
+            
+            for (GRT::UINT neighbour = 0; neighbour < K; ++neighbour)
+            {
+                exact[query * K + neighbour] = neighbours[neighbour].index;
+            }
+            std::sort(exact.begin() + query * K, exact.begin() + (query + 1) * K);
+        }
+        
+        exact_time = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / num_queries;
+        recall.resize(ef_search_values.size());
+        approximate_time.resize(ef_search_values.size());
+        
+        for (GRT::UINT value = 0; value < ef_search_values.size(); ++value)
+        {
+            GRT::UINT found = 0;
+            double elapsed = 0;
+            
+            graph.set_ef_search(ef_search_values[value]);
+            
+            for (GRT::UINT query = 0; query < num_queries; ++query)
+            {
+                start = std::chrono::steady_clock::now();
+                graph.search(&queries[query * numInputDimensions], K, neighbours);
+                elapsed += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+                
+                for (std::vector<spatial_index::neighbour>::const_iterator neighbour = neighbours.begin(); neighbour != neighbours.end(); ++neighbour)
+                {
+                    found += std::binary_search(exact.begin() + query * K, exact.begin() + (query + 1) * K, neighbour->index);
+                }
+            }
+            
+            recall[value] = static_cast<double>(found) / (num_queries * K);
+            approximate_time[value] = elapsed / num_queries;
+        }
+        
+        graph.set_ef_search(ef_search);
+        
+        return true;
+    }
+    
     class knn : classification
     {
         FLEXT_HEADER_S(knn, classification, setup);
         
     public:
         knn()
+        : num_added(0), active_added(0), retired_added(0), spare_added(0), added_generation(0)
         {
             post("Support Vector Machines based on the GRT library version " + GRT::GRTBase::getGRTVersion());
             set_scaling(defaults::scaling);
@@ -43,12 +1691,22 @@ namespace ml
             FLEXT_CADDATTR_SET(c, "min_k_search_value", set_min_k_search_value);
             FLEXT_CADDATTR_SET(c, "max_k_search_value", set_max_k_search_value);
             FLEXT_CADDATTR_SET(c, "best_k_value_search", set_best_k_value_search);
+            FLEXT_CADDATTR_SET(c, "index", set_index);
+            FLEXT_CADDATTR_SET(c, "approximate", set_approximate);
+            FLEXT_CADDATTR_SET(c, "ef_search", set_ef_search);
+            FLEXT_CADDATTR_SET(c, "M", set_max_connections);
             
             // Flext attribute get messages
             FLEXT_CADDATTR_GET(c, "k", get_k);
             FLEXT_CADDATTR_GET(c, "min_k_search_value", get_min_k_search_value);
             FLEXT_CADDATTR_GET(c, "max_k_search_value", get_max_k_search_value);
             FLEXT_CADDATTR_GET(c, "best_k_value_search", get_best_k_value_search);
+            FLEXT_CADDATTR_GET(c, "index", get_index);
+            FLEXT_CADDATTR_GET(c, "approximate", get_approximate);
+            FLEXT_CADDATTR_GET(c, "ef_search", get_ef_search);
+            FLEXT_CADDATTR_GET(c, "M", get_max_connections);
+            
+            FLEXT_CADDMETHOD_(c, 0, "recall", recall);
             
             // Associate this Flext class with a certain help file prefix
             DefineHelp(c, object_name.c_str());
@@ -59,28 +1717,68 @@ namespace ml
         void set_min_k_search_value(int min_k_search_value);
         void set_max_k_search_value(int max_k_search_value);
         void set_best_k_value_search(bool best_k_value_search);
+        void set_index(int index);
+        void set_approximate(bool approximate);
+        void set_ef_search(int ef_search);
+        void set_max_connections(int max_connections);
         
         // Flext attribute getters
         void get_k(int &k) const;
         void get_min_k_search_value(int &min_k_search_value) const;
         void get_max_k_search_value(int &max_k_search_value) const;
         void get_best_k_value_search(bool &best_k_value_search) const;
+        void get_index(int &index) const;
+        void get_approximate(bool &approximate) const;
+        void get_ef_search(int &ef_search) const;
+        void get_max_connections(int &max_connections) const;
+        
+        // Methods
+        void add(int argc, const t_atom *argv);
+        void recall(int argc, const t_atom *argv);
         
+        GRT::MLBase *copy_MLBase_instance(const GRT::MLBase &instance) const;
         // Pure virtual method implementations
         GRT::Classifier &get_Classifier_instance();
         const GRT::Classifier &get_Classifier_instance() const;
         
+        bool changes_prediction(const t_symbol *s) const;
+        
     private:
+        // A sample added to the trained model by 'add'
+        struct added_sample
+        {
+            GRT::UINT label;
+            GRT::VectorDouble values;
+        };
+        
+        void publish_added_sample(GRT::UINT label, const GRT::VectorDouble &values);
+        
+        // Flext method wrappers
+        FLEXT_CALLBACK_V(recall);
+        
         // Flext Flext attribute wrappers
         FLEXT_CALLVAR_I(get_k, set_k);
         FLEXT_CALLVAR_I(get_min_k_search_value, set_min_k_search_value);
         FLEXT_CALLVAR_I(get_max_k_search_value, set_max_k_search_value);
         FLEXT_CALLVAR_B(get_best_k_value_search, set_best_k_value_search);
+        FLEXT_CALLVAR_I(get_index, set_index);
+        FLEXT_CALLVAR_B(get_approximate, set_approximate);
+        FLEXT_CALLVAR_I(get_ef_search, set_ef_search);
+        FLEXT_CALLVAR_I(get_max_connections, set_max_connections);
         
         // Virtual method override
         virtual const std::string get_object_name(void) const { return object_name; };
         
-        GRT::KNN grt_knn;
+        indexed_knn grt_knn;
+        
+        // The last samples added to the staging model, and how many had been added when each of the models kept by
+        // publish_MLBase_instance() was published, 0 if it wasn't published by 'add'
+        std::deque<added_sample> added_samples;
+        uint64_t num_added;
+        uint64_t active_added;
+        uint64_t retired_added;
+        uint64_t spare_added;
+        uint32_t added_generation; // the active generation after the last publish by 'add'
     };
     
     // Flext attribute setters
@@ -104,6 +1802,44 @@ namespace ml
         grt_knn.enableBestKValueSearch(best_k_value_search);
     }
     
+    void knn::set_index(int index)
+    {
+        if (index < 0 || index >= spatial_index::NUM_INDEX_TYPES)
+        {
+            error("index must be between 0 and " + std::to_string(spatial_index::NUM_INDEX_TYPES - 1));
+            return;
+        }
+        
+        grt_knn.set_index_type(static_cast<spatial_index::index_type>(index));
+    }
+    
+    void knn::set_approximate(bool approximate)
+    {
+        grt_knn.set_approximate(approximate);
+    }
+    
+    void knn::set_ef_search(int ef_search)
+    {
+        if (ef_search < 1)
+        {
+            error("ef_search must be 1 or greater");
+            return;
+        }
+        
+        grt_knn.set_ef_search(ef_search);
+    }
+    
+    void knn::set_max_connections(int max_connections)
+    {
+        if (max_connections < 2)
+        {
+            error("M must be 2 or greater");
+            return;
+        }
+        
+        grt_knn.set_max_connections(max_connections);
+    }
+    
     // Flext attribute getters
     void knn::get_k(int &k) const
     {
@@ -125,6 +1861,151 @@ namespace ml
         flext::error("function not implemented");
     }
     
+    void knn::get_index(int &index) const
+    {
+        index = grt_knn.get_index_type();
+    }
+    
+    void knn::get_approximate(bool &approximate) const
+    {
+        approximate = grt_knn.get_approximate();
+    }
+    
+    void knn::get_ef_search(int &ef_search) const
+    {
+        ef_search = grt_knn.get_ef_search();
+    }
+    
+    void knn::get_max_connections(int &max_connections) const
+    {
+        max_connections = grt_knn.get_max_connections();
+    }
+    
+    // Methods
+    
+    // Samples added to a trained model go straight into the staging and active models, 'train' still rebuilds from the whole dataset
+    void knn::add(int argc, const t_atom *argv)
+    {
+        const GRT::UINT numSamples = classification_data.getNumSamples();
+        
+        classification::add(argc, argv);
+        
+        // A 'train' in progress will replace the staging model with one trained on the dataset as it was when it started
+        if (classification_data.getNumSamples() != numSamples + 1 || get_staging_busy() || !grt_knn.getTrained())
+        {
+            return;
+        }
+        
+        const GRT::ClassificationSample &sample = classification_data[numSamples];
+        bool labels_changed = false;
+        
+        if (!grt_knn.add_sample(sample.getClassLabel(), sample.getSample(), labels_changed))
+        {
+            post("sample added to the dataset only, send 'train' to add it to the model");
+            return;
+        }
+        
+        publish_added_sample(sample.getClassLabel(), sample.getSample());
+    }
+    
+    // 'map' may be using the active model, so it is never changed in place. The spare model, published three adds ago, is brought up to
+    // date with the samples added since, which costs what adding them to the staging model did, and published instead. After a 'train'
+    // or anything else that published a model the spare is of unknown age, and the first few adds copy the staging model
+    void knn::publish_added_sample(GRT::UINT label, const GRT::VectorDouble &values)
+    {
+        static const size_t max_added_samples = 3;
+        
+        if (get_active_generation() != added_generation)
+        {
+            active_added = retired_added = spare_added = 0;
+            added_samples.clear();
+        }
+        
+        added_sample sample = {label, values};
+        
+        added_samples.push_back(sample);
+        ++num_added;
+        
+        if (added_samples.size() > max_added_samples)
+        {
+            added_samples.pop_front();
+        }
+        
+        indexed_knn *instance = static_cast<indexed_knn *>(take_spare_MLBase_instance());
+        bool updated = instance != NULL && spare_added != 0 && num_added - spare_added <= added_samples.size();
+        
+        for (size_t index = updated ? added_samples.size() - (num_added - spare_added) : 0; updated && index < added_samples.size(); ++index)
+        {
+            bool labels_changed = false;
+            updated = instance->add_sample(added_samples[index].label, added_samples[index].values, labels_changed);
+        }
+        
+        if (!updated)
+        {
+            delete instance;
+            instance = static_cast<indexed_knn *>(copy_MLBase_instance(grt_knn));
+        }
+        
+        publish_MLBase_instance(instance);
+        
+        spare_added = retired_added;
+        retired_added = active_added;
+        active_added = num_added;
+        added_generation = get_active_generation();
+    }
+    
+    void knn::recall(int argc, const t_atom *argv)
+    {
+        static const t_symbol *s_recall = flext::MakeSymbol("recall");
+        static const GRT::UINT ef_search_values[] = {10, 20, 40, 80, 160, 320};
+        
+        const int num_queries = argc > 0 ? GetAInt(argv[0]) : 100;
+        
+        if (num_queries < 1)
+        {
+            error("number of queries must be 1 or greater");
+            return;
+        }
+        
+        std::vector<GRT::UINT> values(ef_search_values, ef_search_values + sizeof(ef_search_values) / sizeof(ef_search_values[0]));
+        std::vector<double> recall;
+        std::vector<double> approximate_time;
+        double exact_time = 0;
+        
+        // get_recall() changes ef_search while it measures, so it runs on the staging model, which 'map' never reads
+        if (!grt_knn.get_recall(num_queries, values, recall, approximate_time, exact_time))
+        {
+            error("no approximate index, set 'approximate 1' and 'train' the model");
+            return;
+        }
+        
+        // recall <ef_search> <recall> <approximate microseconds per query> <exact microseconds per query>
+        for (GRT::UINT value = 0; value < values.size(); ++value)
+        {
+            t_atom report[4];
+            
+            SetInt(report[0], values[value]);
+            SetFloat(report[1], recall[value]);
+            SetFloat(report[2], approximate_time[value]);
+            SetFloat(report[3], exact_time);
+            ToOutAnything(1, s_recall, 4, report);
+        }
+    }
+    
+    // The GRT classifier factory would copy a plain GRT::KNN, losing the index
+    GRT::MLBase *knn::copy_MLBase_instance(const GRT::MLBase &instance) const
+    {
+        indexed_knn *copy = new indexed_knn;
+        
+        if (!copy->deepCopyFrom(static_cast<const GRT::Classifier *>(&instance)))
+        {
+            delete copy;
+            return NULL;
+        }
+        
+        return copy;
+    }
+    
     // Implement pure virtual methods
     GRT::Classifier &knn::get_Classifier_instance()
     {
@@ -136,6 +2017,14 @@ namespace ml
         return grt_knn;
     }
    
+    // Training settings take effect at the next 'train', 'recall' only reads the staging model
+    bool knn::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const staging_only[] = {"min_k_search_value", "max_k_search_value", "best_k_value_search", "M", "recall", NULL};
+        
+        return !is_symbol_in(s, staging_only) && classification::changes_prediction(s);
+    }
+    
     typedef class knn ml0x2eknn;
     
 #ifdef BUILD_AS_LIBRARY
@@ -58,6 +58,8 @@ namespace ml
         GRT::Classifier &get_Classifier_instance();
         const GRT::Classifier &get_Classifier_instance() const;
         
+        bool changes_prediction(const t_symbol *s) const;
+        
     private:
         // Flext Flext attribute wrappers
         FLEXT_CALLVAR_I(get_num_clusters, set_num_clusters);
@@ -92,6 +94,14 @@ namespace ml
         return grt_mindist;
     }
     
+    // Training settings, these take effect at the next 'train'
+    bool mindist::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const training_settings[] = {"num_clusters", NULL};
+        
+        return !is_symbol_in(s, training_settings) && classification::changes_prediction(s);
+    }
+    
     typedef class mindist ml0x2emindist;
     
 #ifdef BUILD_AS_LIBRARY
@@ -74,6 +74,8 @@ namespace ml
         GRT::Classifier &get_Classifier_instance();
         const GRT::Classifier &get_Classifier_instance() const;
         
+        bool changes_prediction(const t_symbol *s) const;
+        
     private:
         // Flext Flext attribute wrappers
         FLEXT_CALLVAR_I(get_num_random_splits, set_num_random_splits);
@@ -130,6 +132,14 @@ namespace ml
         return grt_randforest;
     }
     
+    // Training settings, these take effect at the next 'train'
+    bool randforest::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const training_settings[] = {"num_random_splits", "min_samples_per_node", "max_depth", NULL};
+        
+        return !is_symbol_in(s, training_settings) && classification::changes_prediction(s);
+    }
+    
       typedef class randforest ml0x2erandforest;
     
 #ifdef BUILD_AS_LIBRARY
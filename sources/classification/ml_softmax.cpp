@@ -20,16 +20,106 @@
 
 #include "ml_defaults.h"
 
+#include <algorithm>
+
 namespace ml
 {
     static const std::string object_name = ML_NAME_PREFIX "softmax";
     
+    // GRT's softmax trains a logistic model per class by stochastic gradient descent on inputs scaled to [0, 1],
+    // update() takes one more step of it for a single sample
+    class online_softmax : public GRT::Softmax
+    {
+    public:
+        // An untrained model starts with no classes and [0, 1] scaling ranges that leave the inputs as they are until 'train' learns real ones.
+        // A new label adds a class with zero weights
+        bool update(GRT::UINT label, const GRT::VectorDouble &input);
+        
+    private:
+        void init(GRT::UINT num_inputs);
+        
+        GRT::VectorDouble scaled_input;
+    };
+    
+    bool online_softmax::update(GRT::UINT label, const GRT::VectorDouble &input)
+    {
+        if (!trained)
+        {
+            init(input.size());
+        }
+        
+        if (input.size() != numInputDimensions || (useScaling && ranges.size() != numInputDimensions))
+        {
+            return false;
+        }
+        
+        if (std::find(classLabels.begin(), classLabels.end(), label) == classLabels.end())
+        {
+            GRT::SoftmaxModel model;
+            
+            model.classLabel = label;
+            model.N = numInputDimensions;
+            model.w0 = 0;
+            model.w.assign(numInputDimensions, 0);
+            
+            models.push_back(model);
+            classLabels.push_back(label);
+            numClasses = classLabels.size();
+            classLikelihoods.assign(numClasses, 0);
+            classDistances.assign(numClasses, 0);
+        }
+        
+        // As GRT scales to [0, 1], a constant maps to 0
+        scaled_input.resize(numInputDimensions);
+        
+        for (GRT::UINT index = 0; index < numInputDimensions; ++index)
+        {
+            const GRT::MinMax *range = useScaling ? &ranges[index] : NULL;
+            
+            scaled_input[index] = range == NULL ? input[index] : range->minValue == range->maxValue ? 0 : (input[index] - range->minValue) / (range->maxValue - range->minValue);
+        }
+        
+        const double rate = getLearningRate();
+        
+        for (GRT::UINT model_index = 0; model_index < models.size(); ++model_index)
+        {
+            GRT::SoftmaxModel &model = models[model_index];
+            const double error = (model.classLabel == label ? 1.0 : 0.0) - model.compute(scaled_input);
+            
+            for (GRT::UINT index = 0; index < numInputDimensions; ++index)
+            {
+                model.w[index] += rate * error * scaled_input[index];
+            }
+            model.w0 += rate * error;
+        }
+        
+        return true;
+    }
+    
+    void online_softmax::init(GRT::UINT num_inputs)
+    {
+        GRT::MinMax unit;
+        
+        unit.minValue = 0;
+        unit.maxValue = 1;
+        
+        numInputDimensions = num_inputs;
+        numClasses = 0;
+        models.clear();
+        classLabels.clear();
+        classLikelihoods.clear();
+        classDistances.clear();
+        ranges.assign(num_inputs, unit);
+        trained = true;
+    }
+    
     class softmax : classification
     {
         FLEXT_HEADER_S(softmax, classification, setup);
         
     public:
         softmax()
+        : online(false), keep_samples(false)
         {
             post("Softmax algorithm based on the GRT library version " + GRT::GRTBase::getGRTVersion());
             set_scaling(defaults::scaling);
@@ -38,21 +128,126 @@ namespace ml
     protected:
         static void setup(t_classid c)
         {
+            FLEXT_CADDATTR_SET(c, "training_rate", set_training_rate);
+            FLEXT_CADDATTR_SET(c, "online", set_online);
+            FLEXT_CADDATTR_SET(c, "keep_samples", set_keep_samples);
+            
+            FLEXT_CADDATTR_GET(c, "training_rate", get_training_rate);
+            FLEXT_CADDATTR_GET(c, "online", get_online);
+            FLEXT_CADDATTR_GET(c, "keep_samples", get_keep_samples);
+            
             // Associate this Flext class with a certain help file prefix
             DefineHelp(c, object_name.c_str());
         }
         
+        void add(int argc, const t_atom *argv);
+        
+        // Flext attribute setters
+        void set_training_rate(float training_rate);
+        void set_online(bool online);
+        void set_keep_samples(bool keep_samples);
+        
+        // Flext attribute getters
+        void get_training_rate(float &training_rate) const;
+        void get_online(bool &online) const;
+        void get_keep_samples(bool &keep_samples) const;
+        
         // Pure virtual method implementations
         GRT::Classifier &get_Classifier_instance();
         const GRT::Classifier &get_Classifier_instance() const;
         
+        bool changes_prediction(const t_symbol *s) const;
+        GRT::MLBase *copy_MLBase_instance(const GRT::MLBase &instance) const;
+        
     private:
+        // Flext attribute wrappers
+        FLEXT_CALLVAR_F(get_training_rate, set_training_rate);
+        FLEXT_CALLVAR_B(get_online, set_online);
+        FLEXT_CALLVAR_B(get_keep_samples, set_keep_samples);
+        
         // Virtual method override
         virtual const std::string get_object_name(void) const { return object_name; };
         
-        GRT::Softmax grt_softmax;
+        online_softmax grt_softmax;
+        bool online;
+        bool keep_samples;
     };
     
+    // Flext attribute setters
+    void softmax::set_training_rate(float training_rate)
+    {
+        bool success = grt_softmax.setLearningRate(training_rate);
+        
+        if (success == false)
+        {
+            error("unable to set training_rate, hint: should be between 0-1");
+        }
+    }
+    
+    void softmax::set_online(bool online)
+    {
+        this->online = online;
+    }
+    
+    void softmax::set_keep_samples(bool keep_samples)
+    {
+        this->keep_samples = keep_samples;
+    }
+    
+    // Flext attribute getters
+    void softmax::get_training_rate(float &training_rate) const
+    {
+        training_rate = grt_softmax.getLearningRate();
+    }
+    
+    void softmax::get_online(bool &online) const
+    {
+        online = this->online;
+    }
+    
+    void softmax::get_keep_samples(bool &keep_samples) const
+    {
+        keep_samples = this->keep_samples;
+    }
+    
+    // Methods
+    
+    // With 'online' on, each sample is a gradient step on the staging model, which is then published, and is only kept in the dataset with 'keep_samples'
+    void softmax::add(int argc, const t_atom *argv)
+    {
+        const GRT::UINT numSamples = classification_data.getNumSamples();
+        
+        classification::add(argc, argv);
+        
+        if (!online || get_data_type() != LABELLED_CLASSIFICATION || classification_data.getNumSamples() != numSamples + 1)
+        {
+            return;
+        }
+        
+        // A 'train' in progress will replace the staging model with one trained on the dataset, so the sample stays there
+        if (get_staging_busy())
+        {
+            post("sample added to the dataset only, send 'train' to add it to the model");
+            return;
+        }
+        
+        const GRT::ClassificationSample &sample = classification_data[numSamples];
+        
+        if (!grt_softmax.update(sample.getClassLabel(), sample.getSample()))
+        {
+            error("unable to update the model, the sample doesn't have the number of inputs the model was trained with, it was added to the dataset only");
+            return;
+        }
+        
+        // 'map' may be reading the active model, the model is small enough to publish a copy per sample
+        publish_MLBase_instance();
+        
+        if (!keep_samples)
+        {
+            classification_data.removeLastSample();
+        }
+    }
+    
     // Implement pure virtual methods
     GRT::Classifier &softmax::get_Classifier_instance()
     {
@@ -64,6 +259,28 @@ namespace ml
         return grt_softmax;
     }
     
+    // The GRT classifier factory would copy a plain GRT::Softmax, which can't be updated online
+    GRT::MLBase *softmax::copy_MLBase_instance(const GRT::MLBase &instance) const
+    {
+        online_softmax *copy = new online_softmax;
+        
+        if (!copy->deepCopyFrom(static_cast<const GRT::Classifier *>(&instance)))
+        {
+            delete copy;
+            return NULL;
+        }
+        
+        return copy;
+    }
+    
+    // Training settings, which take effect at the next 'train', and settings of this object rather than its model
+    bool softmax::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const training_settings[] = {"training_rate", "online", "keep_samples", NULL};
+        
+        return !is_symbol_in(s, training_settings) && classification::changes_prediction(s);
+    }
+    
     typedef class softmax ml0x2esoftmax;
     
 #ifdef BUILD_AS_LIBRARY
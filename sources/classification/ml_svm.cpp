@@ -19,12 +19,18 @@
 #include "ml_classification.h"
 
 #include "ml_defaults.h"
+#include "ml_simd.h"
 
 #include <vector>
 #include <string>
 #include <sstream>
 #include <map>
 #include <algorithm>
+#include <mutex>
+#include <fstream>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
 
 #include <stdint.h>
 
@@ -113,6 +119,463 @@ namespace ml
         return GRT::SVM::LINEAR_KERNEL;
     }
     
+    // GRT::SVM predicting from a dense copy of its libsvm model, made at train and load time. With the linear kernel each one-vs-one
+    // decision function is a sum of dot products with the support vectors, which collapses into one weight vector per class pair.
+    // The other kernels are evaluated against support vectors stored as an aligned row-major matrix, with SIMD unless it is disabled
+    class dense_svm : public GRT::SVM
+    {
+    public:
+        dense_svm() : num_classes(0), stride(0), use_simd(true), instructions(simd::SCALAR), solver_iterations(0), cache_fit(0), cache_required(0)
+        {
+            set_use_simd(true);
+        }
+        
+        // Without SIMD the kernel values and decision values are bit for bit the ones libsvm computes. Atomic so that it can be switched while another thread predicts
+        void set_use_simd(bool use_simd);
+        bool get_use_simd() const { return use_simd; }
+        
+        // libsvm solver settings that GRT leaves at their defaults
+        void set_cache_size(double cache_size) { param.cache_size = cache_size; }
+        double get_cache_size() const { return param.cache_size; }
+        void set_shrinking(bool shrinking) { param.shrinking = shrinking; }
+        bool get_shrinking() const { return param.shrinking != 0; }
+        void set_epsilon(double epsilon) { param.p = epsilon; }
+        double get_epsilon() const { return param.p; }
+        
+        // From the last training: solver iterations summed over all binary problems, the fraction of the largest kernel matrix that fits
+        // in the kernel cache and the cache size in MB that it would take to hold it all. The cache fit is worked out from the class
+        // counts and cachesize, not measured: libsvm doesn't count cache hits
+        GRT::UINT get_solver_iterations() const { return solver_iterations; }
+        double get_cache_fit() const { return cache_fit; }
+        double get_cache_required() const { return cache_required; }
+        
+        bool deepCopyFrom(const GRT::Classifier *classifier);
+        bool train_(GRT::ClassificationData &trainingData);
+        bool predict_(GRT::VectorDouble &inputVector);
+        bool load(std::fstream &file);
+        bool clear();
+        
+        using GRT::SVM::train_;
+        using GRT::SVM::predict_;
+        using GRT::SVM::load;
+        
+    private:
+        void prepare_model();
+        void get_kernel_values();
+        void set_cache_statistics(const GRT::ClassificationData &trainingData);
+        static void capture_solver_output(const char *output);
+        
+        GRT::UINT num_classes;
+        GRT::UINT stride; // numInputDimensions padded for SIMD
+        std::atomic<bool> use_simd;
+        std::atomic<simd::instruction_set> instructions;
+        LIBSVM::svm_parameter parameters;
+        std::vector<int> labels;
+        std::vector<GRT::UINT> start; // first support vector of each class
+        std::vector<GRT::UINT> counts; // support vectors per class
+        std::vector<double> weights; // linear kernel, dimension-major, the inner loop of predict_() runs over all class pairs at once and vectorises
+        simd::aligned_vector support_vectors; // other kernels, row-major with stride values per row
+        std::vector<double> coefficients; // other kernels, libsvm's sv_coef with one row of all support vectors per class but one
+        std::vector<double> kernel_values;
+        std::vector<double> decisions; // per class pair
+        std::vector<double> rho;
+        std::vector<GRT::UINT> votes;
+        simd::aligned_vector query;
+        GRT::UINT solver_iterations;
+        double cache_fit;
+        double cache_required;
+    };
+    
+    // libsvm's info() output for the training running on this thread
+    static thread_local std::string *solver_output = NULL;
+    
+    // Trainings collecting libsvm's output, libsvm's default printer is put back when the last of them finishes
+    static std::mutex solver_output_mutex;
+    static GRT::UINT solver_output_users = 0;
+    
+    // libsvm's integer power, repeated squaring rounds differently from std::pow
+    static inline double powi(double base, int times)
+    {
+        double tmp = base;
+        double result = 1.0;
+        
+        for (int t = times; t > 0; t /= 2)
+        {
+            if (t % 2 == 1)
+            {
+                result *= tmp;
+            }
+            tmp = tmp * tmp;
+        }
+        
+        return result;
+    }
+    
+    void dense_svm::set_use_simd(bool use_simd)
+    {
+        this->use_simd = use_simd;
+        instructions = use_simd ? simd::get_best_instruction_set() : simd::SCALAR;
+    }
+    
+    bool dense_svm::deepCopyFrom(const GRT::Classifier *classifier)
+    {
+        if (!GRT::SVM::deepCopyFrom(classifier))
+        {
+            return false;
+        }
+        
+        const dense_svm *source = dynamic_cast<const dense_svm *>(classifier);
+        
+        if (source != NULL)
+        {
+            set_use_simd(source->use_simd);
+            solver_iterations = source->solver_iterations;
+            cache_fit = source->cache_fit;
+            cache_required = source->cache_required;
+        }
+        
+        prepare_model();
+        
+        return true;
+    }
+    
+    void dense_svm::capture_solver_output(const char *output)
+    {
+        if (solver_output != NULL)
+        {
+            solver_output->append(output);
+        }
+        else
+        {
+            // What libsvm's default printer does, for training that isn't ours
+            fputs(output, stdout);
+            fflush(stdout);
+        }
+    }
+    
+    bool dense_svm::train_(GRT::ClassificationData &trainingData)
+    {
+        static const std::string iterations_prefix = "#iter = ";
+        std::string output;
+        
+        // libsvm reports its iterations through a global print function, which is only taken over while training. The output is
+        // collected per thread
+        {
+            std::lock_guard<std::mutex> lock(solver_output_mutex);
+            
+            if (solver_output_users++ == 0)
+            {
+                LIBSVM::svm_set_print_string_function(&dense_svm::capture_solver_output);
+            }
+        }
+        
+        solver_output = &output;
+        
+        const bool success = GRT::SVM::train_(trainingData);
+        
+        solver_output = NULL;
+        
+        {
+            std::lock_guard<std::mutex> lock(solver_output_mutex);
+            
+            if (--solver_output_users == 0)
+            {
+                LIBSVM::svm_set_print_string_function(NULL);
+            }
+        }
+        
+        if (!success)
+        {
+            return false;
+        }
+        
+        // One "optimization finished, #iter = N" line per binary problem
+        solver_iterations = 0;
+        
+        for (size_t position = output.find(iterations_prefix); position != std::string::npos; position = output.find(iterations_prefix, position + 1))
+        {
+            solver_iterations += std::strtoul(output.c_str() + position + iterations_prefix.size(), NULL, 10);
+        }
+        
+        set_cache_statistics(trainingData);
+        prepare_model();
+        
+        return true;
+    }
+    
+    // An estimate, libsvm doesn't count cache hits. Its cache holds kernel columns of float for one binary problem at a time, so what
+    // fits of the largest problem's kernel matrix bounds how much gets recomputed
+    void dense_svm::set_cache_statistics(const GRT::ClassificationData &trainingData)
+    {
+        double largest_problem = trainingData.getNumSamples();
+        
+        // One-vs-one classification trains on the samples of two classes at a time
+        if (param.svm_type == C_SVC || param.svm_type == NU_SVC)
+        {
+            const GRT::Vector<GRT::ClassTracker> classes = trainingData.getClassTracker();
+            
+            largest_problem = 0;
+            
+            for (GRT::UINT i = 0; i < classes.size(); ++i)
+            {
+                for (GRT::UINT j = i + 1; j < classes.size(); ++j)
+                {
+                    largest_problem = std::max(largest_problem, static_cast<double>(classes[i].counter + classes[j].counter));
+                }
+            }
+        }
+        
+        const double megabytes = largest_problem * largest_problem * sizeof(float) / (1 << 20);
+        
+        cache_required = std::ceil(megabytes);
+        cache_fit = megabytes > 0 ? std::min(1.0, param.cache_size / megabytes) : 1;
+    }
+    
+    bool dense_svm::load(std::fstream &file)
+    {
+        if (!GRT::SVM::load(file))
+        {
+            return false;
+        }
+        
+        prepare_model();
+        
+        return true;
+    }
+    
+    bool dense_svm::clear()
+    {
+        num_classes = 0;
+        weights.clear();
+        support_vectors.clear();
+        coefficients.clear();
+        
+        return GRT::SVM::clear();
+    }
+    
+    // Only the plain one-vs-one vote of svm_predict() is replaced, probability estimates, the other SVM types and precomputed kernels stay with libsvm
+    void dense_svm::prepare_model()
+    {
+        const LIBSVM::svm_model *model = getLibSVMModel();
+        
+        num_classes = 0;
+        weights.clear();
+        support_vectors.clear();
+        coefficients.clear();
+        
+        if (!trained || model == NULL || model->param.probability != 0 || (model->param.svm_type != C_SVC && model->param.svm_type != NU_SVC))
+        {
+            return;
+        }
+        
+        const int kernel_type = model->param.kernel_type;
+        
+        if (kernel_type != LINEAR_KERNEL && kernel_type != POLY_KERNEL && kernel_type != RBF_KERNEL && kernel_type != SIGMOID_KERNEL)
+        {
+            return;
+        }
+        
+        const GRT::UINT num_pairs = model->nr_class * (model->nr_class - 1) / 2;
+        const GRT::UINT num_support_vectors = model->l;
+        
+        num_classes = model->nr_class;
+        parameters = model->param;
+        stride = simd::get_stride(numInputDimensions);
+        labels.assign(model->label, model->label + num_classes);
+        counts.assign(model->nSV, model->nSV + num_classes);
+        start.assign(num_classes, 0);
+        rho.assign(model->rho, model->rho + num_pairs);
+        decisions.resize(num_pairs);
+        votes.resize(num_classes);
+        query.assign(stride, 0.0);
+        
+        for (GRT::UINT class_index = 1; class_index < num_classes; ++class_index)
+        {
+            start[class_index] = start[class_index - 1] + counts[class_index - 1];
+        }
+        
+        if (kernel_type != LINEAR_KERNEL)
+        {
+            support_vectors.assign(num_support_vectors * stride, 0.0);
+            coefficients.resize((num_classes - 1) * num_support_vectors);
+            kernel_values.resize(num_support_vectors);
+            
+            for (GRT::UINT support_vector = 0; support_vector < num_support_vectors; ++support_vector)
+            {
+                // libsvm nodes are sparse with 1-based indices, terminated by -1
+                for (const LIBSVM::svm_node *node = model->SV[support_vector]; node->index != -1; ++node)
+                {
+                    if (node->index >= 1 && (GRT::UINT)node->index <= numInputDimensions)
+                    {
+                        support_vectors[support_vector * stride + node->index - 1] = node->value;
+                    }
+                }
+            }
+            
+            for (GRT::UINT row = 0; row + 1 < num_classes; ++row)
+            {
+                std::copy(model->sv_coef[row], model->sv_coef[row] + num_support_vectors, coefficients.begin() + row * num_support_vectors);
+            }
+            return;
+        }
+        
+        weights.assign(numInputDimensions * num_pairs, 0.0);
+        
+        GRT::UINT pair = 0;
+        
+        // The same pair order and coefficients as svm_predict_values()
+        for (GRT::UINT i = 0; i < num_classes; ++i)
+        {
+            for (GRT::UINT j = i + 1; j < num_classes; ++j, ++pair)
+            {
+                const GRT::UINT classes[2] = {i, j};
+                const double *class_coefficients[2] = {model->sv_coef[j - 1], model->sv_coef[i]};
+                
+                for (GRT::UINT side = 0; side < 2; ++side)
+                {
+                    const GRT::UINT begin = start[classes[side]];
+                    const GRT::UINT end = begin + counts[classes[side]];
+                    
+                    for (GRT::UINT support_vector = begin; support_vector < end; ++support_vector)
+                    {
+                        for (const LIBSVM::svm_node *node = model->SV[support_vector]; node->index != -1; ++node)
+                        {
+                            if (node->index >= 1 && (GRT::UINT)node->index <= numInputDimensions)
+                            {
+                                weights[(node->index - 1) * num_pairs + pair] += class_coefficients[side][support_vector] * node->value;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    // The kernel between the query and every support vector, as Kernel::k_function() computes it
+    void dense_svm::get_kernel_values()
+    {
+        const GRT::UINT num_support_vectors = kernel_values.size();
+        double *values = kernel_values.data();
+        
+        if (parameters.kernel_type == RBF_KERNEL)
+        {
+            simd::squared_distance_rows(instructions, support_vectors.data(), num_support_vectors, stride, query.data(), values);
+            
+            for (GRT::UINT support_vector = 0; support_vector < num_support_vectors; ++support_vector)
+            {
+                values[support_vector] = std::exp(-parameters.gamma * values[support_vector]);
+            }
+            return;
+        }
+        
+        simd::dot_rows(instructions, support_vectors.data(), num_support_vectors, stride, query.data(), values);
+        
+        for (GRT::UINT support_vector = 0; support_vector < num_support_vectors; ++support_vector)
+        {
+            const double value = parameters.gamma * values[support_vector] + parameters.coef0;
+            values[support_vector] = parameters.kernel_type == POLY_KERNEL ? powi(value, parameters.degree) : std::tanh(value);
+        }
+    }
+    
+    bool dense_svm::predict_(GRT::VectorDouble &inputVector)
+    {
+        if (num_classes == 0)
+        {
+            return GRT::SVM::predict_(inputVector);
+        }
+        
+        predictedClassLabel = 0;
+        maxLikelihood = -10000;
+        
+        if (inputVector.size() != numInputDimensions)
+        {
+            errorLog << "predict_(VectorDouble &inputVector) - the size of the input vector does not match the number of features" << std::endl;
+            return false;
+        }
+        
+        // GRT scales SVM inputs to [-1, 1]
+        for (GRT::UINT dimension = 0; dimension < numInputDimensions; ++dimension)
+        {
+            const GRT::MinMax &range = ranges[dimension];
+            
+            if (!useScaling)
+            {
+                query[dimension] = inputVector[dimension];
+            }
+            else
+            {
+                query[dimension] = range.minValue == range.maxValue ? -1 : (inputVector[dimension] - range.minValue) * 2 / (range.maxValue - range.minValue) - 1;
+            }
+        }
+        
+        const GRT::UINT num_pairs = rho.size();
+        
+        if (parameters.kernel_type == LINEAR_KERNEL)
+        {
+            for (GRT::UINT pair = 0; pair < num_pairs; ++pair)
+            {
+                decisions[pair] = -rho[pair];
+            }
+            
+            for (GRT::UINT dimension = 0; dimension < numInputDimensions; ++dimension)
+            {
+                const double value = query[dimension];
+                const double *row = &weights[dimension * num_pairs];
+                
+                for (GRT::UINT pair = 0; pair < num_pairs; ++pair)
+                {
+                    decisions[pair] += row[pair] * value;
+                }
+            }
+        }
+        else
+        {
+            const GRT::UINT num_support_vectors = kernel_values.size();
+            GRT::UINT pair = 0;
+            
+            get_kernel_values();
+            
+            // Summed in the order of svm_predict_values()
+            for (GRT::UINT i = 0; i < num_classes; ++i)
+            {
+                for (GRT::UINT j = i + 1; j < num_classes; ++j, ++pair)
+                {
+                    const double *coefficients_i = &coefficients[(j - 1) * num_support_vectors];
+                    const double *coefficients_j = &coefficients[i * num_support_vectors];
+                    double sum = 0;
+                    
+                    for (GRT::UINT k = start[i]; k < start[i] + counts[i]; ++k)
+                    {
+                        sum += coefficients_i[k] * kernel_values[k];
+                    }
+                    
+                    for (GRT::UINT k = start[j]; k < start[j] + counts[j]; ++k)
+                    {
+                        sum += coefficients_j[k] * kernel_values[k];
+                    }
+                    
+                    decisions[pair] = sum - rho[pair];
+                }
+            }
+        }
+        
+        std::fill(votes.begin(), votes.end(), 0);
+        
+        GRT::UINT pair = 0;
+        
+        for (GRT::UINT i = 0; i < num_classes; ++i)
+        {
+            for (GRT::UINT j = i + 1; j < num_classes; ++j, ++pair)
+            {
+                ++votes[decisions[pair] > 0 ? i : j];
+            }
+        }
+        
+        predictedClassLabel = labels[std::max_element(votes.begin(), votes.end()) - votes.begin()];
+        
+        return true;
+    }
+    
     class svm : classification
     {
         FLEXT_HEADER_S(svm, classification, setup);
@@ -144,6 +607,7 @@ namespace ml
             FLEXT_CADDATTR_SET(c, "weights", set_weights);
             FLEXT_CADDATTR_SET(c, "mode", set_kfold_value);
             FLEXT_CADDATTR_SET(c, "enable_cross_validation", set_enable_cross_validation);
+            FLEXT_CADDATTR_SET(c, "simd", set_simd);
             
             FLEXT_CADDATTR_GET(c, "type", get_type);
             FLEXT_CADDATTR_GET(c, "kernel", get_kernel);
@@ -158,6 +622,7 @@ namespace ml
             FLEXT_CADDATTR_GET(c, "probs", get_probs);
             FLEXT_CADDATTR_GET(c, "weights", get_weights);
             FLEXT_CADDATTR_GET(c, "mode", get_kfold_value);
+            FLEXT_CADDATTR_GET(c, "simd", get_simd);
             
             FLEXT_CADDMETHOD_(c, 0, "cross_validation", cross_validation);
             
@@ -181,6 +646,7 @@ namespace ml
         void set_weights(const AtomList &weights);
         void set_kfold_value(int mode);
         void set_enable_cross_validation(bool enable_cross_validation);
+        void set_simd(bool simd);
         
         // Flext attribute getters
         void get_type(int &type) const;
@@ -196,11 +662,17 @@ namespace ml
         void get_probs(bool &probs) const;
         void get_weights(AtomList &weights) const;
         void get_kfold_value(int &mode) const;
+        void get_simd(bool &simd) const;
         
         // Pure virtual method implementations
         GRT::Classifier &get_Classifier_instance();
         const GRT::Classifier &get_Classifier_instance() const;
         
+        bool changes_prediction(const t_symbol *s) const;
+        
+        GRT::MLBase *copy_MLBase_instance(const GRT::MLBase &instance) const;
+        void report_training();
+        
     private:
         // Flext method wrappers
         FLEXT_CALLBACK(cross_validation);
@@ -220,11 +692,12 @@ namespace ml
         FLEXT_CALLVAR_V(get_weights, set_weights);
         FLEXT_CALLVAR_I(get_kfold_value, set_kfold_value);
         FLEXT_CALLSET_B(set_enable_cross_validation);
+        FLEXT_CALLVAR_B(get_simd, set_simd);
         
         // Virtual method override
         virtual const std::string get_object_name(void) const { return object_name; };
         
-        GRT::SVM grt_svm;
+        dense_svm grt_svm;
     };
     
     // Flext attribute setters
@@ -289,17 +762,29 @@ namespace ml
     
     void svm::set_epsilon(float epsilon)
     {
-        error("function not implemented");
+        if (epsilon < 0)
+        {
+            error("epsilon must be 0 or greater");
+            return;
+        }
+        
+        grt_svm.set_epsilon(epsilon);
     }
     
     void svm::set_cachesize(int cachesize)
     {
-        error("function not implemented");
+        if (cachesize < 1)
+        {
+            error("cachesize must be 1 MB or greater");
+            return;
+        }
+        
+        grt_svm.set_cache_size(cachesize);
     }
     
     void svm::set_shrinking(int shrinking)
     {
-        error("function not implemented");
+        grt_svm.set_shrinking(shrinking != 0);
     }
     
     void svm::set_probs(bool probs)
@@ -322,6 +807,19 @@ namespace ml
         grt_svm.enableCrossValidationTraining(enable_cross_validation);
     }
     
+    void svm::set_simd(bool simd)
+    {
+        grt_svm.set_use_simd(simd);
+        
+        // The predictions only differ by rounding, so the active model is switched too rather than replaced by a copy
+        dense_svm *active_svm = static_cast<dense_svm *>(get_active_MLBase_instance());
+        
+        if (active_svm != NULL)
+        {
+            active_svm->set_use_simd(simd);
+        }
+    }
+    
     // Flext attribute getters
     void svm::get_type(int &type) const
     {
@@ -363,17 +861,17 @@ namespace ml
     
     void svm::get_epsilon(float &epsilon) const
     {
-        error("function not implemented");
+        epsilon = grt_svm.get_epsilon();
     }
     
     void svm::get_cachesize(int &cachesize) const
     {
-        error("function not implemented");
+        cachesize = grt_svm.get_cache_size();
     }
     
     void svm::get_shrinking(int &shrinking) const
     {
-        error("function not implemented");
+        shrinking = grt_svm.get_shrinking();
     }
     
     void svm::get_probs(bool &probs) const
@@ -391,12 +889,43 @@ namespace ml
         error("function not implemented");
     }
     
+    void svm::get_simd(bool &simd) const
+    {
+        simd = grt_svm.get_use_simd();
+    }
+    
+    // solver <iterations> <cache fit> <cachesize in MB needed to hold the largest kernel matrix>
+    void svm::report_training()
+    {
+        static const t_symbol *s_solver = flext::MakeSymbol("solver");
+        t_atom report[3];
+        
+        SetInt(report[0], grt_svm.get_solver_iterations());
+        SetFloat(report[1], grt_svm.get_cache_fit());
+        SetInt(report[2], grt_svm.get_cache_required());
+        ToOutAnything(1, s_solver, 3, report);
+    }
+    
     void svm::cross_validation()
     {
         double result = grt_svm.getCrossValidationResult();
         ToOutDouble(0, result);
     }
     
+    // The GRT classifier factory would copy a plain GRT::SVM, losing the dense model
+    GRT::MLBase *svm::copy_MLBase_instance(const GRT::MLBase &instance) const
+    {
+        dense_svm *copy = new dense_svm;
+        
+        if (!copy->deepCopyFrom(static_cast<const GRT::Classifier *>(&instance)))
+        {
+            delete copy;
+            return NULL;
+        }
+        
+        return copy;
+    }
+    
     // Implement pure virtual methods
     GRT::Classifier &svm::get_Classifier_instance()
     {
@@ -408,6 +937,14 @@ namespace ml
         return grt_svm;
     }
     
+    // Training settings, these take effect at the next 'train'. 'simd' switches the active model itself and 'cross_validation' only reads
+    bool svm::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const training_settings[] = {"type", "kernel", "degree", "gamma", "coef0", "cost", "nu", "epsilon", "cachesize", "shrinking", "weights", "mode", "enable_cross_validation", "cross_validation", "simd", NULL};
+        
+        return !is_symbol_in(s, training_settings) && classification::changes_prediction(s);
+    }
+    
     typedef class svm ml0x2esvm;
 
 #ifdef BUILD_AS_LIBRARY
@@ -39,6 +39,11 @@ namespace ml
 //        num_output_dimensions = feature_extractor.getNumOutputDimensions();
     }
     
+    void feature_extraction::train()
+    {
+        error("function not implemented");
+    }
+    
     void feature_extraction::map(int argc, const t_atom *argv)
     {
         GRT::VectorDouble input(argc);
@@ -38,6 +38,7 @@ namespace ml
             FLEXT_CADDATTR_GET(c, "num_output_dimensions", get_num_output_dimensions);
         }
         
+        void train();
         void map(int argc, const t_atom *argv);
                 
         // Flext attribute getters
@@ -51,8 +52,8 @@ namespace ml
         virtual const GRT::FeatureExtraction &get_FeatureExtraction_instance() const = 0;
         
         // Override pure virtual functions - do nothing
-        virtual bool read_specialised_dataset(std::string &path) { return true; };
-        virtual bool write_specialised_dataset(std::string &path) const { return true; };
+        virtual bool read_specialised_dataset(std::string &path, background_job &job) const { return true; };
+        virtual bool write_specialised_dataset(std::string &path, const background_job &job) const { return true; };
         
     private:
         // Flext attribute wrappers
@@ -56,7 +56,7 @@ namespace ml_doc
             ml::k_zerox
         });
         
-        descriptors[ml::k_mlp].desc("Multilayer Perceptron").url("http://www.nickgillian.com/wiki/pmwiki.php/GRT/MLP");
+        descriptors[ml::k_mlp].desc("Multilayer Perceptron. Setting batch_size above 1, patience, rate_schedule or parallel_restarts replaces GRT's trainer with one that runs seeded restarts in parallel, stops on min_change when the epoch's mean squared error changes by less than it and outputs the error of every epoch, except for classification with null_rejection, which always uses GRT's trainer").url("http://www.nickgillian.com/wiki/pmwiki.php/GRT/MLP");
         descriptors[ml::k_linreg].desc("Linear Regression").url("http://www.nickgillian.com/wiki/pmwiki.php/GRT/LinearRegression");
         descriptors[ml::k_logreg].desc("Logistic Regression").url("http://www.nickgillian.com/wiki/pmwiki.php/GRT/LogisticRegression");
         descriptors[ml::k_peak].desc("Peak Detection").url("http://www.nickgillian.com/wiki/pmwiki.php/GRT/PeakDetection");
@@ -84,7 +84,7 @@ namespace ml_doc
         
         message_descriptor train(
                                 "train",
-                                "train the model based on vectors added with 'add'"
+                                "train the model based on vectors added with 'add', training runs in the background and 'train 1' is sent from the right outlet when it completes"
                                 );
         
         message_descriptor map(
@@ -93,15 +93,21 @@ namespace ml_doc
                                "0.2 0.7 0.3 0.1"
                               );
         
+        message_descriptor map_batch(
+                                    "map_batch",
+                                    "generate the output value(s) for several concatenated feature vectors at once, the first argument gives the number of features per vector, output values for all vectors are sent as a single list",
+                                    "2 0.2 0.7 0.3 0.1"
+                                    );
+        
         message_descriptor write(
                                  "write",
-                                 "write training data and / or model, first argument gives path to write file",
+                                 "write training data and / or model, first argument gives path to write file, the file is written in the background and 'write 1' is sent from the right outlet when it completes",
                                  "my_ml-lib_data"
                                  );
         
         message_descriptor read(
                                 "read",
-                                "read training data and / or model, first argument gives path to the read file",
+                                "read training data and / or model, first argument gives path to the read file, the file is read in the background and 'read 1' is sent from the right outlet when it completes",
                                 "my_ml-lib_data"
                                 );
         
@@ -129,7 +135,7 @@ namespace ml_doc
                                              0
                                              );
         
-        descriptors[ml::k_base].add_message_descriptor(add, write, read, train, clear, map, help, scaling, probs);
+        descriptors[ml::k_base].add_message_descriptor(add, write, read, train, clear, map, map_batch, help, scaling, probs);
 
         // generic classification descriptor
         valued_message_descriptor<bool> null_rejection(
@@ -147,7 +153,13 @@ namespace ml_doc
                                                               0.9
                                                               );
         
-        descriptors[ml::k_classification].add_message_descriptor(null_rejection_coeff, null_rejection);
+        message_descriptor cross_validate(
+                                          "cross_validate",
+                                          "train and test the model on k folds of the training data in the background, first argument gives the number of folds. A 'confusion' message is sent from the right outlet for each class followed by 'cross_validate' with the mean and standard deviation of the accuracy",
+                                          "5"
+                                          );
+        
+        descriptors[ml::k_classification].add_message_descriptor(null_rejection_coeff, null_rejection, cross_validate);
         
         // generic feature extraction descriptor
         descriptors[ml::k_feature_extraction].add_message_descriptor(null_rejection_coeff, null_rejection);
@@ -268,11 +280,18 @@ namespace ml_doc
                                                                  
         ranged_message_descriptor<int> rand_training_iterations(
                                                                  "rand_training_iterations",
-                                                                 "set the number of random training iterations",
+                                                                 "set the number of randomly initialised networks to train, keeping the best by validation error",
                                                                  0,
                                                                  1000,
                                                                  10
                                                                  );
+        
+        valued_message_descriptor<bool> parallel_restarts(
+                                                          "parallel_restarts",
+                                                          "set whether the rand_training_iterations networks are trained in parallel",
+                                                          {false, true},
+                                                          false
+                                                          );
 
         valued_message_descriptor<bool> use_validation_set(
                                                            "use_validation_set",
@@ -297,7 +316,69 @@ namespace ml_doc
                                                            );
         
         
-        descriptors[ml::k_mlp].add_message_descriptor(add_mlp, null_rejection, null_rejection_coeff, num_outputs, num_hidden, min_epochs, max_epochs, momentum, gamma, input_activation_function, hidden_activation_function, output_activation_function, rand_training_iterations, use_validation_set, validation_set_size, randomize_training_order);
+        ranged_message_descriptor<int> batch_size(
+                                                  "batch_size",
+                                                  "set the number of samples per weight update, the training rate applies to their mean gradient",
+                                                  1,
+                                                  4096,
+                                                  1
+                                                  );
+        
+        ranged_message_descriptor<int> patience(
+                                                "patience",
+                                                "stop training once the validation error, or the training error without a validation set, hasn't improved for this many epochs and keep the network from the best epoch, 0 disables early stopping",
+                                                0,
+                                                1000,
+                                                0
+                                                );
+        
+        valued_message_descriptor<int> rate_schedule(
+                                                     "rate_schedule",
+                                                     "set how the training rate decays, 0:CONSTANT, 1:STEP (multiplied by rate_decay every rate_decay_epochs epochs), 2:EXPONENTIAL (the same decay spread over every epoch), 3:PLATEAU (multiplied by rate_decay after rate_decay_epochs epochs without improvement)",
+                                                     {0, 1, 2, 3},
+                                                     0
+                                                     );
+        
+        ranged_message_descriptor<float> rate_decay(
+                                                    "rate_decay",
+                                                    "set the factor the training rate is multiplied by at each decay of rate_schedule",
+                                                    0.0,
+                                                    1.0,
+                                                    0.5
+                                                    );
+        
+        ranged_message_descriptor<int> rate_decay_epochs(
+                                                         "rate_decay_epochs",
+                                                         "set the number of epochs per decay of rate_schedule",
+                                                         1,
+                                                         10000,
+                                                         10
+                                                         );
+        
+        message_descriptor error_mlp(
+                                     "error",
+                                     "output the training error of the trained model, per epoch training outputs error <restart> <epoch> <training error> <validation error>"
+                                     );
+        
+        descriptors[ml::k_mlp].add_message_descriptor(add_mlp, null_rejection, null_rejection_coeff, num_outputs, num_hidden, min_epochs, max_epochs, momentum, gamma, input_activation_function, hidden_activation_function, output_activation_function, rand_training_iterations, parallel_restarts, use_validation_set, validation_set_size, randomize_training_order, batch_size, patience, rate_schedule, rate_decay, rate_decay_epochs, error_mlp);
+        
+        //---- ml.linreg, ml.logreg
+        valued_message_descriptor<bool> online_sgd(
+                                                   "online",
+                                                   "set whether each 'add' updates the model straight away with one step of stochastic gradient descent, an untrained model starts from zero weights",
+                                                   {false, true},
+                                                   false
+                                                   );
+        
+        valued_message_descriptor<bool> keep_samples(
+                                                     "keep_samples",
+                                                     "set whether samples added in online mode are also stored in the dataset for 'train' and 'write', otherwise memory use stays constant",
+                                                     {false, true},
+                                                     false
+                                                     );
+        
+        descriptors[ml::k_linreg].add_message_descriptor(online_sgd, keep_samples);
+        descriptors[ml::k_logreg].add_message_descriptor(online_sgd, keep_samples);
         
         
         //-- Classifiers
@@ -395,7 +476,14 @@ namespace ml_doc
                                             "perform cross validation"
                                             );
         
-        descriptors[ml::k_svm].add_message_descriptor(cross_validation, type, kernel, degree, svm_gamma, coef0, cost, nu, epsilon, cachesize, tolerance, shrinking);
+        valued_message_descriptor<bool> simd(
+                                             "simd",
+                                             "evaluate kernels with SIMD instructions (AVX2 or NEON) when the CPU has them, 0 gives decision values identical to libsvm",
+                                             {false, true},
+                                             true
+                                             );
+        
+        descriptors[ml::k_svm].add_message_descriptor(cross_validation, type, kernel, degree, svm_gamma, coef0, cost, nu, epsilon, cachesize, tolerance, shrinking, simd);
         
         //---- ml.adaboost        
         ranged_message_descriptor<int> num_boosting_iterations(
@@ -437,6 +525,15 @@ namespace ml_doc
         
         descriptors[ml::k_anbc].add_message_descriptor(weights);
         
+        //---- time series classifiers
+        ranged_message_descriptor<int> window_size(
+                                                   "window_size",
+                                                   "sets the maximum number of frames classified by 'map' while recording, older frames are discarded so each frame costs the same, 0 classifies everything since recording started",
+                                                   0,
+                                                   10000,
+                                                   0
+                                                   );
+        
         //---- ml.dtw
         valued_message_descriptor<int> rejection_mode(
                                                       "rejection_mode",
@@ -481,7 +578,27 @@ namespace ml_doc
                                                                false
                                                                );
   
-        descriptors[ml::k_dtw].add_message_descriptor(rejection_mode, warping_radius, offset_time_series, constrain_warping_path, enable_z_normalization, enable_trim_training_data);
+        valued_message_descriptor<bool> streaming(
+                                                  "streaming",
+                                                  "spot gestures in a continuous stream, each 'map' updates one warping column per template and the class label is output when a template match below its null rejection threshold is complete, no recording needed",
+                                                  {false, true},
+                                                  false
+                                                  );
+  
+        message_descriptor pruned_templates(
+                                            "pruned_templates",
+                                            "get the number of templates skipped during the last 'map' while recording because a lower bound showed they couldn't be the nearest, bounds are only used with constrain_warping_path off"
+                                            );
+  
+        ranged_message_descriptor<int> num_threads(
+                                                   "num_threads",
+                                                   "sets the number of threads used to compute GRT's distances from the recorded time series to the templates, GRT computes them itself with probs, z-normalization or likelihood based rejection",
+                                                   1,
+                                                   64,
+                                                   1
+                                                   );
+  
+        descriptors[ml::k_dtw].add_message_descriptor(rejection_mode, warping_radius, offset_time_series, constrain_warping_path, enable_z_normalization, enable_trim_training_data, window_size, streaming, pruned_templates, num_threads);
         
         //---- ml.hmm
         ranged_message_descriptor<int> num_states(
@@ -539,9 +656,24 @@ namespace ml_doc
                                                          1.0e-2
                                                          );
         
-        descriptors[ml::k_hmm].add_message_descriptor(num_states, num_symbols, model_type, delta, max_num_iterations, num_random_training_iterations, min_improvement);
+        valued_message_descriptor<bool> online(
+                                               "online",
+                                               "while recording, update each class model's forward probabilities with every 'map' instead of re-evaluating the whole recording, the log-likelihood of each class is output with 'probs' (discrete models only)",
+                                               {false, true},
+                                               false
+                                               );
+        
+        valued_message_descriptor<bool> quantize(
+                                                 "quantize",
+                                                 "train a k-means codebook of num_symbols centroids with the model so that 'add' and 'map' take continuous feature vectors, each frame is mapped to the symbol of its nearest centroid. The codebook is saved in the '.model' file",
+                                                 {false, true},
+                                                 false
+                                                 );
+        
+        descriptors[ml::k_hmm].add_message_descriptor(num_states, num_symbols, model_type, delta, max_num_iterations, num_random_training_iterations, min_improvement, window_size, online, quantize);
         
         //---- ml.softmax
+        descriptors[ml::k_softmax].add_message_descriptor(training_rate, online_sgd, keep_samples);
         
         //---- ml.randforest
         ranged_message_descriptor<int> num_random_splits(
@@ -615,7 +747,42 @@ namespace ml_doc
                                                             false
                                                             );
         
-        descriptors[ml::k_knn].add_message_descriptor(k, min_k_search_value, max_k_search_value, best_k_value_search);
+        valued_message_descriptor<int> index(
+                                             "index",
+                                             "set the search structure built at train time for exact nearest neighbour search: 0 = brute force, 1 = automatic (KD-tree up to 16 dimensions, ball tree above), 2 = KD-tree, 3 = ball tree. The index is saved in the '.model' file, changes take effect on the next 'train'",
+                                             {0, 1, 2, 3},
+                                             1
+                                             );
+        
+        valued_message_descriptor<bool> approximate(
+                                                    "approximate",
+                                                    "build an HNSW graph at train time instead of the exact index, 'map' then finds approximate nearest neighbours much faster on large, high dimensional datasets",
+                                                    {false, true},
+                                                    false
+                                                    );
+        
+        ranged_message_descriptor<int> ef_search(
+                                                 "ef_search",
+                                                 "set the size of the candidate list searched by 'map' in approximate mode, larger values are slower but find more of the true nearest neighbours",
+                                                 1,
+                                                 10000,
+                                                 50
+                                                 );
+        
+        ranged_message_descriptor<int> M(
+                                         "M",
+                                         "set the number of links per sample in the HNSW graph, takes effect on the next 'train'",
+                                         2,
+                                         100,
+                                         16
+                                         );
+        
+        message_descriptor recall(
+                                  "recall",
+                                  "measure the approximate search against an exact search on N queries (default 100), outputs 'recall <ef_search> <recall> <approximate microseconds> <exact microseconds>' for a range of ef_search values"
+                                  );
+        
+        descriptors[ml::k_knn].add_message_descriptor(k, min_k_search_value, max_k_search_value, best_k_value_search, index, approximate, ef_search, M, recall);
         
         //---- ml.gmm
         ranged_message_descriptor<int> num_mixture_models(
@@ -20,11 +20,14 @@
 #include "ml_defaults.h"
 
 #include <string>
+#include <algorithm>
+#include <string.h>
 
 namespace ml
 {
     static const std::string k_model_extension = ".model";
     static const std::string k_data_extension = ".data";
+    static const double k_job_poll_interval = 0.01; // seconds
     const std::string get_symbol_as_string(const t_symbol *symbol);
     const std::string get_file_extension_from_path(const std::string &path); // can be a full path or just file name
     void get_data_file_paths(const std::string &supplied_path, std::string &data_path, std::string &model_path);
@@ -66,6 +69,36 @@ namespace ml
 		return s_error;
 	}
 
+	const t_symbol *get_s_map()
+    { 		
+    	static const t_symbol *s_map = flext::MakeSymbol("map");
+		return s_map;
+	}
+
+	const t_symbol *get_s_map_batch()
+    { 		
+    	static const t_symbol *s_map_batch = flext::MakeSymbol("map_batch");
+		return s_map_batch;
+	}
+
+	const t_symbol *get_s_add()
+    { 		
+    	static const t_symbol *s_add = flext::MakeSymbol("add");
+		return s_add;
+	}
+
+	const t_symbol *get_s_record()
+    { 		
+    	static const t_symbol *s_record = flext::MakeSymbol("record");
+		return s_record;
+	}
+
+	const t_symbol *get_s_help()
+    { 		
+    	static const t_symbol *s_help = flext::MakeSymbol("help");
+		return s_help;
+	}
+
 
     void init_global_symbols()
     {
@@ -75,14 +108,38 @@ namespace ml
 	get_s_write();
 	get_s_probs();
 	get_s_error();
+	get_s_map();
+	get_s_map_batch();
+	get_s_add();
+	get_s_record();
+	get_s_help();
     }
+    
    
     ml::ml()
-    : current_label(0), probs(false), recording(false)
+    : current_label(0), probs(false), recording(false), unsupported_message(false), active_instance(NULL), active_generation(1)
     {
         set_data_type(defaults::data_type);
         set_num_inputs(defaults::num_input_dimensions);
         AddOutAnything("general purpose outlet");
+        
+        FLEXT_ADDTIMER(job_timer, job_tick);
+    }
+    
+    ml::~ml()
+    {
+        // Normally already stopped by Exit()
+        stop_job();
+        
+        delete active_instance.load();
+    }
+    
+    void ml::Exit()
+    {
+        // The worker calls virtuals and uses the subclass's staging model, so it must finish before any destructor runs
+        stop_job();
+        
+        flext_base::Exit();
     }
     
     void ml::set_num_inputs(uint16_t num_inputs)
@@ -151,6 +208,11 @@ namespace ml
     
     void ml::add(int argc, const t_atom *argv)
     {
+        if (check_datasets_busy_with_error(get_s_add()))
+        {
+            return;
+        }
+        
         if (argc < 2)
         {
             error("invalid input length, must contain at least 2 values");
@@ -278,25 +340,51 @@ namespace ml
             time_series_classification_data.addSample(current_label, time_series_data);
         }
         time_series_data.clear();
+        recording_window.clear();
+        reset_recording_state();
         current_label = 0;
     }
     
+    void ml::reset_recording_state()
+    {
+    }
+    
+    void ml::report_training()
+    {
+    }
+    
+    void ml::report_progress(background_job &job)
+    {
+    }
+    
     void ml::record(bool state)
     {
+        if (check_datasets_busy_with_error(get_s_record()))
+        {
+            return;
+        }
+        
         record_(state);
         std::string record_state = recording ? "on" : "off";
         post("recording: " + record_state);
     }
     
-    void ml::write(const t_symbol *path) const
+    void ml::write(const t_symbol *path)
     {
-        bool success = false;
         t_atom a_success;
-        SetInt(a_success, success);
+        SetInt(a_success, false);
         const data_type data_type = get_data_type();
         std::string file_path = get_symbol_as_string(path);
+        
+        // Training settings aren't published, so the staging model is saved. No job is running, so nothing else is using it
         const GRT::MLBase &mlBase = get_MLBase_instance();
         
+        if (check_busy_with_error())
+        {
+            ToOutAnything(1, get_s_write(), 1, &a_success);
+            return;
+        }
+        
         if (
             (data_type == LABELLED_REGRESSION && regression_data.getNumSamples() == 0) ||
             (data_type == LABELLED_CLASSIFICATION && classification_data.getNumSamples() == 0) ||
@@ -314,48 +402,84 @@ namespace ml
             return;
         }
         
-        std::string dataset_file_path;
-        std::string model_file_path;
+        std::shared_ptr<background_job> job = std::make_shared<background_job>(get_s_write(), data_type);
         
-        get_data_file_paths(file_path, dataset_file_path, model_file_path);
+        job->uses_staging = false;
+        get_data_file_paths(file_path, job->dataset_path, job->model_path);
         
-        if (!dataset_file_path.empty())
+        if (!job->dataset_path.empty())
         {
-            success = write_specialised_dataset(dataset_file_path);
-        
-            if (!success)
-            {
-                error("unable to write training data to path: " + dataset_file_path);
-            }
+            copy_dataset_to_job(*job);
         }
         
-        if (!model_file_path.empty())
+        if (!job->model_path.empty())
         {
             if (mlBase.getTrained())
             {
-                success = mlBase.saveModelToFile(model_file_path);
-                
-                if (!success)
-                {
-                    error("unable to write model to path: " + model_file_path);
-                }
+                job->model.reset(copy_MLBase_instance(mlBase));
             }
             else if (get_file_extension_from_path(file_path) == k_model_extension)
             {
                 error("model not trained, use 'train' to train a model");
             }
         }
-       
+        
+        start_job(job, &ml::write_job);
+    }
+    
+    void ml::write_job(background_job &job)
+    {
+        if (!job.dataset_path.empty())
+        {
+            job.dataset_success = write_specialised_dataset(job.dataset_path, job);
+        }
+        
+        if (!job.model_path.empty() && job.model)
+        {
+            job.model_success = job.model->saveModelToFile(job.model_path);
+        }
+    }
+    
+    void ml::complete_write(background_job &job)
+    {
+        bool success = false;
+        
+        if (!job.dataset_path.empty())
+        {
+            success = job.dataset_success;
+            
+            if (!success)
+            {
+                error("unable to write training data to path: " + job.dataset_path);
+            }
+        }
+        
+        if (!job.model_path.empty() && job.model)
+        {
+            success = job.model_success;
+            
+            if (!success)
+            {
+                error("unable to write model to path: " + job.model_path);
+            }
+        }
+        
+        t_atom a_success;
+        
         SetInt(a_success, success);
         ToOutAnything(1, get_s_write(), 1, &a_success);
     }
     
     void ml::read(const t_symbol *path)
     {
-        bool success = false;
         t_atom a_success;
-        SetInt(a_success, success);
-        GRT::MLBase &mlBase = get_MLBase_instance();
+        SetInt(a_success, false);
+        
+        if (check_busy_with_error())
+        {
+            ToOutAnything(1, get_s_read(), 1, &a_success);
+            return;
+        }
 
         std::string file_path = get_symbol_as_string(path);
         
@@ -364,31 +488,69 @@ namespace ml
             return;
         }
         
-        std::string dataset_file_path;
-        std::string model_file_path;
+        std::shared_ptr<background_job> job = std::make_shared<background_job>(get_s_read(), get_data_type());
         
-        get_data_file_paths(file_path, dataset_file_path, model_file_path);
-
-        if (!dataset_file_path.empty())
+        get_data_file_paths(file_path, job->dataset_path, job->model_path);
+        job->replaces_datasets = !job->dataset_path.empty();
+        
+        start_job(job, &ml::read_job);
+    }
+    
+    // Staging messages, 'add' and 'record' are refused while reading, so the worker has the staging model and the datasets to itself
+    void ml::read_job(background_job &job)
+    {
+        if (!job.dataset_path.empty())
         {
-            success = read_specialised_dataset(dataset_file_path);
+            job.dataset_success = read_specialised_dataset(job.dataset_path, job);
             
-            if (!success)
+            if (job.dataset_success)
             {
-                error("unable to read training data from path: " + dataset_file_path);
+                copy_dataset_from_job(job);
             }
         }
         
-        if (!model_file_path.empty())
+        if (!job.model_path.empty())
         {
-            success = mlBase.loadModelFromFile(model_file_path);
+            // The model is loaded into a copy so that the staging model is untouched if loading fails, the copy becomes the active model
+            job.model.reset(copy_MLBase_instance(get_MLBase_instance()));
+            job.model_success = job.model && job.model->loadModelFromFile(job.model_path) && set_MLBase_instance(*job.model);
+        }
+    }
+    
+    void ml::complete_read(background_job &job)
+    {
+        bool success = false;
+        
+        if (!job.dataset_path.empty())
+        {
+            success = job.dataset_success;
             
-            if (!success)
+            if (success)
             {
-                error("unable to read model from path: " + model_file_path);
+                set_data_type(job.data_type_);
+            }
+            else
+            {
+                error("unable to read training data from path: " + job.dataset_path);
             }
         }
         
+        if (!job.model_path.empty())
+        {
+            success = job.model_success;
+            
+            if (success)
+            {
+                publish_MLBase_instance(job.model->getTrained() ? job.model.release() : NULL);
+            }
+            else
+            {
+                error("unable to read model from path: " + job.model_path);
+            }
+        }
+        
+        t_atom a_success;
+        
         SetInt(a_success, success);
         ToOutAnything(1, get_s_read(), 1, &a_success);
     }
@@ -409,9 +571,372 @@ namespace ml
         ToOutAnything(1, get_s_clear(), 1, &status);
     }
     
+    GRT::UINT ml::get_num_samples() const
+    {
+        GRT::UINT numSamples = 0;
+        const data_type data_type = get_data_type();
+        
+        if (data_type == LABELLED_REGRESSION)
+        {
+            numSamples = regression_data.getNumSamples();
+        }
+        else if (data_type == LABELLED_CLASSIFICATION)
+        {
+            numSamples = classification_data.getNumSamples();
+        }
+        else if (data_type == LABELLED_TIME_SERIES_CLASSIFICATION)
+        {
+            numSamples = time_series_classification_data.getNumSamples();
+        }
+        else if (data_type == UNLABELLED_CLASSIFICATION)
+        {
+            numSamples = unlabelled_data.getNumSamples();
+        }
+        
+        return numSamples;
+    }
+    
+    bool ml::get_training() const
+    {
+        return job_ && job_->selector == get_s_train();
+    }
+    
+    bool ml::get_busy() const
+    {
+        return job_.get() != NULL;
+    }
+    
+    bool ml::get_staging_busy() const
+    {
+        return job_ && job_->uses_staging;
+    }
+    
+    bool ml::check_busy_with_error() const
+    {
+        if (get_busy())
+        {
+            error("'" + std::string(GetString(job_->selector)) + "' in progress, wait for the '" + GetString(job_->selector) + "' message from the right outlet");
+            return true;
+        }
+        return false;
+    }
+    
+    bool ml::check_datasets_busy_with_error(const t_symbol *s) const
+    {
+        if (get_busy() && job_->replaces_datasets)
+        {
+            error("'" + std::string(GetString(s)) + "' ignored during '" + GetString(job_->selector) + "', wait for the '" + GetString(job_->selector) + "' message from the right outlet");
+            return true;
+        }
+        return false;
+    }
+    
+    GRT::MLBase *ml::get_active_MLBase_instance()
+    {
+        return active_instance.load();
+    }
+    
+    const GRT::MLBase *ml::get_active_MLBase_instance() const
+    {
+        return active_instance.load();
+    }
+    
+    uint32_t ml::get_active_generation() const
+    {
+        return active_generation.load();
+    }
+    
+    void ml::publish_MLBase_instance(GRT::MLBase *instance)
+    {
+        GRT::MLBase *previous = active_instance.exchange(instance);
+        ++active_generation;
+        
+        // A 'map' on another thread may still be using the previous instance, so it is kept alive until the next swap. After that it is
+        // kept as a spare for take_spare_MLBase_instance() until the swap after
+        spare_instance = std::move(retired_instance);
+        retired_instance.reset(previous);
+    }
+    
+    GRT::MLBase *ml::take_spare_MLBase_instance()
+    {
+        return spare_instance.release();
+    }
+    
+    void ml::publish_MLBase_instance()
+    {
+        const GRT::MLBase &mlBase = get_MLBase_instance();
+        
+        publish_MLBase_instance(mlBase.getTrained() ? copy_MLBase_instance(mlBase) : NULL);
+    }
+    
+    void ml::touch_active_MLBase_instance()
+    {
+        ++active_generation;
+    }
+    
+    GRT::MLBase *ml::copy_MLBase_instance(const GRT::MLBase &instance) const
+    {
+        return NULL;
+    }
+    
+    bool ml::set_MLBase_instance(const GRT::MLBase &instance)
+    {
+        return false;
+    }
+    
+    bool ml::init_training_instance(GRT::MLBase &instance)
+    {
+        return true;
+    }
+    
+    // Messages that only use the active model or the datasets, these are safe while the staging model is training
+    // 'read' and 'train' only touch the staging model once their background job has completed
+    bool ml::is_active_message(const t_symbol *s) const
+    {
+        return s == get_s_map() || s == get_s_map_batch() || s == get_s_add() || s == get_s_record() || s == get_s_write() || s == get_s_help() || s == get_s_train() || s == get_s_read();
+    }
+    
+    bool ml::CbMethodHandler(int inlet, const t_symbol *s, int argc, const t_atom *argv)
+    {
+        const bool uses_staging = !is_active_message(s);
+        
+        // Jobs like 'write' only use their own snapshot, 'read' and 'train' will replace the staging model when they complete
+        if (uses_staging && get_staging_busy())
+        {
+            error("'" + std::string(GetString(s)) + "' ignored during '" + GetString(job_->selector) + "', wait for the '" + GetString(job_->selector) + "' message from the right outlet");
+            return true;
+        }
+        
+        unsupported_message = false;
+        
+        bool handled = flext_base::CbMethodHandler(inlet, s, argc, argv);
+        
+        // Attribute setters, 'read' and 'clear' change the staging model, publish it so that 'map' picks up the change
+        if (handled && uses_staging && !unsupported_message && strncmp(GetString(s), "get", 3) != 0 && changes_prediction(s))
+        {
+            publish_MLBase_instance();
+        }
+        
+        return handled;
+    }
+    
+    // 'probs' only changes what 'map' outputs
+    bool ml::changes_prediction(const t_symbol *s) const
+    {
+        return s != get_s_probs();
+    }
+    
+    bool ml::is_symbol_in(const t_symbol *s, const char *const *names)
+    {
+        for (; *names != NULL; ++names)
+        {
+            if (strcmp(GetString(s), *names) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void ml::copy_dataset_to_job(background_job &job) const
+    {
+        if (job.data_type_ == LABELLED_CLASSIFICATION)
+        {
+            job.classification_data = classification_data;
+        }
+        else if (job.data_type_ == LABELLED_REGRESSION)
+        {
+            job.regression_data = regression_data;
+        }
+        else if (job.data_type_ == LABELLED_TIME_SERIES_CLASSIFICATION)
+        {
+            job.time_series_classification_data = time_series_classification_data;
+        }
+        else if (job.data_type_ == UNLABELLED_CLASSIFICATION)
+        {
+            job.unlabelled_data = unlabelled_data;
+        }
+    }
+    
+    void ml::copy_dataset_from_job(const background_job &job)
+    {
+        if (job.data_type_ == LABELLED_CLASSIFICATION)
+        {
+            classification_data = job.classification_data;
+        }
+        else if (job.data_type_ == LABELLED_REGRESSION)
+        {
+            regression_data = job.regression_data;
+        }
+        else if (job.data_type_ == LABELLED_TIME_SERIES_CLASSIFICATION)
+        {
+            time_series_classification_data = job.time_series_classification_data;
+        }
+        else if (job.data_type_ == UNLABELLED_CLASSIFICATION)
+        {
+            unlabelled_data = job.unlabelled_data;
+        }
+    }
+    
+    void ml::start_job(std::shared_ptr<background_job> job, void (ml::*work)(background_job &))
+    {
+        job_ = job;
+        
+        job_thread = std::thread([this, job, work]()
+        {
+            (this->*work)(*job);
+            job->complete = true;
+        });
+        
+        // Poll for completion from the scheduler so the result is output on the main thread
+        job_timer.Periodic(k_job_poll_interval);
+    }
+    
+    // GRT training and file I/O can't be interrupted, so we have to wait for the worker
+    void ml::stop_job()
+    {
+        job_timer.Reset();
+        
+        if (job_thread.joinable())
+        {
+            job_thread.join();
+        }
+    }
+    
+    void ml::start_job(std::shared_ptr<background_job> job)
+    {
+        start_job(job, &ml::run_job);
+    }
+    
+    void ml::run_job(background_job &job)
+    {
+    }
+    
+    void ml::complete_job(background_job &job)
+    {
+    }
+    
     void ml::train()
     {
-        error("function not implemented");
+        if (check_busy_with_error())
+        {
+            return;
+        }
+        
+        if (get_num_samples() == 0)
+        {
+            error("no observations added, use 'add' to add training data");
+            return;
+        }
+        
+        const data_type data_type = get_data_type();
+        
+        if (data_type >= NUM_DATA_TYPES)
+        {
+            error("unhandled data_type:" + std::to_string(data_type));
+            return;
+        }
+        
+        if (!init_training_instance(get_MLBase_instance()))
+        {
+            error("unable to initialise model for training");
+            return;
+        }
+        
+        // The dataset is copied so that 'add' can continue while we train
+        std::shared_ptr<background_job> job = std::make_shared<background_job>(get_s_train(), data_type);
+        
+        copy_dataset_to_job(*job);
+        start_job(job, &ml::train_job);
+    }
+    
+    void ml::train_job(background_job &job)
+    {
+        GRT::MLBase &mlBase = get_MLBase_instance();
+        
+        if (job.data_type_ == LABELLED_CLASSIFICATION)
+        {
+            job.model_success = mlBase.train(job.classification_data);
+        }
+        else if (job.data_type_ == LABELLED_REGRESSION)
+        {
+            job.model_success = mlBase.train(job.regression_data);
+        }
+        else if (job.data_type_ == LABELLED_TIME_SERIES_CLASSIFICATION)
+        {
+            job.model_success = mlBase.train(job.time_series_classification_data);
+        }
+        else if (job.data_type_ == UNLABELLED_CLASSIFICATION)
+        {
+            job.model_success = mlBase.train(job.unlabelled_data);
+        }
+        
+        if (job.model_success)
+        {
+            // Copy on this thread so that publishing the result on the main thread is just a pointer swap
+            job.model.reset(copy_MLBase_instance(mlBase));
+        }
+    }
+    
+    void ml::complete_train(background_job &job)
+    {
+        bool success = job.model_success && job.model;
+        
+        if (success)
+        {
+            publish_MLBase_instance(job.model.release());
+            report_training();
+        }
+        else
+        {
+            error("training failed");
+        }
+        
+        t_atom a_success;
+        
+        SetInt(a_success, success);
+        ToOutAnything(1, get_s_train(), 1, &a_success);
+    }
+    
+    void ml::job_tick(void *data)
+    {
+        if (!job_)
+        {
+            return;
+        }
+        
+        // Read before reporting, so that nothing the job did before completing is left unreported
+        const bool complete = job_->complete;
+        
+        report_progress(*job_);
+        
+        if (!complete)
+        {
+            return;
+        }
+        
+        job_timer.Reset();
+        job_thread.join();
+        
+        std::shared_ptr<background_job> job = job_;
+        job_.reset();
+        
+        if (job->selector == get_s_train())
+        {
+            complete_train(*job);
+        }
+        else if (job->selector == get_s_read())
+        {
+            complete_read(*job);
+        }
+        else if (job->selector == get_s_write())
+        {
+            complete_write(*job);
+        }
+        else
+        {
+            complete_job(*job);
+        }
     }
     
     void ml::map(int argc, const t_atom *argv)
@@ -419,8 +944,42 @@ namespace ml
         error("function not implemented");
     }
     
+    void ml::map_batch(int argc, const t_atom *argv)
+    {
+        error("function not implemented");
+    }
+    
+    // 'map_batch' takes the number of dimensions followed by one or more concatenated feature vectors
+    bool ml::get_batch_num_rows(int argc, const t_atom *argv, GRT::UINT numInputFeatures, GRT::UINT &numRows) const
+    {
+        if (argc < 2)
+        {
+            error("invalid input length, must contain the number of dimensions followed by at least one feature vector");
+            return false;
+        }
+        
+        int numDimensions = GetAInt(argv[0]);
+        
+        if (numDimensions < 1 || (unsigned)numDimensions != numInputFeatures)
+        {
+            error("invalid number of dimensions, expected " + std::to_string(numInputFeatures) + ", got " + std::to_string(numDimensions));
+            return false;
+        }
+        
+        if ((argc - 1) % numDimensions != 0)
+        {
+            error("invalid input length, " + std::to_string(argc - 1) + " values is not a multiple of " + std::to_string(numDimensions));
+            return false;
+        }
+        
+        numRows = (argc - 1) / numDimensions;
+        
+        return true;
+    }
+    
     void ml::any(const t_symbol *s, int argc, const t_atom *argv)
     {
+        unsupported_message = true;
         error("messages with the selector '" + std::string(GetString(s)) + "' are not supported");
     }
     
@@ -447,9 +1006,83 @@ namespace ml
         FLEXT_CADDMETHOD_(c, 0, "train", train);
         FLEXT_CADDMETHOD_(c, 0, "clear", clear);
         FLEXT_CADDMETHOD_(c, 0, "map", map);
+        FLEXT_CADDMETHOD_(c, 0, "map_batch", map_batch);
         FLEXT_CADDMETHOD_(c, 0, "help", usage);
     }
     
+    time_series_window::time_series_window()
+    : capacity(0), head(0), count(0)
+    {
+    }
+    
+    void time_series_window::set_capacity(GRT::UINT capacity)
+    {
+        this->capacity = capacity;
+        frames.clear();
+        ordered_frames.clear();
+        clear();
+    }
+    
+    GRT::UINT time_series_window::get_capacity() const
+    {
+        return capacity;
+    }
+    
+    void time_series_window::push_back(const GRT::VectorDouble &frame)
+    {
+        if (capacity == 0)
+        {
+            return;
+        }
+        
+        const GRT::UINT numDimensions = frame.size();
+        
+        if (frames.getNumRows() != capacity || frames.getNumCols() != numDimensions)
+        {
+            frames.resize(capacity, numDimensions);
+            clear();
+        }
+        
+        // head is the oldest frame once the window is full
+        GRT::UINT row = (head + count) % capacity;
+        
+        if (count == capacity)
+        {
+            row = head;
+            head = (head + 1) % capacity;
+        }
+        else
+        {
+            ++count;
+        }
+        
+        std::copy(frame.begin(), frame.end(), frames[row]);
+    }
+    
+    void time_series_window::clear()
+    {
+        head = 0;
+        count = 0;
+    }
+    
+    GRT::MatrixDouble &time_series_window::get_ordered_frames()
+    {
+        const GRT::UINT numDimensions = frames.getNumCols();
+        
+        if (ordered_frames.getNumRows() != count || ordered_frames.getNumCols() != numDimensions)
+        {
+            ordered_frames.resize(count, numDimensions);
+        }
+        
+        for (GRT::UINT index = 0; index < count; ++index)
+        {
+            const double *frame = frames[(head + index) % capacity];
+            std::copy(frame, frame + numDimensions, ordered_frames[index]);
+        }
+        
+        return ordered_frames;
+    }
+    
     void ml::set_data_type(data_type type)
     {
         if (type > NUM_DATA_TYPES)
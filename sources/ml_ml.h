@@ -26,6 +26,9 @@
 
 #include <vector>
 #include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
 
 #include <stdint.h>
 
@@ -37,6 +40,11 @@ namespace ml
     const t_symbol *get_s_write();
     const t_symbol *get_s_probs();
     const t_symbol *get_s_error();
+    const t_symbol *get_s_map();
+    const t_symbol *get_s_map_batch();
+    const t_symbol *get_s_add();
+    const t_symbol *get_s_record();
+    const t_symbol *get_s_help();
 
     void init_global_symbols();
     
@@ -48,6 +56,29 @@ namespace ml
         }
     };
     
+    // Fixed capacity ring buffer holding the most recent frames of a time series
+    class time_series_window
+    {
+    public:
+        time_series_window();
+        
+        void set_capacity(GRT::UINT capacity);
+        GRT::UINT get_capacity() const;
+        
+        void push_back(const GRT::VectorDouble &frame);
+        void clear();
+        
+        // Frames oldest first, rebuilt in a buffer that only reallocates while the window is filling up
+        GRT::MatrixDouble &get_ordered_frames();
+        
+    private:
+        GRT::MatrixDouble frames;
+        GRT::MatrixDouble ordered_frames;
+        GRT::UINT capacity;
+        GRT::UINT head;
+        GRT::UINT count;
+    };
+    
     class ml:
     public base
     {
@@ -55,17 +86,56 @@ namespace ml
         
     public:
         ml();
+        virtual ~ml();
         
     protected:
+        // Train, read and write run on a worker thread using their own copy of the data and model, see start_job()
+        struct background_job
+        {
+            background_job(const t_symbol *selector, data_type data_type_)
+            : selector(selector), data_type_(data_type_), complete(false), dataset_success(false), model_success(false), uses_staging(true), replaces_datasets(false) {}
+            
+            const t_symbol *selector;
+            data_type data_type_;
+            GRT::UnlabelledData unlabelled_data;
+            GRT::ClassificationData classification_data;
+            GRT::TimeSeriesClassificationData time_series_classification_data;
+            GRT::RegressionData regression_data;
+            std::unique_ptr<GRT::MLBase> model;
+            std::string dataset_path;
+            std::string model_path;
+            std::atomic<bool> complete;
+            bool dataset_success;
+            bool model_success;
+            bool uses_staging; // false for jobs that only use their own snapshot, so the staging model can still be changed while they run
+            bool replaces_datasets; // the worker writes the datasets, so 'add' and 'record' are refused until it completes
+        };
+        
+        // Buffers reused by 'map' so that the steady state does no allocation, resized when the active model changes
+        struct inference_context
+        {
+            inference_context() : generation(0) {}
+            
+            uint32_t generation;
+            GRT::VectorDouble query;
+            GRT::MatrixDouble time_series; // the recording as passed to the classifier, which may modify it
+            GRT::Vector<GRT::UINT> labels;
+            std::vector<t_atom> output;
+            std::vector<t_atom> batch_output;
+        };
         
         static void setup(t_classid c);
         
+        // Called by flext before the destructor, while the subclass and its model are still alive
+        virtual void Exit();
+        
         virtual void add(int argc, const t_atom *argv);
-        virtual void write(const t_symbol *path) const;
+        virtual void write(const t_symbol *path);
         virtual void read(const t_symbol *path);
         virtual void train();
         virtual void clear();
         virtual void map(int argc, const t_atom *argv);
+        virtual void map_batch(int argc, const t_atom *argv);
         virtual void usage() const;
         
         void record(bool state);
@@ -76,8 +146,57 @@ namespace ml
         
         virtual GRT::MLBase &get_MLBase_instance() = 0;
         virtual const GRT::MLBase &get_MLBase_instance() const = 0;
-        virtual bool read_specialised_dataset(std::string &path) = 0;
-        virtual bool write_specialised_dataset(std::string &path) const = 0;
+        
+        // Called on the worker thread, these must only touch the datasets in job
+        virtual bool read_specialised_dataset(std::string &path, background_job &job) const = 0;
+        virtual bool write_specialised_dataset(std::string &path, const background_job &job) const = 0;
+        
+        // get_MLBase_instance() is the staging model: attributes, read and train all act on it.
+        // 'map' uses the active model, a copy of the staging model which is swapped in atomically by publish_MLBase_instance()
+        GRT::MLBase *get_active_MLBase_instance();
+        const GRT::MLBase *get_active_MLBase_instance() const;
+        uint32_t get_active_generation() const; // read before get_active_MLBase_instance() so that a swap in between is never missed
+        void publish_MLBase_instance();
+        void publish_MLBase_instance(GRT::MLBase *instance); // takes ownership, NULL if there is no trained model
+        void touch_active_MLBase_instance(); // after the active model has been changed in place, so that caches depending on it are rebuilt
+        
+        // The model published two swaps ago, which no 'map' can still be using. Ownership passes to the caller, who can bring it up to date
+        // and publish it again instead of copying the whole staging model. NULL if there isn't one
+        GRT::MLBase *take_spare_MLBase_instance();
+        virtual GRT::MLBase *copy_MLBase_instance(const GRT::MLBase &instance) const;
+        virtual bool set_MLBase_instance(const GRT::MLBase &instance);
+        virtual bool init_training_instance(GRT::MLBase &instance);
+        
+        // Called whenever recording starts or stops, subclasses that carry state from frame to frame while recording reset it here
+        virtual void reset_recording_state();
+        
+        // Called after a 'train' has succeeded and the staging model holds the result, before the 'train' status message. Subclasses can report on the training here
+        virtual void report_training();
+        
+        // Called on the main thread each time a running job is polled and once more before it completes, so subclasses can output its progress
+        virtual void report_progress(background_job &job);
+        
+        virtual bool CbMethodHandler(int inlet, const t_symbol *s, int argc, const t_atom *argv);
+        
+        // Messages that don't change the staging model, subclasses add their own
+        virtual bool is_active_message(const t_symbol *s) const;
+        
+        // Whether a staging message changes what 'map' computes, only then is the staging model copied and published. Subclasses exclude their training settings
+        virtual bool changes_prediction(const t_symbol *s) const;
+        static bool is_symbol_in(const t_symbol *s, const char *const *names); // names is NULL terminated
+        
+        // Subclass jobs: run_job() is called on the worker thread and complete_job() on the main thread once it has finished
+        void start_job(std::shared_ptr<background_job> job);
+        virtual void run_job(background_job &job);
+        virtual void complete_job(background_job &job);
+        
+        bool get_batch_num_rows(int argc, const t_atom *argv, GRT::UINT numInputFeatures, GRT::UINT &numRows) const;
+        GRT::UINT get_num_samples() const;
+        bool get_training() const;
+        bool get_busy() const;
+        bool get_staging_busy() const; // a job is running that will replace or is using the staging model
+        bool check_busy_with_error() const;
+        bool check_datasets_busy_with_error(const t_symbol *s) const;
                 
         // Flext attribute setters
         void set_scaling(bool scaling);
@@ -92,13 +211,24 @@ namespace ml
         GRT::TimeSeriesClassificationData time_series_classification_data;
         GRT::RegressionData regression_data;
         GRT::MatrixDouble time_series_data;
+        time_series_window recording_window;
         GRT::UINT current_label;
         
         bool probs;
         bool recording;
                 
     private:
-        
+        void start_job(std::shared_ptr<background_job> job, void (ml::*work)(background_job &));
+        void stop_job();
+        void copy_dataset_to_job(background_job &job) const;
+        void copy_dataset_from_job(const background_job &job);
+        void train_job(background_job &job);
+        void read_job(background_job &job);
+        void write_job(background_job &job);
+        void complete_train(background_job &job);
+        void complete_read(background_job &job);
+        void complete_write(background_job &job);
+        void job_tick(void *data);
         void record_(bool state);
         void set_num_inputs(uint16_t num_inputs);
         
@@ -111,14 +241,25 @@ namespace ml
         FLEXT_CALLBACK(train);
         FLEXT_CALLBACK(clear);
         FLEXT_CALLBACK_V(map);
+        FLEXT_CALLBACK_V(map_batch);
         FLEXT_CALLBACK(usage);
+        FLEXT_CALLBACK_T(job_tick);
         
         // Flext attribute wrappers
         FLEXT_CALLVAR_B(get_scaling, set_scaling);
         FLEXT_CALLVAR_B(get_probs, set_probs);
         
         data_type data_type_;
+        bool unsupported_message;
+        
+        std::atomic<GRT::MLBase *> active_instance;
+        std::atomic<uint32_t> active_generation;
+        std::unique_ptr<GRT::MLBase> retired_instance;
+        std::unique_ptr<GRT::MLBase> spare_instance;
         
+        Timer job_timer;
+        std::thread job_thread;
+        std::shared_ptr<background_job> job_;
     };
 
 }
@@ -0,0 +1,580 @@
+/*
+ * ml-lib, a machine learning library for Max and Pure Data
+ * Copyright (C) 2013 Carnegie Mellon University
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ml_simd_h__
+#define ml_simd_h__
+
+#include <vector>
+#include <new>
+#include <cmath>
+#include <algorithm>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define ML_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define ML_SIMD_TARGET_AVX2
+#else
+#define ML_SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define ML_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+namespace ml
+{
+    // Batched dot products and squared distances between one vector and the rows of a matrix, picking AVX2 or NEON at run time.
+    // Rows and the vector must be aligned to simd::alignment and padded with zeros to a multiple of simd::width values, see get_stride().
+    // exp_values() has no alignment or padding requirements
+    namespace simd
+    {
+        static const size_t alignment = 32;
+        static const size_t width = alignment / sizeof(double);
+        
+        enum instruction_set
+        {
+            SCALAR, // sums in index order, the same as a plain loop over the unpadded values
+            AVX2,
+            NEON
+        };
+        
+        // Allocates with the given alignment, the address of the underlying block is kept just in front of the aligned one
+        template <class T>
+        struct aligned_allocator
+        {
+            typedef T value_type;
+            
+            template <class U>
+            struct rebind
+            {
+                typedef aligned_allocator<U> other;
+            };
+            
+            aligned_allocator() {}
+            
+            template <class U>
+            aligned_allocator(const aligned_allocator<U> &) {}
+            
+            T *allocate(size_t count)
+            {
+                void *block = ::operator new(count * sizeof(T) + alignment);
+                const uintptr_t address = (reinterpret_cast<uintptr_t>(block) + alignment) & ~static_cast<uintptr_t>(alignment - 1);
+                
+                reinterpret_cast<void **>(address)[-1] = block;
+                return reinterpret_cast<T *>(address);
+            }
+            
+            void deallocate(T *pointer, size_t)
+            {
+                ::operator delete(reinterpret_cast<void **>(pointer)[-1]);
+            }
+            
+            template <class U>
+            bool operator==(const aligned_allocator<U> &) const { return true; }
+            
+            template <class U>
+            bool operator!=(const aligned_allocator<U> &) const { return false; }
+        };
+        
+        typedef std::vector<double, aligned_allocator<double> > aligned_vector;
+        
+        inline size_t get_stride(size_t num_values)
+        {
+            return (num_values + width - 1) / width * width;
+        }
+        
+        // exp() by range reduction to [-ln 2 / 2, ln 2 / 2] and a degree 12 polynomial, within a few ulp of std::exp()
+        static const double exp_max = 708.0;
+        static const double exp_log2e = 1.4426950408889634;
+        static const double exp_ln2_high = 6.93145751953125e-1;
+        static const double exp_ln2_low = 1.42860682030941723212e-6;
+        static const double exp_coefficients[] = {
+            1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0, 1.0 / 362880.0, 1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0,
+            1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0, 0.5, 1.0, 1.0
+        };
+        static const size_t exp_num_coefficients = sizeof(exp_coefficients) / sizeof(exp_coefficients[0]);
+        
+        inline double exp_polynomial(double x)
+        {
+            x = std::min(std::max(x, -exp_max), exp_max);
+            
+            const double k = std::floor(x * exp_log2e + 0.5);
+            const double r = (x - k * exp_ln2_high) - k * exp_ln2_low;
+            double p = exp_coefficients[0];
+            
+            for (size_t coefficient = 1; coefficient < exp_num_coefficients; ++coefficient)
+            {
+                p = p * r + exp_coefficients[coefficient];
+            }
+            
+            // 2^k built directly in the exponent bits
+            const int64_t bits = (static_cast<int64_t>(k) + 1023) << 52;
+            double power;
+            
+            memcpy(&power, &bits, sizeof(power));
+            
+            return p * power;
+        }
+
+#ifdef ML_SIMD_X86
+        inline bool has_avx2()
+        {
+#if defined(_MSC_VER) && !defined(__clang__)
+            int info[4];
+            
+            __cpuid(info, 0);
+            
+            if (info[0] < 7)
+            {
+                return false;
+            }
+            
+            __cpuid(info, 1);
+            
+            const bool fma = (info[2] & (1 << 12)) != 0;
+            const bool osxsave = (info[2] & (1 << 27)) != 0;
+            const bool avx = (info[2] & (1 << 28)) != 0;
+            
+            // The OS must save the YMM registers
+            if (!fma || !osxsave || !avx || (_xgetbv(0) & 6) != 6)
+            {
+                return false;
+            }
+            
+            __cpuidex(info, 7, 0);
+            
+            return (info[1] & (1 << 5)) != 0;
+#else
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+        }
+        
+        ML_SIMD_TARGET_AVX2 inline double sum_avx2(__m256d values)
+        {
+            const __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(values), _mm256_extractf128_pd(values, 1));
+            return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+        }
+        
+        ML_SIMD_TARGET_AVX2 inline void dot_rows_avx2(const double *rows, size_t num_rows, size_t stride, const double *vector, double *results)
+        {
+            for (size_t row = 0; row < num_rows; ++row)
+            {
+                const double *values = rows + row * stride;
+                __m256d sum = _mm256_setzero_pd();
+                
+                for (size_t index = 0; index < stride; index += width)
+                {
+                    sum = _mm256_fmadd_pd(_mm256_load_pd(values + index), _mm256_load_pd(vector + index), sum);
+                }
+                results[row] = sum_avx2(sum);
+            }
+        }
+        
+        ML_SIMD_TARGET_AVX2 inline void squared_distance_rows_avx2(const double *rows, size_t num_rows, size_t stride, const double *vector, double *results)
+        {
+            for (size_t row = 0; row < num_rows; ++row)
+            {
+                const double *values = rows + row * stride;
+                __m256d sum = _mm256_setzero_pd();
+                
+                for (size_t index = 0; index < stride; index += width)
+                {
+                    const __m256d difference = _mm256_sub_pd(_mm256_load_pd(values + index), _mm256_load_pd(vector + index));
+                    sum = _mm256_fmadd_pd(difference, difference, sum);
+                }
+                results[row] = sum_avx2(sum);
+            }
+        }
+        
+        ML_SIMD_TARGET_AVX2 inline void exp_values_avx2(double *values, size_t count)
+        {
+            size_t index = 0;
+            
+            for (; index + width <= count; index += width)
+            {
+                const __m256d x = _mm256_min_pd(_mm256_max_pd(_mm256_loadu_pd(values + index), _mm256_set1_pd(-exp_max)), _mm256_set1_pd(exp_max));
+                const __m256d k = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(exp_log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+                const __m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(exp_ln2_low), _mm256_fnmadd_pd(k, _mm256_set1_pd(exp_ln2_high), x));
+                __m256d p = _mm256_set1_pd(exp_coefficients[0]);
+                
+                for (size_t coefficient = 1; coefficient < exp_num_coefficients; ++coefficient)
+                {
+                    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_coefficients[coefficient]));
+                }
+                
+                const __m256i exponents = _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(k)), _mm256_set1_epi64x(1023));
+                
+                _mm256_storeu_pd(values + index, _mm256_mul_pd(p, _mm256_castsi256_pd(_mm256_slli_epi64(exponents, 52))));
+            }
+            
+            for (; index < count; ++index)
+            {
+                values[index] = exp_polynomial(values[index]);
+            }
+        }
+        
+        // Two rows of a against two rows of b share their loads, each result is summed in the same order as dot_rows_avx2()
+        ML_SIMD_TARGET_AVX2 inline void multiply_transposed_avx2(const double *a, size_t a_rows, const double *b, size_t b_rows, size_t stride, double *results, size_t result_stride)
+        {
+            size_t row = 0;
+            
+            for (; row + 2 <= a_rows; row += 2)
+            {
+                const double *a0 = a + row * stride;
+                const double *a1 = a0 + stride;
+                double *results0 = results + row * result_stride;
+                double *results1 = results0 + result_stride;
+                size_t column = 0;
+                
+                for (; column + 2 <= b_rows; column += 2)
+                {
+                    const double *b0 = b + column * stride;
+                    const double *b1 = b0 + stride;
+                    __m256d sum00 = _mm256_setzero_pd();
+                    __m256d sum01 = _mm256_setzero_pd();
+                    __m256d sum10 = _mm256_setzero_pd();
+                    __m256d sum11 = _mm256_setzero_pd();
+                    
+                    for (size_t index = 0; index < stride; index += width)
+                    {
+                        const __m256d x0 = _mm256_load_pd(a0 + index);
+                        const __m256d x1 = _mm256_load_pd(a1 + index);
+                        const __m256d y0 = _mm256_load_pd(b0 + index);
+                        const __m256d y1 = _mm256_load_pd(b1 + index);
+                        
+                        sum00 = _mm256_fmadd_pd(x0, y0, sum00);
+                        sum01 = _mm256_fmadd_pd(x0, y1, sum01);
+                        sum10 = _mm256_fmadd_pd(x1, y0, sum10);
+                        sum11 = _mm256_fmadd_pd(x1, y1, sum11);
+                    }
+                    results0[column] = sum_avx2(sum00);
+                    results0[column + 1] = sum_avx2(sum01);
+                    results1[column] = sum_avx2(sum10);
+                    results1[column + 1] = sum_avx2(sum11);
+                }
+                
+                dot_rows_avx2(b + column * stride, b_rows - column, stride, a0, results0 + column);
+                dot_rows_avx2(b + column * stride, b_rows - column, stride, a1, results1 + column);
+            }
+            
+            for (; row < a_rows; ++row)
+            {
+                dot_rows_avx2(b, b_rows, stride, a + row * stride, results + row * result_stride);
+            }
+        }
+        
+        ML_SIMD_TARGET_AVX2 inline void add_scaled_avx2(double scale, const double *values, size_t count, double *results)
+        {
+            const __m256d factor = _mm256_set1_pd(scale);
+            size_t index = 0;
+            
+            for (; index + width <= count; index += width)
+            {
+                _mm256_storeu_pd(results + index, _mm256_fmadd_pd(factor, _mm256_loadu_pd(values + index), _mm256_loadu_pd(results + index)));
+            }
+            
+            for (; index < count; ++index)
+            {
+                results[index] += scale * values[index];
+            }
+        }
+#endif
+
+#ifdef ML_SIMD_NEON
+        inline void dot_rows_neon(const double *rows, size_t num_rows, size_t stride, const double *vector, double *results)
+        {
+            for (size_t row = 0; row < num_rows; ++row)
+            {
+                const double *values = rows + row * stride;
+                float64x2_t low = vdupq_n_f64(0);
+                float64x2_t high = vdupq_n_f64(0);
+                
+                for (size_t index = 0; index < stride; index += width)
+                {
+                    low = vfmaq_f64(low, vld1q_f64(values + index), vld1q_f64(vector + index));
+                    high = vfmaq_f64(high, vld1q_f64(values + index + 2), vld1q_f64(vector + index + 2));
+                }
+                results[row] = vaddvq_f64(vaddq_f64(low, high));
+            }
+        }
+        
+        inline void squared_distance_rows_neon(const double *rows, size_t num_rows, size_t stride, const double *vector, double *results)
+        {
+            for (size_t row = 0; row < num_rows; ++row)
+            {
+                const double *values = rows + row * stride;
+                float64x2_t low = vdupq_n_f64(0);
+                float64x2_t high = vdupq_n_f64(0);
+                
+                for (size_t index = 0; index < stride; index += width)
+                {
+                    const float64x2_t low_difference = vsubq_f64(vld1q_f64(values + index), vld1q_f64(vector + index));
+                    const float64x2_t high_difference = vsubq_f64(vld1q_f64(values + index + 2), vld1q_f64(vector + index + 2));
+                    
+                    low = vfmaq_f64(low, low_difference, low_difference);
+                    high = vfmaq_f64(high, high_difference, high_difference);
+                }
+                results[row] = vaddvq_f64(vaddq_f64(low, high));
+            }
+        }
+        
+        inline void exp_values_neon(double *values, size_t count)
+        {
+            size_t index = 0;
+            
+            for (; index + 2 <= count; index += 2)
+            {
+                const float64x2_t x = vminq_f64(vmaxq_f64(vld1q_f64(values + index), vdupq_n_f64(-exp_max)), vdupq_n_f64(exp_max));
+                const float64x2_t k = vrndnq_f64(vmulq_f64(x, vdupq_n_f64(exp_log2e)));
+                const float64x2_t r = vfmsq_f64(vfmsq_f64(x, k, vdupq_n_f64(exp_ln2_high)), k, vdupq_n_f64(exp_ln2_low));
+                float64x2_t p = vdupq_n_f64(exp_coefficients[0]);
+                
+                for (size_t coefficient = 1; coefficient < exp_num_coefficients; ++coefficient)
+                {
+                    p = vfmaq_f64(vdupq_n_f64(exp_coefficients[coefficient]), p, r);
+                }
+                
+                const int64x2_t exponents = vaddq_s64(vcvtq_s64_f64(k), vdupq_n_s64(1023));
+                
+                vst1q_f64(values + index, vmulq_f64(p, vreinterpretq_f64_s64(vshlq_n_s64(exponents, 52))));
+            }
+            
+            for (; index < count; ++index)
+            {
+                values[index] = exp_polynomial(values[index]);
+            }
+        }
+        
+        // Two rows of a against two rows of b share their loads, each result is summed in the same order as dot_rows_neon()
+        inline void multiply_transposed_neon(const double *a, size_t a_rows, const double *b, size_t b_rows, size_t stride, double *results, size_t result_stride)
+        {
+            size_t row = 0;
+            
+            for (; row + 2 <= a_rows; row += 2)
+            {
+                const double *a0 = a + row * stride;
+                const double *a1 = a0 + stride;
+                double *results0 = results + row * result_stride;
+                double *results1 = results0 + result_stride;
+                size_t column = 0;
+                
+                for (; column + 2 <= b_rows; column += 2)
+                {
+                    const double *b0 = b + column * stride;
+                    const double *b1 = b0 + stride;
+                    float64x2_t low00 = vdupq_n_f64(0), high00 = vdupq_n_f64(0);
+                    float64x2_t low01 = vdupq_n_f64(0), high01 = vdupq_n_f64(0);
+                    float64x2_t low10 = vdupq_n_f64(0), high10 = vdupq_n_f64(0);
+                    float64x2_t low11 = vdupq_n_f64(0), high11 = vdupq_n_f64(0);
+                    
+                    for (size_t index = 0; index < stride; index += width)
+                    {
+                        const float64x2_t x0_low = vld1q_f64(a0 + index), x0_high = vld1q_f64(a0 + index + 2);
+                        const float64x2_t x1_low = vld1q_f64(a1 + index), x1_high = vld1q_f64(a1 + index + 2);
+                        const float64x2_t y0_low = vld1q_f64(b0 + index), y0_high = vld1q_f64(b0 + index + 2);
+                        const float64x2_t y1_low = vld1q_f64(b1 + index), y1_high = vld1q_f64(b1 + index + 2);
+                        
+                        low00 = vfmaq_f64(low00, y0_low, x0_low);
+                        high00 = vfmaq_f64(high00, y0_high, x0_high);
+                        low01 = vfmaq_f64(low01, y1_low, x0_low);
+                        high01 = vfmaq_f64(high01, y1_high, x0_high);
+                        low10 = vfmaq_f64(low10, y0_low, x1_low);
+                        high10 = vfmaq_f64(high10, y0_high, x1_high);
+                        low11 = vfmaq_f64(low11, y1_low, x1_low);
+                        high11 = vfmaq_f64(high11, y1_high, x1_high);
+                    }
+                    results0[column] = vaddvq_f64(vaddq_f64(low00, high00));
+                    results0[column + 1] = vaddvq_f64(vaddq_f64(low01, high01));
+                    results1[column] = vaddvq_f64(vaddq_f64(low10, high10));
+                    results1[column + 1] = vaddvq_f64(vaddq_f64(low11, high11));
+                }
+                
+                dot_rows_neon(b + column * stride, b_rows - column, stride, a0, results0 + column);
+                dot_rows_neon(b + column * stride, b_rows - column, stride, a1, results1 + column);
+            }
+            
+            for (; row < a_rows; ++row)
+            {
+                dot_rows_neon(b, b_rows, stride, a + row * stride, results + row * result_stride);
+            }
+        }
+        
+        inline void add_scaled_neon(double scale, const double *values, size_t count, double *results)
+        {
+            const float64x2_t factor = vdupq_n_f64(scale);
+            size_t index = 0;
+            
+            for (; index + 2 <= count; index += 2)
+            {
+                vst1q_f64(results + index, vfmaq_f64(vld1q_f64(results + index), factor, vld1q_f64(values + index)));
+            }
+            
+            for (; index < count; ++index)
+            {
+                results[index] += scale * values[index];
+            }
+        }
+#endif
+
+        // The fastest instruction set this CPU supports, detected once
+        inline instruction_set get_best_instruction_set()
+        {
+#if defined(ML_SIMD_X86)
+            static const instruction_set best = has_avx2() ? AVX2 : SCALAR;
+            return best;
+#elif defined(ML_SIMD_NEON)
+            return NEON;
+#else
+            return SCALAR;
+#endif
+        }
+        
+        inline void dot_rows(instruction_set instructions, const double *rows, size_t num_rows, size_t stride, const double *vector, double *results)
+        {
+#if defined(ML_SIMD_X86)
+            if (instructions == AVX2)
+            {
+                dot_rows_avx2(rows, num_rows, stride, vector, results);
+                return;
+            }
+#elif defined(ML_SIMD_NEON)
+            if (instructions == NEON)
+            {
+                dot_rows_neon(rows, num_rows, stride, vector, results);
+                return;
+            }
+#endif
+            for (size_t row = 0; row < num_rows; ++row)
+            {
+                const double *values = rows + row * stride;
+                double sum = 0;
+                
+                for (size_t index = 0; index < stride; ++index)
+                {
+                    sum += values[index] * vector[index];
+                }
+                results[row] = sum;
+            }
+        }
+        
+        inline void squared_distance_rows(instruction_set instructions, const double *rows, size_t num_rows, size_t stride, const double *vector, double *results)
+        {
+#if defined(ML_SIMD_X86)
+            if (instructions == AVX2)
+            {
+                squared_distance_rows_avx2(rows, num_rows, stride, vector, results);
+                return;
+            }
+#elif defined(ML_SIMD_NEON)
+            if (instructions == NEON)
+            {
+                squared_distance_rows_neon(rows, num_rows, stride, vector, results);
+                return;
+            }
+#endif
+            for (size_t row = 0; row < num_rows; ++row)
+            {
+                const double *values = rows + row * stride;
+                double sum = 0;
+                
+                for (size_t index = 0; index < stride; ++index)
+                {
+                    const double difference = values[index] - vector[index];
+                    sum += difference * difference;
+                }
+                results[row] = sum;
+            }
+        }
+        
+        // In place, the scalar version is std::exp()
+        inline void exp_values(instruction_set instructions, double *values, size_t count)
+        {
+#if defined(ML_SIMD_X86)
+            if (instructions == AVX2)
+            {
+                exp_values_avx2(values, count);
+                return;
+            }
+#elif defined(ML_SIMD_NEON)
+            if (instructions == NEON)
+            {
+                exp_values_neon(values, count);
+                return;
+            }
+#endif
+            for (size_t index = 0; index < count; ++index)
+            {
+                values[index] = std::exp(values[index]);
+            }
+        }
+        
+        // a times b transposed into results, whose rows are result_stride apart. The rows of a and b are padded to stride like those of
+        // dot_rows(), so that a batch of inputs times a layer's weight matrix is one call
+        inline void multiply_transposed(instruction_set instructions, const double *a, size_t a_rows, const double *b, size_t b_rows, size_t stride, double *results, size_t result_stride)
+        {
+#if defined(ML_SIMD_X86)
+            if (instructions == AVX2)
+            {
+                multiply_transposed_avx2(a, a_rows, b, b_rows, stride, results, result_stride);
+                return;
+            }
+#elif defined(ML_SIMD_NEON)
+            if (instructions == NEON)
+            {
+                multiply_transposed_neon(a, a_rows, b, b_rows, stride, results, result_stride);
+                return;
+            }
+#endif
+            for (size_t row = 0; row < a_rows; ++row)
+            {
+                dot_rows(instructions, b, b_rows, stride, a + row * stride, results + row * result_stride);
+            }
+        }
+        
+        // results += scale * values, no alignment needed
+        inline void add_scaled(instruction_set instructions, double scale, const double *values, size_t count, double *results)
+        {
+#if defined(ML_SIMD_X86)
+            if (instructions == AVX2)
+            {
+                add_scaled_avx2(scale, values, count, results);
+                return;
+            }
+#elif defined(ML_SIMD_NEON)
+            if (instructions == NEON)
+            {
+                add_scaled_neon(scale, values, count, results);
+                return;
+            }
+#endif
+            for (size_t index = 0; index < count; ++index)
+            {
+                results[index] += scale * values[index];
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * ml-lib, a machine learning library for Max and Pure Data
+ * Copyright (C) 2013 Carnegie Mellon University
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of  MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ml_thread_pool_h__
+#define ml_thread_pool_h__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <stddef.h>
+
+namespace ml
+{
+    // Persistent worker threads for spreading a loop across cores. The calling thread takes part in every loop
+    // so a pool of 1 thread runs everything inline. Only one loop may run at a time.
+    class thread_pool
+    {
+    public:
+        thread_pool()
+        : generation(0), stopping(false), count(0), pending(0), invoker(NULL), function(NULL), next(0)
+        {
+        }
+        
+        ~thread_pool()
+        {
+            stop();
+        }
+        
+        // Total number of threads including the caller
+        void set_num_threads(unsigned num_threads)
+        {
+            stop();
+            
+            for (unsigned thread = 1; thread < num_threads; ++thread)
+            {
+                workers.push_back(std::thread(&thread_pool::worker, this, thread, generation));
+            }
+        }
+        
+        unsigned get_num_threads() const
+        {
+            return workers.size() + 1;
+        }
+        
+        // Calls function(index, thread) for every index in [0, count), thread is in [0, get_num_threads()) and can be used to pick per-thread buffers
+        template <class F>
+        void parallel_for(size_t count, const F &function)
+        {
+            if (workers.empty() || count < 2)
+            {
+                for (size_t index = 0; index < count; ++index)
+                {
+                    function(index, 0);
+                }
+                return;
+            }
+            
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                this->count = count;
+                this->pending = workers.size();
+                this->invoker = &invoke<F>;
+                this->function = &function;
+                this->next = 0;
+                ++generation;
+            }
+            
+            start_condition.notify_all();
+            work(0);
+            
+            std::unique_lock<std::mutex> lock(mutex);
+            done_condition.wait(lock, [this]() { return pending == 0; });
+        }
+    
+    private:
+        template <class F>
+        static void invoke(const void *function, size_t index, unsigned thread)
+        {
+            (*static_cast<const F *>(function))(index, thread);
+        }
+        
+        void work(unsigned thread)
+        {
+            for (size_t index = next++; index < count; index = next++)
+            {
+                invoker(function, index, thread);
+            }
+        }
+        
+        void worker(unsigned thread, size_t seen)
+        {
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    start_condition.wait(lock, [this, seen]() { return stopping || generation != seen; });
+                    
+                    if (stopping)
+                    {
+                        return;
+                    }
+                    seen = generation;
+                }
+                
+                work(thread);
+                
+                std::lock_guard<std::mutex> lock(mutex);
+                
+                if (--pending == 0)
+                {
+                    done_condition.notify_one();
+                }
+            }
+        }
+        
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            
+            start_condition.notify_all();
+            
+            for (std::vector<std::thread>::iterator worker = workers.begin(); worker != workers.end(); ++worker)
+            {
+                worker->join();
+            }
+            
+            workers.clear();
+            stopping = false;
+        }
+        
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable start_condition;
+        std::condition_variable done_condition;
+        size_t generation;
+        bool stopping;
+        size_t count;
+        size_t pending;
+        void (*invoker)(const void *, size_t, unsigned);
+        const void *function;
+        std::atomic<size_t> next;
+    };
+}
+
+#endif
@@ -24,9 +24,11 @@ namespace ml
 {
     static const std::string object_name = ML_NAME_PREFIX "linreg";
     
-    class linreg : regression
+    typedef online_regressifier<GRT::LinearRegression, false> online_linear_regression;
+    
+    class linreg : online_regression
     {
-        FLEXT_HEADER_S(linreg, regression, setup);
+        FLEXT_HEADER_S(linreg, online_regression, setup);
         
     public:
         linreg()
@@ -44,12 +46,14 @@ namespace ml
         // Implement pure virtual methods
         GRT::Regressifier &get_Regressifier_instance();
         const GRT::Regressifier &get_Regressifier_instance() const;
+        bool update_online(GRT::Regressifier &instance, const GRT::VectorDouble &input, const GRT::VectorDouble &target);
+        GRT::MLBase *copy_MLBase_instance(const GRT::MLBase &instance) const;
 
     private:
         // Virtual method override
         virtual const std::string get_object_name(void) const { return object_name; };
         
-        GRT::LinearRegression regressifier;
+        online_linear_regression regressifier;
         
     };
     
@@ -63,6 +67,25 @@ namespace ml
     {
         return regressifier;
     }
+    
+    bool linreg::update_online(GRT::Regressifier &instance, const GRT::VectorDouble &input, const GRT::VectorDouble &target)
+    {
+        return static_cast<online_linear_regression &>(instance).update(input, target);
+    }
+    
+    // The GRT regressifier factory would copy a plain GRT::LinearRegression, which can't be updated online
+    GRT::MLBase *linreg::copy_MLBase_instance(const GRT::MLBase &instance) const
+    {
+        online_linear_regression *copy = new online_linear_regression;
+        
+        if (!copy->deepCopyFrom(static_cast<const GRT::Regressifier *>(&instance)))
+        {
+            delete copy;
+            return NULL;
+        }
+        
+        return copy;
+    }
 
     typedef class linreg ml0x2elinreg;
     
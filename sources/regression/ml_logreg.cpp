@@ -24,9 +24,11 @@ namespace ml
 {
     static const std::string object_name = ML_NAME_PREFIX "logreg";
     
-    class logreg : regression
+    typedef online_regressifier<GRT::LogisticRegression, true> online_logistic_regression;
+    
+    class logreg : online_regression
     {
-        FLEXT_HEADER_S(logreg, regression, setup);
+        FLEXT_HEADER_S(logreg, online_regression, setup);
         
     public:
         logreg()
@@ -44,12 +46,14 @@ namespace ml
         // Implement pure virtual methods
         GRT::Regressifier &get_Regressifier_instance();
         const GRT::Regressifier &get_Regressifier_instance() const;
+        bool update_online(GRT::Regressifier &instance, const GRT::VectorDouble &input, const GRT::VectorDouble &target);
+        GRT::MLBase *copy_MLBase_instance(const GRT::MLBase &instance) const;
         
     private:
         // Virtual method override
         virtual const std::string get_object_name(void) const { return object_name; };
                 
-        GRT::LogisticRegression regressifier;
+        online_logistic_regression regressifier;
         
     };
     
@@ -64,6 +68,25 @@ namespace ml
         return regressifier;
     }
     
+    bool logreg::update_online(GRT::Regressifier &instance, const GRT::VectorDouble &input, const GRT::VectorDouble &target)
+    {
+        return static_cast<online_logistic_regression &>(instance).update(input, target);
+    }
+    
+    // The GRT regressifier factory would copy a plain GRT::LogisticRegression, which can't be updated online
+    GRT::MLBase *logreg::copy_MLBase_instance(const GRT::MLBase &instance) const
+    {
+        online_logistic_regression *copy = new online_logistic_regression;
+        
+        if (!copy->deepCopyFrom(static_cast<const GRT::Regressifier *>(&instance)))
+        {
+            delete copy;
+            return NULL;
+        }
+        
+        return copy;
+    }
+    
     typedef class logreg ml0x2elogreg;
     
 #ifdef BUILD_AS_LIBRARY
@@ -18,29 +18,1067 @@
 
 #include "ml_ml.h"
 #include "ml_defaults.h"
+#include "ml_simd.h"
+#include "ml_thread_pool.h"
+
+#include <algorithm>
+#include <random>
+#include <limits>
+#include <cmath>
+#include <mutex>
 
 namespace ml
 {
     const std::string object_name = ML_NAME_PREFIX "mlp";
         
-    typedef enum mlp_layer_
+    typedef enum mlp_layer_
+    {
+        LAYER_INPUT,
+        LAYER_HIDDEN,
+        LAYER_OUTPUT,
+        MLP_NUM_LAYERS
+    }
+    mlp_layer;
+    
+    typedef enum mlp_rate_schedule_
+    {
+        RATE_CONSTANT,
+        RATE_STEP,
+        RATE_EXPONENTIAL,
+        RATE_PLATEAU,
+        MLP_NUM_RATE_SCHEDULES
+    }
+    mlp_rate_schedule;
+    
+    GRT::Neuron::Type get_grt_neuron_type(int type)
+    {
+        if (type >= GRT::Neuron::Type::NUMBER_OF_ACTIVATION_FUNCTIONS)
+        {
+            throw grt_type_exception();
+        }
+        return static_cast<GRT::Neuron::Type>(type);
+    }
+    
+    // GRT's MLP with the trained network flattened into contiguous, aligned per-layer weight matrices. The input scaling is folded into
+    // the weights and biases of the input layer and the output scaling into the output layer, so predict_() is two SIMD matrix-vector
+    // products and three activation loops
+    class compiled_mlp : public GRT::MLP
+    {
+    public:
+        compiled_mlp()
+        : compiled(false), instructions(simd::get_best_instruction_set()), num_inputs(0), num_hidden(0), num_outputs(0), input_stride(0), hidden_stride(0), batch_size(1),
+        parallel_restarts(false), patience(0), rate_schedule(RATE_CONSTANT), rate_decay(0.5), rate_decay_epochs(10)
+        {
+        }
+        
+        // False while GRT's own predict_() is used, e.g. for networks with mixed activation functions in a layer
+        bool get_compiled() const { return compiled; }
+        
+        // Above 1, training runs backpropagation over batches of this many samples on the flattened network instead of GRT's per-sample training.
+        // The flattened network is also trained, one sample at a time, for early stopping and training rate schedules. Its random restarts
+        // run in parallel and are seeded by their index, so it trains the same network every time, unlike GRT's
+        void set_batch_size(GRT::UINT batch_size) { this->batch_size = batch_size; }
+        GRT::UINT get_batch_size() const { return batch_size; }
+        
+        // Trains more than one random restart on the flattened network for its parallel, seeded restarts. GRT's MLP draws its initial
+        // weights from generators it seeds itself, so its own restarts can neither be seeded nor trained as independent copies
+        void set_parallel_restarts(bool parallel_restarts) { this->parallel_restarts = parallel_restarts; }
+        bool get_parallel_restarts() const { return parallel_restarts; }
+        
+        // Above 0, training stops once the validation error, or the training error without a validation set, hasn't improved for this many epochs
+        // and the network from the best epoch is kept
+        void set_patience(GRT::UINT patience) { this->patience = patience; }
+        GRT::UINT get_patience() const { return patience; }
+        
+        // The training rate is multiplied by rate_decay every rate_decay_epochs epochs (RATE_STEP), continuously at that pace (RATE_EXPONENTIAL),
+        // or after rate_decay_epochs epochs without improvement (RATE_PLATEAU)
+        void set_rate_schedule(mlp_rate_schedule rate_schedule) { this->rate_schedule = rate_schedule; }
+        mlp_rate_schedule get_rate_schedule() const { return rate_schedule; }
+        void set_rate_decay(double rate_decay) { this->rate_decay = rate_decay; }
+        double get_rate_decay() const { return rate_decay; }
+        void set_rate_decay_epochs(GRT::UINT rate_decay_epochs) { this->rate_decay_epochs = rate_decay_epochs; }
+        GRT::UINT get_rate_decay_epochs() const { return rate_decay_epochs; }
+        
+        // Whether batch_size, patience, rate_schedule or parallel_restarts ask for the flattened network's training, which classification only uses
+        // without null rejection
+        bool get_trains_flattened() const;
+        
+        struct epoch_error
+        {
+            GRT::UINT restart;
+            GRT::UINT epoch;
+            double training_error;
+            double validation_error; // NaN without a validation set
+        };
+        
+        // Moves out the errors of the epochs trained since the last call, can be called while another thread is training
+        void take_epoch_errors(std::vector<epoch_error> &errors);
+        
+        // In place, getRegressionData() returns a copy
+        const GRT::VectorDouble &get_regression_data() const { return regressionData; }
+        const GRT::VectorDouble &get_class_likelihoods() const { return classLikelihoods; }
+        
+        bool deepCopyFrom(const GRT::Regressifier *regressifier);
+        bool train_(GRT::ClassificationData &trainingData);
+        bool train_(GRT::RegressionData &trainingData);
+        bool predict_(GRT::VectorDouble &inputVector);
+        bool load(std::fstream &file);
+        bool clear();
+        
+        using GRT::MLP::train_;
+        using GRT::MLP::predict_;
+        using GRT::MLP::load;
+        
+    private:
+        struct layer
+        {
+            layer() : activation(GRT::Neuron::LINEAR), gamma(0) {}
+            
+            GRT::UINT activation;
+            double gamma;
+            simd::aligned_vector weights; // a row per neuron, padded to the stride of the previous layer's outputs
+            std::vector<double> biases;
+        };
+        
+        // Input layer outputs, which GRT doesn't train, computed once per sample with rows padded to input_stride
+        struct sample_set
+        {
+            sample_set() : size(0) {}
+            
+            GRT::UINT size;
+            simd::aligned_vector inputs;
+            std::vector<double> targets;
+        };
+        
+        bool train_mini_batch(GRT::RegressionData &trainingData, bool classification);
+        void train_network(GRT::UINT restart, layer &hidden, layer &output, const sample_set &training, const sample_set &validation, std::mt19937 &random, double &training_error, double &validation_error);
+        void prepare_samples(const GRT::RegressionData &data, const layer &input, sample_set &samples);
+        double get_error(const layer &hidden, const layer &output, const sample_set &samples, double *exponent) const;
+        void set_sizes();
+        void compile();
+        bool compile_layer(const GRT::Vector<GRT::Neuron> &neurons, GRT::UINT num_weights, size_t stride, layer &compiled_layer) const;
+        bool verify();
+        void feedforward(const double *inputVector);
+        void feedforward_layer(const layer &compiled_layer, const double *inputs, GRT::UINT num_neurons, size_t stride, double *values, double *exponent) const;
+        void set_results();
+        void activate(GRT::UINT activation, double gamma, double *values, size_t count, double *exponent) const; // exponent is scratch for count values
+        static double get_derivative(GRT::UINT activation, double gamma, double value);
+        
+        bool compiled;
+        simd::instruction_set instructions;
+        GRT::UINT num_inputs;
+        GRT::UINT num_hidden;
+        GRT::UINT num_outputs;
+        size_t input_stride;
+        size_t hidden_stride;
+        layer input_layer; // one weight per neuron
+        layer hidden_layer;
+        layer output_layer;
+        std::vector<double> output_scales; // regression output scaling when the output layer isn't linear, applied after the activation
+        std::vector<double> output_offsets;
+        simd::aligned_vector input_outputs;
+        simd::aligned_vector hidden_outputs;
+        std::vector<double> outputs;
+        std::vector<double> exponents; // activate() scratch for predict_()
+        GRT::UINT batch_size;
+        bool parallel_restarts;
+        GRT::UINT patience;
+        mlp_rate_schedule rate_schedule;
+        double rate_decay;
+        GRT::UINT rate_decay_epochs;
+        std::mutex epoch_mutex;
+        std::vector<epoch_error> epoch_errors;
+    };
+    
+    bool compiled_mlp::deepCopyFrom(const GRT::Regressifier *regressifier)
+    {
+        if (!GRT::MLP::deepCopyFrom(regressifier))
+        {
+            return false;
+        }
+        
+        const compiled_mlp *source = dynamic_cast<const compiled_mlp *>(regressifier);
+        
+        if (source != NULL)
+        {
+            batch_size = source->batch_size;
+            parallel_restarts = source->parallel_restarts;
+            patience = source->patience;
+            rate_schedule = source->rate_schedule;
+            rate_decay = source->rate_decay;
+            rate_decay_epochs = source->rate_decay_epochs;
+        }
+        
+        compile();
+        
+        return true;
+    }
+    
+    bool compiled_mlp::train_(GRT::ClassificationData &trainingData)
+    {
+        compiled = false;
+        
+        // GRT's NULL rejection threshold is computed by its own training
+        if (get_trains_flattened() && !getNullRejectionEnabled())
+        {
+            // One target per class as in GRT, which predicts the index of the largest output plus one as the class label
+            GRT::RegressionData regression_data = trainingData.reformatAsRegressionData();
+            
+            if (!train_mini_batch(regression_data, true))
+            {
+                return false;
+            }
+        }
+        else if (!GRT::MLP::train_(trainingData))
+        {
+            return false;
+        }
+        
+        compile();
+        
+        return true;
+    }
+    
+    bool compiled_mlp::train_(GRT::RegressionData &trainingData)
+    {
+        compiled = false;
+        
+        if (get_trains_flattened())
+        {
+            if (!train_mini_batch(trainingData, false))
+            {
+                return false;
+            }
+        }
+        else if (!GRT::MLP::train_(trainingData))
+        {
+            return false;
+        }
+        
+        compile();
+        
+        return true;
+    }
+    
+    bool compiled_mlp::get_trains_flattened() const
+    {
+        // Restarts alone only when asked for, so that the defaults train as GRT does
+        return batch_size > 1 || patience > 0 || rate_schedule != RATE_CONSTANT || (parallel_restarts && getNumRandomTrainingIterations() > 1);
+    }
+    
+    void compiled_mlp::take_epoch_errors(std::vector<epoch_error> &errors)
+    {
+        std::lock_guard<std::mutex> lock(epoch_mutex);
+        
+        errors.swap(epoch_errors);
+        epoch_errors.clear();
+    }
+    
+    // Follows GRT's MLP training: scaling to [-1, 1], the validation split, random restarts keeping the best network and stopping
+    // on min_change, but the gradient of a whole batch is applied at once, with momentum. The forward pass is one matrix product per
+    // layer for the whole batch, the deltas and gradients are SIMD row updates. The restarts are independent, so they are spread
+    // across a thread pool. Every epoch's errors are logged for take_epoch_errors()
+    bool compiled_mlp::train_mini_batch(GRT::RegressionData &trainingData, bool classification)
+    {
+        trained = false;
+        set_sizes();
+        
+        if (trainingData.getNumSamples() == 0 || trainingData.getNumInputDimensions() != num_inputs || trainingData.getNumTargetDimensions() != num_outputs)
+        {
+            return false;
+        }
+        
+        layer input;
+        layer hidden;
+        layer output;
+        
+        // Only the activations and gamma are used, the weights are randomised below
+        if (
+            !compile_layer(getInputLayer(), 1, 1, input) ||
+            !compile_layer(getHiddenLayer(), num_inputs, input_stride, hidden) ||
+            !compile_layer(getOutputLayer(), num_hidden, hidden_stride, output) ||
+            hidden.gamma == 0 || output.gamma == 0
+            )
+        {
+            return false;
+        }
+        
+        GRT::Vector<GRT::MinMax> input_ranges;
+        GRT::Vector<GRT::MinMax> target_ranges;
+        
+        if (useScaling)
+        {
+            input_ranges = trainingData.getInputRanges();
+            target_ranges = trainingData.getTargetRanges();
+            trainingData.scale(input_ranges, target_ranges, -1.0, 1.0);
+        }
+        
+        GRT::RegressionData validationData;
+        
+        if (getUseValidationSet())
+        {
+            validationData = trainingData.partition(100 - getValidationSetSize());
+            
+            if (trainingData.getNumSamples() == 0 || validationData.getNumSamples() == 0)
+            {
+                return false;
+            }
+        }
+        
+        sample_set training;
+        sample_set validation;
+        
+        {
+            std::lock_guard<std::mutex> lock(epoch_mutex);
+            epoch_errors.clear();
+        }
+        
+        exponents.assign(std::max(num_inputs, std::max(num_hidden, num_outputs)), 0);
+        prepare_samples(trainingData, input, training);
+        prepare_samples(validationData, input, validation);
+        
+        const GRT::UINT num_restarts = std::max(getNumRandomTrainingIterations(), 1U);
+        std::vector<layer> hidden_layers(num_restarts, hidden);
+        std::vector<layer> output_layers(num_restarts, output);
+        std::vector<double> training_errors(num_restarts, 0);
+        std::vector<double> validation_errors(num_restarts, 0);
+        thread_pool pool;
+        
+        pool.set_num_threads(std::max(1U, std::min<unsigned>(num_restarts, std::thread::hardware_concurrency())));
+        pool.parallel_for(num_restarts, [&](size_t restart, unsigned thread)
+        {
+            // Seeded by restart rather than by thread so that training reproduces whatever the number of cores
+            std::mt19937 random(restart + 1);
+            std::uniform_real_distribution<double> initial(-0.1, 0.1);
+            layer &restart_hidden = hidden_layers[restart];
+            layer &restart_output = output_layers[restart];
+            
+            for (GRT::UINT neuron = 0; neuron < num_hidden; ++neuron)
+            {
+                std::generate(restart_hidden.weights.begin() + neuron * input_stride, restart_hidden.weights.begin() + neuron * input_stride + num_inputs, [&]() { return initial(random); });
+                restart_hidden.biases[neuron] = initial(random) * restart_hidden.gamma;
+            }
+            
+            for (GRT::UINT neuron = 0; neuron < num_outputs; ++neuron)
+            {
+                std::generate(restart_output.weights.begin() + neuron * hidden_stride, restart_output.weights.begin() + neuron * hidden_stride + num_hidden, [&]() { return initial(random); });
+                restart_output.biases[neuron] = initial(random) * restart_output.gamma;
+            }
+            
+            train_network(restart, restart_hidden, restart_output, training, validation, random, training_errors[restart], validation_errors[restart]);
+        });
+        
+        // In restart order, so ties go to the same network every time
+        GRT::UINT best = num_restarts;
+        double best_error = std::numeric_limits<double>::infinity();
+        
+        for (GRT::UINT restart = 0; restart < num_restarts; ++restart)
+        {
+            const double error = validation.size > 0 ? validation_errors[restart] : training_errors[restart];
+            
+            if (error < best_error)
+            {
+                best_error = error;
+                best = restart;
+            }
+        }
+        
+        if (best == num_restarts)
+        {
+            return false;
+        }
+        
+        const layer &best_hidden = hidden_layers[best];
+        const layer &best_output = output_layers[best];
+        
+        // Back into GRT's neurons, which add bias * gamma
+        for (GRT::UINT neuron = 0; neuron < num_hidden; ++neuron)
+        {
+            GRT::Neuron &target = hiddenLayer[neuron];
+            
+            std::copy(best_hidden.weights.begin() + neuron * input_stride, best_hidden.weights.begin() + neuron * input_stride + num_inputs, target.weights.begin());
+            target.bias = best_hidden.biases[neuron] / best_hidden.gamma;
+        }
+        
+        for (GRT::UINT neuron = 0; neuron < num_outputs; ++neuron)
+        {
+            GRT::Neuron &target = outputLayer[neuron];
+            
+            std::copy(best_output.weights.begin() + neuron * hidden_stride, best_output.weights.begin() + neuron * hidden_stride + num_hidden, target.weights.begin());
+            target.bias = best_output.biases[neuron] / best_output.gamma;
+        }
+        
+        if (useScaling)
+        {
+            inputVectorRanges = input_ranges;
+            targetVectorRanges = target_ranges;
+        }
+        
+        // What GRT's training sets besides the weights
+        numInputDimensions = num_inputs;
+        numOutputDimensions = num_outputs;
+        classificationModeActive = classification;
+        trainingError = training_errors[best];
+        trained = true;
+        
+        return true;
+    }
+    
+    void compiled_mlp::train_network(GRT::UINT restart, layer &hidden, layer &output, const sample_set &training, const sample_set &validation, std::mt19937 &random, double &training_error, double &validation_error)
+    {
+        const GRT::UINT num_samples = training.size;
+        const GRT::UINT batch = std::min(batch_size, num_samples);
+        const double initial_rate = getTrainingRate();
+        double learning_rate = initial_rate;
+        const double momentum = getMomentum();
+        std::vector<GRT::UINT> order(num_samples);
+        
+        // A row per sample in the batch, the padding of the input and hidden rows stays zero for the SIMD products
+        simd::aligned_vector input_values(batch * input_stride, 0);
+        simd::aligned_vector hidden_values(batch * hidden_stride, 0);
+        std::vector<double> output_values(batch * num_outputs);
+        std::vector<double> output_deltas(batch * num_outputs);
+        std::vector<double> hidden_deltas(batch * num_hidden);
+        simd::aligned_vector hidden_gradients(hidden.weights.size());
+        simd::aligned_vector output_gradients(output.weights.size());
+        std::vector<double> hidden_bias_gradients(num_hidden);
+        std::vector<double> output_bias_gradients(num_outputs);
+        std::vector<double> hidden_updates(hidden.weights.size(), 0);
+        std::vector<double> output_updates(output.weights.size(), 0);
+        std::vector<double> hidden_bias_updates(num_hidden, 0);
+        std::vector<double> output_bias_updates(num_outputs, 0);
+        std::vector<double> exponent(std::max(num_hidden, num_outputs));
+        double last_error = 0;
+        
+        // The error early stopping and RATE_PLATEAU watch, and the network at its best when there is patience
+        double best_error = std::numeric_limits<double>::infinity();
+        GRT::UINT best_epoch = 0;
+        GRT::UINT decay_epoch = 0;
+        layer best_hidden;
+        layer best_output;
+        double best_training_error = 0;
+        double best_validation_error = 0;
+        
+        for (GRT::UINT sample = 0; sample < num_samples; ++sample)
+        {
+            order[sample] = sample;
+        }
+        
+        for (GRT::UINT epoch = 0; epoch < getMaxNumEpochs(); ++epoch)
+        {
+            switch (rate_schedule)
+            {
+                case RATE_STEP:
+                    learning_rate = initial_rate * std::pow(rate_decay, static_cast<double>(epoch / rate_decay_epochs));
+                    break;
+                case RATE_EXPONENTIAL:
+                    learning_rate = initial_rate * std::pow(rate_decay, static_cast<double>(epoch) / rate_decay_epochs);
+                    break;
+                default:
+                    break;
+            }
+            
+            if (getRandomiseTrainingOrder())
+            {
+                for (GRT::UINT sample = num_samples - 1; sample > 0; --sample)
+                {
+                    std::swap(order[sample], order[random() % (sample + 1)]);
+                }
+            }
+            
+            double squared_error = 0;
+            
+            for (GRT::UINT start = 0; start < num_samples; start += batch)
+            {
+                const GRT::UINT count = std::min(batch, num_samples - start);
+                
+                // The batch's inputs, gathered in training order
+                for (GRT::UINT row = 0; row < count; ++row)
+                {
+                    const double *inputs = &training.inputs[order[start + row] * input_stride];
+                    
+                    std::copy(inputs, inputs + input_stride, input_values.begin() + row * input_stride);
+                }
+                
+                // Forward pass, each layer's weighted sums for the whole batch as one matrix product
+                simd::multiply_transposed(instructions, input_values.data(), count, hidden.weights.data(), num_hidden, input_stride, hidden_values.data(), hidden_stride);
+                
+                for (GRT::UINT row = 0; row < count; ++row)
+                {
+                    double *hidden_row = &hidden_values[row * hidden_stride];
+                    
+                    for (GRT::UINT neuron = 0; neuron < num_hidden; ++neuron)
+                    {
+                        hidden_row[neuron] += hidden.biases[neuron];
+                    }
+                    activate(hidden.activation, hidden.gamma, hidden_row, num_hidden, exponent.data());
+                }
+                
+                simd::multiply_transposed(instructions, hidden_values.data(), count, output.weights.data(), num_outputs, hidden_stride, output_values.data(), num_outputs);
+                
+                // Deltas, error = target - output as in GRT
+                for (GRT::UINT row = 0; row < count; ++row)
+                {
+                    const double *targets = &training.targets[order[start + row] * num_outputs];
+                    const double *hidden_row = &hidden_values[row * hidden_stride];
+                    double *output_row = &output_values[row * num_outputs];
+                    double *output_delta = &output_deltas[row * num_outputs];
+                    double *hidden_delta = &hidden_deltas[row * num_hidden];
+                    
+                    for (GRT::UINT neuron = 0; neuron < num_outputs; ++neuron)
+                    {
+                        output_row[neuron] += output.biases[neuron];
+                    }
+                    activate(output.activation, output.gamma, output_row, num_outputs, exponent.data());
+                    
+                    for (GRT::UINT neuron = 0; neuron < num_outputs; ++neuron)
+                    {
+                        const double error = targets[neuron] - output_row[neuron];
+                        
+                        squared_error += error * error;
+                        output_delta[neuron] = get_derivative(output.activation, output.gamma, output_row[neuron]) * error;
+                    }
+                    
+                    std::fill(hidden_delta, hidden_delta + num_hidden, 0.0);
+                    
+                    for (GRT::UINT neuron = 0; neuron < num_outputs; ++neuron)
+                    {
+                        simd::add_scaled(instructions, output_delta[neuron], &output.weights[neuron * hidden_stride], num_hidden, hidden_delta);
+                    }
+                    
+                    for (GRT::UINT index = 0; index < num_hidden; ++index)
+                    {
+                        hidden_delta[index] *= get_derivative(hidden.activation, hidden.gamma, hidden_row[index]);
+                    }
+                }
+                
+                // Gradients as deltas transposed times the layer inputs, summed over the batch. Whole padded rows, the padding stays zero
+                std::fill(hidden_gradients.begin(), hidden_gradients.end(), 0.0);
+                std::fill(output_gradients.begin(), output_gradients.end(), 0.0);
+                std::fill(hidden_bias_gradients.begin(), hidden_bias_gradients.end(), 0.0);
+                std::fill(output_bias_gradients.begin(), output_bias_gradients.end(), 0.0);
+                
+                for (GRT::UINT row = 0; row < count; ++row)
+                {
+                    const double *inputs = &input_values[row * input_stride];
+                    const double *hidden_row = &hidden_values[row * hidden_stride];
+                    
+                    for (GRT::UINT neuron = 0; neuron < num_outputs; ++neuron)
+                    {
+                        const double delta = output_deltas[row * num_outputs + neuron];
+                        
+                        simd::add_scaled(instructions, delta, hidden_row, hidden_stride, &output_gradients[neuron * hidden_stride]);
+                        output_bias_gradients[neuron] += delta;
+                    }
+                    
+                    for (GRT::UINT neuron = 0; neuron < num_hidden; ++neuron)
+                    {
+                        const double delta = hidden_deltas[row * num_hidden + neuron];
+                        
+                        simd::add_scaled(instructions, delta, inputs, input_stride, &hidden_gradients[neuron * input_stride]);
+                        hidden_bias_gradients[neuron] += delta;
+                    }
+                }
+                
+                // Mean gradient with momentum, GRT steps the bias before it is multiplied by gamma
+                const double step = learning_rate / count;
+                
+                for (size_t index = 0; index < hidden_gradients.size(); ++index)
+                {
+                    hidden_updates[index] = step * hidden_gradients[index] + momentum * hidden_updates[index];
+                    hidden.weights[index] += hidden_updates[index];
+                }
+                
+                for (size_t index = 0; index < output_gradients.size(); ++index)
+                {
+                    output_updates[index] = step * output_gradients[index] + momentum * output_updates[index];
+                    output.weights[index] += output_updates[index];
+                }
+                
+                for (GRT::UINT neuron = 0; neuron < num_hidden; ++neuron)
+                {
+                    hidden_bias_updates[neuron] = step * hidden_bias_gradients[neuron] + momentum * hidden_bias_updates[neuron];
+                    hidden.biases[neuron] += hidden_bias_updates[neuron] * hidden.gamma;
+                }
+                
+                for (GRT::UINT neuron = 0; neuron < num_outputs; ++neuron)
+                {
+                    output_bias_updates[neuron] = step * output_bias_gradients[neuron] + momentum * output_bias_updates[neuron];
+                    output.biases[neuron] += output_bias_updates[neuron] * output.gamma;
+                }
+            }
+            
+            training_error = squared_error / num_samples;
+            validation_error = validation.size > 0 ? get_error(hidden, output, validation, exponent.data()) : std::numeric_limits<double>::quiet_NaN();
+            
+            {
+                const epoch_error logged = {restart, epoch, training_error, validation_error};
+                
+                std::lock_guard<std::mutex> lock(epoch_mutex);
+                epoch_errors.push_back(logged);
+            }
+            
+            const double error = validation.size > 0 ? validation_error : training_error;
+            
+            if (error < best_error)
+            {
+                best_error = error;
+                best_epoch = epoch;
+                
+                if (patience > 0)
+                {
+                    best_hidden = hidden;
+                    best_output = output;
+                    best_training_error = training_error;
+                    best_validation_error = validation_error;
+                }
+            }
+            else if (rate_schedule == RATE_PLATEAU && epoch >= std::max(best_epoch, decay_epoch) + rate_decay_epochs)
+            {
+                learning_rate *= rate_decay;
+                decay_epoch = epoch;
+            }
+            
+            const bool converged = std::fabs(last_error - training_error) <= getMinChange();
+            const bool stalled = patience > 0 && epoch >= best_epoch + patience;
+            
+            if (!std::isfinite(training_error) || (epoch + 1 >= getMinNumEpochs() && (converged || stalled)))
+            {
+                break;
+            }
+            
+            last_error = training_error;
+        }
+        
+        if (patience > 0 && best_error < std::numeric_limits<double>::infinity())
+        {
+            hidden = best_hidden;
+            output = best_output;
+            training_error = best_training_error;
+            validation_error = best_validation_error;
+        }
+    }
+    
+    void compiled_mlp::prepare_samples(const GRT::RegressionData &data, const layer &input, sample_set &samples)
+    {
+        samples.size = data.getNumSamples();
+        samples.inputs.assign(samples.size * input_stride, 0);
+        samples.targets.resize(samples.size * num_outputs);
+        
+        for (GRT::UINT sample = 0; sample < samples.size; ++sample)
+        {
+            const GRT::VectorDouble &inputs = data[sample].getInputVector();
+            const GRT::VectorDouble &targets = data[sample].getTargetVector();
+            double *values = &samples.inputs[sample * input_stride];
+            
+            for (GRT::UINT index = 0; index < num_inputs; ++index)
+            {
+                values[index] = inputs[index] * input.weights[index] + input.biases[index];
+            }
+            activate(input.activation, input.gamma, values, num_inputs, exponents.data());
+            
+            std::copy(targets.begin(), targets.end(), samples.targets.begin() + sample * num_outputs);
+        }
+    }
+    
+    // Mean over the samples of the summed squared output errors
+    double compiled_mlp::get_error(const layer &hidden, const layer &output, const sample_set &samples, double *exponent) const
+    {
+        simd::aligned_vector hidden_row(hidden_stride, 0);
+        std::vector<double> output_row(num_outputs);
+        double squared_error = 0;
+        
+        for (GRT::UINT sample = 0; sample < samples.size; ++sample)
+        {
+            const double *targets = &samples.targets[sample * num_outputs];
+            
+            feedforward_layer(hidden, &samples.inputs[sample * input_stride], num_hidden, input_stride, hidden_row.data(), exponent);
+            feedforward_layer(output, hidden_row.data(), num_outputs, hidden_stride, output_row.data(), exponent);
+            
+            for (GRT::UINT neuron = 0; neuron < num_outputs; ++neuron)
+            {
+                const double error = targets[neuron] - output_row[neuron];
+                squared_error += error * error;
+            }
+        }
+        
+        return samples.size > 0 ? squared_error / samples.size : 0;
+    }
+    
+    bool compiled_mlp::load(std::fstream &file)
+    {
+        compiled = false;
+        
+        if (!GRT::MLP::load(file))
+        {
+            return false;
+        }
+        
+        compile();
+        
+        return true;
+    }
+    
+    bool compiled_mlp::clear()
+    {
+        compiled = false;
+        
+        return GRT::MLP::clear();
+    }
+    
+    bool compiled_mlp::predict_(GRT::VectorDouble &inputVector)
+    {
+        // GRT reports the errors
+        if (!compiled || !getTrained() || inputVector.size() != num_inputs)
+        {
+            return GRT::MLP::predict_(inputVector);
+        }
+        
+        feedforward(inputVector.data());
+        set_results();
+        
+        return true;
+    }
+    
+    bool compiled_mlp::compile_layer(const GRT::Vector<GRT::Neuron> &neurons, GRT::UINT num_weights, size_t stride, layer &compiled_layer) const
+    {
+        if (neurons.empty())
+        {
+            return false;
+        }
+        
+        compiled_layer.activation = neurons[0].activationFunction;
+        compiled_layer.gamma = neurons[0].gamma;
+        compiled_layer.weights.assign(neurons.size() * stride, 0);
+        compiled_layer.biases.resize(neurons.size());
+        
+        for (GRT::UINT neuron = 0; neuron < neurons.size(); ++neuron)
+        {
+            const GRT::Neuron &source = neurons[neuron];
+            
+            if (source.weights.size() != num_weights || source.activationFunction != compiled_layer.activation || source.gamma != compiled_layer.gamma)
+            {
+                return false;
+            }
+            
+            std::copy(source.weights.begin(), source.weights.end(), compiled_layer.weights.begin() + neuron * stride);
+            compiled_layer.biases[neuron] = source.bias * source.gamma;
+        }
+        
+        return true;
+    }
+    
+    void compiled_mlp::set_sizes()
+    {
+        num_inputs = getNumInputNeurons();
+        num_hidden = getNumHiddenNeurons();
+        num_outputs = getNumOutputNeurons();
+        input_stride = simd::get_stride(num_inputs);
+        hidden_stride = simd::get_stride(num_hidden);
+    }
+    
+    void compiled_mlp::compile()
+    {
+        compiled = false;
+        
+        // GRT's NULL rejection threshold isn't exposed, so those models keep using GRT's predict_()
+        if (!getTrained() || (getClassificationModeActive() && getNullRejectionEnabled()))
+        {
+            return;
+        }
+        
+        set_sizes();
+        
+        if (
+            !compile_layer(getInputLayer(), 1, 1, input_layer) ||
+            !compile_layer(getHiddenLayer(), num_inputs, input_stride, hidden_layer) ||
+            !compile_layer(getOutputLayer(), num_hidden, hidden_stride, output_layer) ||
+            input_layer.biases.size() != num_inputs || hidden_layer.biases.size() != num_hidden || output_layer.biases.size() != num_outputs
+            )
+        {
+            return;
+        }
+        
+        // Scaling to [-1, 1] is affine, GRT maps a constant input to -1
+        if (getScalingEnabled())
+        {
+            const GRT::Vector<GRT::MinMax> ranges = getInputRanges();
+            
+            if (ranges.size() != num_inputs)
+            {
+                return;
+            }
+            
+            for (GRT::UINT input = 0; input < num_inputs; ++input)
+            {
+                const double range = ranges[input].maxValue - ranges[input].minValue;
+                const double scale = range == 0 ? 0 : 2.0 / range;
+                const double offset = -1.0 - ranges[input].minValue * scale;
+                
+                input_layer.biases[input] += input_layer.weights[input] * offset;
+                input_layer.weights[input] *= scale;
+            }
+        }
+        
+        output_scales.assign(num_outputs, 1);
+        output_offsets.assign(num_outputs, 0);
+        
+        // Regression outputs are scaled back from [-1, 1] to the target ranges, through the weights when the output layer is linear
+        if (getScalingEnabled() && !getClassificationModeActive())
+        {
+            const GRT::Vector<GRT::MinMax> ranges = getOutputRanges();
+            
+            if (ranges.size() != num_outputs)
+            {
+                return;
+            }
+            
+            for (GRT::UINT output = 0; output < num_outputs; ++output)
+            {
+                output_scales[output] = (ranges[output].maxValue - ranges[output].minValue) / 2.0;
+                output_offsets[output] = ranges[output].minValue + output_scales[output];
+            }
+            
+            if (output_layer.activation == GRT::Neuron::LINEAR)
+            {
+                for (GRT::UINT output = 0; output < num_outputs; ++output)
+                {
+                    double *weights = &output_layer.weights[output * hidden_stride];
+                    
+                    for (GRT::UINT hidden = 0; hidden < num_hidden; ++hidden)
+                    {
+                        weights[hidden] *= output_scales[output];
+                    }
+                    output_layer.biases[output] = output_layer.biases[output] * output_scales[output] + output_offsets[output];
+                }
+                
+                output_scales.assign(num_outputs, 1);
+                output_offsets.assign(num_outputs, 0);
+            }
+        }
+        
+        input_outputs.assign(input_stride, 0);
+        hidden_outputs.assign(hidden_stride, 0);
+        outputs.assign(num_outputs, 0);
+        exponents.assign(std::max(num_inputs, std::max(num_hidden, num_outputs)), 0);
+        
+        compiled = verify();
+    }
+    
+    // Compares against GRT's predict_() at the corners and random points of the input ranges, so a network the compiled
+    // version doesn't reproduce falls back to GRT instead of giving different results
+    bool compiled_mlp::verify()
+    {
+        static const GRT::UINT num_probes = 16;
+        static const double tolerance = 1.0e-9;
+        
+        const GRT::Vector<GRT::MinMax> ranges = getInputRanges();
+        const bool scaling = getScalingEnabled() && ranges.size() == num_inputs;
+        std::mt19937 random(1);
+        std::uniform_real_distribution<double> unit(0, 1);
+        GRT::VectorDouble probe(num_inputs);
+        
+        for (GRT::UINT probe_index = 0; probe_index < num_probes; ++probe_index)
+        {
+            for (GRT::UINT input = 0; input < num_inputs; ++input)
+            {
+                const double position = probe_index == 0 ? 0 : probe_index == 1 ? 1 : unit(random);
+                
+                probe[input] = scaling ? ranges[input].minValue + position * (ranges[input].maxValue - ranges[input].minValue) : position * 2 - 1;
+            }
+            
+            feedforward(probe.data());
+            
+            if (!GRT::MLP::predict_(probe))
+            {
+                return false;
+            }
+            
+            for (GRT::UINT output = 0; output < num_outputs; ++output)
+            {
+                const double expected = regressionData[output];
+                
+                if (!(std::fabs(outputs[output] - expected) <= tolerance * std::max(1.0, std::fabs(expected))))
+                {
+                    return false;
+                }
+            }
+            
+            if (getClassificationModeActive())
+            {
+                const GRT::VectorDouble expected_likelihoods = classLikelihoods;
+                const GRT::UINT expected_label = predictedClassLabel;
+                
+                set_results();
+                
+                if (predictedClassLabel != expected_label || classLikelihoods.size() != expected_likelihoods.size())
+                {
+                    return false;
+                }
+                
+                for (GRT::UINT output = 0; output < num_outputs; ++output)
+                {
+                    if (!(std::fabs(classLikelihoods[output] - expected_likelihoods[output]) <= tolerance))
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+        
+        return true;
+    }
+    
+    void compiled_mlp::feedforward(const double *inputVector)
+    {
+        double *values = input_outputs.data();
+        
+        for (GRT::UINT input = 0; input < num_inputs; ++input)
+        {
+            values[input] = inputVector[input] * input_layer.weights[input] + input_layer.biases[input];
+        }
+        activate(input_layer.activation, input_layer.gamma, values, num_inputs, exponents.data());
+        
+        // The padding after the outputs stays zero, so the padded weights multiply zeros
+        double *hidden = hidden_outputs.data();
+        double *output = outputs.data();
+        
+        feedforward_layer(hidden_layer, values, num_hidden, input_stride, hidden, exponents.data());
+        feedforward_layer(output_layer, hidden, num_outputs, hidden_stride, output, exponents.data());
+        
+        for (GRT::UINT neuron = 0; neuron < num_outputs; ++neuron)
+        {
+            output[neuron] = output[neuron] * output_scales[neuron] + output_offsets[neuron];
+        }
+    }
+    
+    void compiled_mlp::feedforward_layer(const layer &compiled_layer, const double *inputs, GRT::UINT num_neurons, size_t stride, double *values, double *exponent) const
+    {
+        simd::dot_rows(instructions, compiled_layer.weights.data(), num_neurons, stride, inputs, values);
+        
+        for (GRT::UINT neuron = 0; neuron < num_neurons; ++neuron)
+        {
+            values[neuron] += compiled_layer.biases[neuron];
+        }
+        activate(compiled_layer.activation, compiled_layer.gamma, values, num_neurons, exponent);
+    }
+    
+    // The same steps as GRT's MLP::predict_() after the feedforward pass
+    void compiled_mlp::set_results()
     {
-        LAYER_INPUT,
-        LAYER_HIDDEN,
-        LAYER_OUTPUT,
-        MLP_NUM_LAYERS
+        regressionData.resize(num_outputs);
+        std::copy(outputs.begin(), outputs.end(), regressionData.begin());
+        
+        if (!getClassificationModeActive())
+        {
+            return;
+        }
+        
+        classLikelihoods.resize(num_outputs);
+        std::copy(outputs.begin(), outputs.end(), classLikelihoods.begin());
+        
+        const double min_value = *std::min_element(classLikelihoods.begin(), classLikelihoods.end());
+        
+        if (min_value < 0)
+        {
+            for (GRT::UINT output = 0; output < num_outputs; ++output)
+            {
+                classLikelihoods[output] += min_value;
+            }
+        }
+        
+        double sum = 0;
+        
+        for (GRT::UINT output = 0; output < num_outputs; ++output)
+        {
+            sum += classLikelihoods[output];
+        }
+        
+        if (sum > 0)
+        {
+            for (GRT::UINT output = 0; output < num_outputs; ++output)
+            {
+                classLikelihoods[output] /= sum;
+            }
+        }
+        
+        GRT::UINT best = 0;
+        
+        for (GRT::UINT output = 1; output < num_outputs; ++output)
+        {
+            if (classLikelihoods[output] > classLikelihoods[best])
+            {
+                best = output;
+            }
+        }
+        
+        maxLikelihood = classLikelihoods[best];
+        predictedClassLabel = best + 1;
     }
-    mlp_layer;
     
-    GRT::Neuron::Type get_grt_neuron_type(int type)
+    // GRT's Neuron::fire() activations including its overflow guards, with the exponentials computed in one SIMD pass
+    void compiled_mlp::activate(GRT::UINT activation, double gamma, double *values, size_t count, double *exponent) const
     {
-        if (type >= GRT::Neuron::Type::NUMBER_OF_ACTIVATION_FUNCTIONS)
+        switch (activation)
         {
-            throw grt_type_exception();
+            case GRT::Neuron::SIGMOID:
+                for (size_t index = 0; index < count; ++index)
+                {
+                    exponent[index] = -values[index];
+                }
+                simd::exp_values(instructions, exponent, count);
+                
+                for (size_t index = 0; index < count; ++index)
+                {
+                    const double y = values[index];
+                    values[index] = y < -45.0 ? 0.0 : y > 45.0 ? 1.0 : 1.0 / (1.0 + exponent[index]);
+                }
+                break;
+            case GRT::Neuron::BIPOLAR_SIGMOID:
+                for (size_t index = 0; index < count; ++index)
+                {
+                    exponent[index] = -gamma * values[index];
+                }
+                simd::exp_values(instructions, exponent, count);
+                
+                for (size_t index = 0; index < count; ++index)
+                {
+                    const double y = values[index];
+                    values[index] = y < -45.0 ? 0.0 : y > 45.0 ? 1.0 : 2.0 / (1.0 + exponent[index]) - 1.0;
+                }
+                break;
+            case GRT::Neuron::TANH:
+                for (size_t index = 0; index < count; ++index)
+                {
+                    exponent[index] = 2.0 * values[index];
+                }
+                simd::exp_values(instructions, exponent, count);
+                
+                for (size_t index = 0; index < count; ++index)
+                {
+                    values[index] = 1.0 - 2.0 / (exponent[index] + 1.0);
+                }
+                break;
+            default:
+                break;
         }
-        return static_cast<GRT::Neuron::Type>(type);
     }
     
+    // GRT's Neuron::getDerivative(), from the neuron's output
+    double compiled_mlp::get_derivative(GRT::UINT activation, double gamma, double value)
+    {
+        switch (activation)
+        {
+            case GRT::Neuron::SIGMOID:
+                return value * (1.0 - value);
+            case GRT::Neuron::BIPOLAR_SIGMOID:
+                return gamma * (1.0 - value * value) / 2.0;
+            case GRT::Neuron::TANH:
+                return 1.0 - value * value;
+            default:
+                return 1.0;
+        }
+    }
     
     class mlp : ml
     {
@@ -83,9 +1121,15 @@ namespace ml
             FLEXT_CADDATTR_SET(c, "hidden_activation_function", set_hidden_activation_function);
             FLEXT_CADDATTR_SET(c, "output_activation_function", set_output_activation_function);
             FLEXT_CADDATTR_SET(c, "rand_training_iterations", set_rand_training_iterations);
+            FLEXT_CADDATTR_SET(c, "parallel_restarts", set_parallel_restarts);
             FLEXT_CADDATTR_SET(c, "use_validation_set", set_use_validation_set);
             FLEXT_CADDATTR_SET(c, "validation_set_size", set_validation_set_size);
             FLEXT_CADDATTR_SET(c, "randomize_training_order", set_randomise_training_order);
+            FLEXT_CADDATTR_SET(c, "batch_size", set_batch_size);
+            FLEXT_CADDATTR_SET(c, "patience", set_patience);
+            FLEXT_CADDATTR_SET(c, "rate_schedule", set_rate_schedule);
+            FLEXT_CADDATTR_SET(c, "rate_decay", set_rate_decay);
+            FLEXT_CADDATTR_SET(c, "rate_decay_epochs", set_rate_decay_epochs);
             
             FLEXT_CADDATTR_GET(c, "mode", get_mode);
             FLEXT_CADDATTR_GET(c, "num_outputs", get_num_outputs);
@@ -101,17 +1145,24 @@ namespace ml
             FLEXT_CADDATTR_GET(c, "hidden_activation_function", get_hidden_activation_function);
             FLEXT_CADDATTR_GET(c, "output_activation_function", get_output_activation_function);
             FLEXT_CADDATTR_GET(c, "rand_training_iterations", get_rand_training_iterations);
+            FLEXT_CADDATTR_GET(c, "parallel_restarts", get_parallel_restarts);
             FLEXT_CADDATTR_GET(c, "use_validation_set", get_use_validation_set);
             FLEXT_CADDATTR_GET(c, "validation_set_size", get_validation_set_size);
             FLEXT_CADDATTR_GET(c, "randomize_training_order", get_randomise_training_order);
+            FLEXT_CADDATTR_GET(c, "batch_size", get_batch_size);
+            FLEXT_CADDATTR_GET(c, "patience", get_patience);
+            FLEXT_CADDATTR_GET(c, "rate_schedule", get_rate_schedule);
+            FLEXT_CADDATTR_GET(c, "rate_decay", get_rate_decay);
+            FLEXT_CADDATTR_GET(c, "rate_decay_epochs", get_rate_decay_epochs);
        
             DefineHelp(c, object_name.c_str());
         }
         
         void clear();
-        void train();
         void map(int argc, const t_atom *argv);
+        void map_batch(int argc, const t_atom *argv);
         void error();
+        void report_progress(background_job &job);
         
         // Flext attribute setters
         void set_mode(int mode);
@@ -129,9 +1180,15 @@ namespace ml
         void set_hidden_activation_function(int activation_function);
         void set_output_activation_function(int activation_function);
         void set_rand_training_iterations(int rand_training_iterations);
+        void set_parallel_restarts(bool parallel_restarts);
         void set_use_validation_set(bool use_validation_set);
         void set_validation_set_size(int validation_set_size);
         void set_randomise_training_order(bool randomise_training_order);
+        void set_batch_size(int batch_size);
+        void set_patience(int patience);
+        void set_rate_schedule(int rate_schedule);
+        void set_rate_decay(float rate_decay);
+        void set_rate_decay_epochs(int rate_decay_epochs);
         
         // Flext attribute getters
         void get_mode(int &mode) const;
@@ -149,18 +1206,30 @@ namespace ml
         void get_hidden_activation_function(int &activation_function) const;
         void get_output_activation_function(int &activation_function) const;
         void get_rand_training_iterations(int &rand_training_iterations) const;
+        void get_parallel_restarts(bool &parallel_restarts) const;
         void get_use_validation_set(bool &use_validation_set) const;
         void get_validation_set_size(int &validation_set_size) const;
         void get_randomise_training_order(bool &randomise_training_order) const;
+        void get_batch_size(int &batch_size) const;
+        void get_patience(int &patience) const;
+        void get_rate_schedule(int &rate_schedule) const;
+        void get_rate_decay(float &rate_decay) const;
+        void get_rate_decay_epochs(int &rate_decay_epochs) const;
         
         // Implement pure virtual methods
         GRT::MLBase &get_MLBase_instance();
         const GRT::MLBase &get_MLBase_instance() const;
-        bool read_specialised_dataset(std::string &path);
-        bool write_specialised_dataset(std::string &path) const;
+        bool read_specialised_dataset(std::string &path, background_job &job) const;
+        bool write_specialised_dataset(std::string &path, const background_job &job) const;
+        GRT::MLBase *copy_MLBase_instance(const GRT::MLBase &instance) const;
+        
+        bool changes_prediction(const t_symbol *s) const;
+        bool set_MLBase_instance(const GRT::MLBase &instance);
+        bool init_training_instance(GRT::MLBase &instance);
         
     private:
         void set_activation_function(int activation_function, mlp_layer layer);
+        void prepare_inference_context(const compiled_mlp &active_mlp, uint32_t generation);
         
         // Flext method wrappers
         FLEXT_CALLBACK(error);
@@ -181,19 +1250,27 @@ namespace ml
         FLEXT_CALLVAR_I(get_hidden_activation_function, set_hidden_activation_function);
         FLEXT_CALLVAR_I(get_output_activation_function, set_output_activation_function);
         FLEXT_CALLVAR_I(get_rand_training_iterations, set_rand_training_iterations);
+        FLEXT_CALLVAR_B(get_parallel_restarts, set_parallel_restarts);
         FLEXT_CALLVAR_B(get_use_validation_set, set_use_validation_set);
         FLEXT_CALLVAR_I(get_validation_set_size, set_validation_set_size);
         FLEXT_CALLVAR_B(get_randomise_training_order, set_randomise_training_order);
+        FLEXT_CALLVAR_I(get_batch_size, set_batch_size);
+        FLEXT_CALLVAR_I(get_patience, set_patience);
+        FLEXT_CALLVAR_I(get_rate_schedule, set_rate_schedule);
+        FLEXT_CALLVAR_F(get_rate_decay, set_rate_decay);
+        FLEXT_CALLVAR_I(get_rate_decay_epochs, set_rate_decay_epochs);
 
         // Virtual method override
         virtual const std::string get_object_name(void) const { return object_name; };
         
-        GRT::MLP grt_mlp;
+        compiled_mlp grt_mlp;
         GRT::UINT num_hidden_neurons;
         GRT::Neuron::Type input_activation_function;
         GRT::Neuron::Type hidden_activation_function;
         GRT::Neuron::Type output_activation_function;
         
+        inference_context context;
+        std::vector<compiled_mlp::epoch_error> epoch_errors;
     };
     
     // Flext attribute setters
@@ -392,6 +1469,11 @@ namespace ml
         }
     }
     
+    void mlp::set_parallel_restarts(bool parallel_restarts)
+    {
+        grt_mlp.set_parallel_restarts(parallel_restarts);
+    }
+    
     void mlp::set_use_validation_set(bool use_validation_set)
     {
         bool success = grt_mlp.setUseValidationSet(use_validation_set);
@@ -422,6 +1504,61 @@ namespace ml
         }
     }
     
+    void mlp::set_batch_size(int batch_size)
+    {
+        if (batch_size < 1)
+        {
+            flext::error("batch_size must be 1 or greater, 1 trains one sample at a time");
+            return;
+        }
+        
+        grt_mlp.set_batch_size(batch_size);
+    }
+    
+    void mlp::set_patience(int patience)
+    {
+        if (patience < 0)
+        {
+            flext::error("patience must be 0 or greater, 0 disables early stopping");
+            return;
+        }
+        
+        grt_mlp.set_patience(patience);
+    }
+    
+    void mlp::set_rate_schedule(int rate_schedule)
+    {
+        if (rate_schedule < 0 || rate_schedule >= MLP_NUM_RATE_SCHEDULES)
+        {
+            flext::error("rate_schedule must be between 0 and %d", MLP_NUM_RATE_SCHEDULES - 1);
+            return;
+        }
+        
+        grt_mlp.set_rate_schedule((mlp_rate_schedule)rate_schedule);
+    }
+    
+    void mlp::set_rate_decay(float rate_decay)
+    {
+        if (rate_decay <= 0 || rate_decay > 1)
+        {
+            flext::error("unable to set rate_decay, hint: should be greater than 0 and at most 1");
+            return;
+        }
+        
+        grt_mlp.set_rate_decay(rate_decay);
+    }
+    
+    void mlp::set_rate_decay_epochs(int rate_decay_epochs)
+    {
+        if (rate_decay_epochs < 1)
+        {
+            flext::error("rate_decay_epochs must be 1 or greater");
+            return;
+        }
+        
+        grt_mlp.set_rate_decay_epochs(rate_decay_epochs);
+    }
+    
     // Flext attribute getters
     void mlp::get_mode(int &mode) const
     {
@@ -506,6 +1643,11 @@ namespace ml
     {
         rand_training_iterations = grt_mlp.getNumRandomTrainingIterations();
     }
+    
+    void mlp::get_parallel_restarts(bool &parallel_restarts) const
+    {
+        parallel_restarts = grt_mlp.get_parallel_restarts();
+    }
 
     void mlp::get_use_validation_set(bool &use_validation_set) const
     {
@@ -522,88 +1664,90 @@ namespace ml
         flext::error("function not implemented");
     }
     
+    void mlp::get_batch_size(int &batch_size) const
+    {
+        batch_size = grt_mlp.get_batch_size();
+    }
+    
+    void mlp::get_patience(int &patience) const
+    {
+        patience = grt_mlp.get_patience();
+    }
+    
+    void mlp::get_rate_schedule(int &rate_schedule) const
+    {
+        rate_schedule = grt_mlp.get_rate_schedule();
+    }
+    
+    void mlp::get_rate_decay(float &rate_decay) const
+    {
+        rate_decay = grt_mlp.get_rate_decay();
+    }
+    
+    void mlp::get_rate_decay_epochs(int &rate_decay_epochs) const
+    {
+        rate_decay_epochs = grt_mlp.get_rate_decay_epochs();
+    }
+    
     // Methods
-    // NOTE: MLP is special since it supports both regression and classification, we therefore override these methods
-    void mlp::train()
+    void mlp::clear()
     {
-        const data_type data_type = get_data_type();
-        
-        GRT::UINT numSamples = data_type == LABELLED_CLASSIFICATION ? classification_data.getNumSamples() : regression_data.getNumSamples();
+        grt_mlp.clear();
+        ml::clear();
+    }
         
-        if (numSamples == 0)
-        {
-            flext::error("no observations added, use 'add' to add training data");
-            return;
-        }
+    // GRT's MLP predicts the index of the winning output + 1 as the class label, so those are the labels that go with the likelihoods
+    void mlp::prepare_inference_context(const compiled_mlp &active_mlp, uint32_t generation)
+    {
+        const GRT::UINT numOutputs = active_mlp.getNumOutputNeurons();
+        GRT::Vector<GRT::UINT> &labels = context.labels;
+        std::vector<t_atom> &output = context.output;
         
-        bool success = false;
+        context.query.resize(active_mlp.getNumInputNeurons());
+        labels.clear();
         
-        if (data_type == LABELLED_CLASSIFICATION)
-        {
-            grt_mlp.init(
-                     classification_data.getNumDimensions(),
-                     num_hidden_neurons,
-                     classification_data.getNumClasses(),
-                     input_activation_function,
-                     hidden_activation_function,
-                     output_activation_function
-                     );
-            success = grt_mlp.train(classification_data);
-        }
-        else if (data_type == LABELLED_REGRESSION)
+        // label / likelihood pairs in classification mode, the labels are laid out once here so that 'map' only writes the likelihoods
+        if (active_mlp.getClassificationModeActive())
         {
-            grt_mlp.init(
-                     regression_data.getNumInputDimensions(),
-                     num_hidden_neurons,
-                     regression_data.getNumTargetDimensions(),
-                     input_activation_function,
-                     hidden_activation_function,
-                     output_activation_function
-                     );
-            success = grt_mlp.train(regression_data);
+            output.resize(numOutputs * 2);
+            
+            for (GRT::UINT index = 0; index < numOutputs; ++index)
+            {
+                labels.push_back(index + 1);
+                SetInt(output[index * 2], labels[index]);
+            }
         }
-
-        if (!success)
+        else
         {
-            flext::error("training failed");
+            output.resize(numOutputs);
         }
         
-        t_atom a_success;
-        
-        SetInt(a_success, success);
-        ToOutAnything(1, get_s_train(), 1, &a_success);
+        context.generation = generation;
     }
     
-    void mlp::clear()
-    {
-        grt_mlp.clear();
-        ml::clear();
-    }
-        
     void mlp::map(int argc, const t_atom *argv)
     {
-        const data_type data_type = get_data_type();
-
-        GRT::UINT numSamples = data_type == LABELLED_CLASSIFICATION ? classification_data.getNumSamples() : regression_data.getNumSamples();
-
-        if (numSamples == 0)
+        const uint32_t generation = get_active_generation();
+        compiled_mlp *active_mlp = static_cast<compiled_mlp *>(get_active_MLBase_instance());
+        
+        if (active_mlp == NULL || active_mlp->getTrained() == false)
         {
-            flext::error("no observations added, use 'add' to add training data");
+            flext::error("model has not been trained, use 'train' to train the model");
             return;
         }
-
-        if (grt_mlp.getTrained() == false)
+        
+        if (context.generation != generation)
         {
-            flext::error("model has not been trained, use 'train' to train the model");
-            return;
+            prepare_inference_context(*active_mlp, generation);
         }
         
-        GRT::UINT numInputNeurons = grt_mlp.getNumInputNeurons();
-        GRT::VectorDouble query(numInputNeurons);
+        GRT::VectorDouble &query = context.query;
+        GRT::UINT numInputNeurons = query.size();
         
         if (argc < 0 || (unsigned)argc != numInputNeurons)
         {
             flext::error("invalid input length, expected %d, got %d", numInputNeurons, argc);
+            return;
         }
 
         for (uint32_t index = 0; index < (uint32_t)argc; ++index)
@@ -612,7 +1756,7 @@ namespace ml
             query[index] = value;
         }
         
-        bool success = grt_mlp.predict(query);
+        bool success = active_mlp->predict_(query);
         
         if (success == false)
         {
@@ -620,60 +1764,120 @@ namespace ml
             return;
         }
         
+        std::vector<t_atom> &result = context.output;
+        
         // TODO: add probs to attributes
-        if (grt_mlp.getClassificationModeActive())
+        if (active_mlp->getClassificationModeActive())
         {
-            GRT::VectorDouble likelihoods = grt_mlp.getClassLikelihoods();
-            GRT::Vector<GRT::UINT> labels = classification_data.getClassLabels();
-            GRT::UINT classification = grt_mlp.getPredictedClassLabel();
+            const GRT::VectorDouble &likelihoods = active_mlp->get_class_likelihoods();
+            GRT::UINT classification = active_mlp->getPredictedClassLabel();
             
-            if (likelihoods.size() != labels.size())
+            if (likelihoods.size() * 2 != result.size())
             {
                 flext::error("labels / likelihoods size mismatch");
             }
             else
             {
-                AtomList probs;
-
-                for (unsigned count = 0; count < labels.size(); ++count)
+                for (unsigned count = 0; count < likelihoods.size(); ++count)
                 {
-                    t_atom label_a;
-                    t_atom likelihood_a;
-                    
-                    SetFloat(likelihood_a, static_cast<float>(likelihoods[count]));
-                    SetInt(label_a, labels[count]);
-                    
-                    probs.Append(label_a);
-                    probs.Append(likelihood_a);
+                    SetFloat(result[count * 2 + 1], static_cast<float>(likelihoods[count]));
                 }
-                ToOutAnything(1, get_s_probs(), probs);
+                ToOutAnything(1, get_s_probs(), (int)result.size(), result.data());
             }
                  
             ToOutInt(0, classification);
         }
-        else if (grt_mlp.getRegressionModeActive())
+        else if (active_mlp->getRegressionModeActive())
         {
-            GRT::VectorDouble regression_data = grt_mlp.getRegressionData();
+            const GRT::VectorDouble &regression_data = active_mlp->get_regression_data();
             GRT::VectorDouble::size_type numOutputDimensions = regression_data.size();
             
-            if (numOutputDimensions != grt_mlp.getNumOutputNeurons())
+            if (numOutputDimensions != result.size())
             {
                 flext::error("invalid output dimensions: %d", numOutputDimensions);
                 return;
             }
             
-            AtomList result;
-            
             for (uint32_t index = 0; index < numOutputDimensions; ++index)
             {
-                t_atom value_a;
                 double value = regression_data[index];
-                SetFloat(value_a, value);
-                result.Append(value_a);
+                SetFloat(result[index], value);
+            }
+            
+            ToOutList(0, (int)result.size(), result.data());
+        }
+    }
+    
+    void mlp::map_batch(int argc, const t_atom *argv)
+    {
+        const uint32_t generation = get_active_generation();
+        compiled_mlp *active_mlp = static_cast<compiled_mlp *>(get_active_MLBase_instance());
+        
+        if (active_mlp == NULL || active_mlp->getTrained() == false)
+        {
+            flext::error("model has not been trained, use 'train' to train the model");
+            return;
+        }
+        
+        if (context.generation != generation)
+        {
+            prepare_inference_context(*active_mlp, generation);
+        }
+        
+        const bool classification_mode = active_mlp->getClassificationModeActive();
+        GRT::UINT numInputNeurons = context.query.size();
+        GRT::UINT numOutputs = classification_mode ? 1 : active_mlp->getNumOutputNeurons();
+        GRT::UINT numRows = 0;
+        
+        if (!get_batch_num_rows(argc, argv, numInputNeurons, numRows))
+        {
+            return;
+        }
+        
+        GRT::VectorDouble &query = context.query;
+        std::vector<t_atom> &result = context.batch_output;
+        
+        result.resize(numRows * numOutputs);
+        
+        const t_atom *row = argv + 1;
+        
+        for (GRT::UINT rowIndex = 0; rowIndex < numRows; ++rowIndex, row += numInputNeurons)
+        {
+            for (GRT::UINT index = 0; index < numInputNeurons; ++index)
+            {
+                query[index] = GetAFloat(row[index]);
+            }
+            
+            if (!active_mlp->predict_(query))
+            {
+                flext::error("unable to map input %d", rowIndex);
+                return;
             }
             
-            ToOutList(0, result);
+            t_atom *output = &result[rowIndex * numOutputs];
+            
+            if (classification_mode)
+            {
+                SetInt(output[0], active_mlp->getPredictedClassLabel());
+            }
+            else
+            {
+                const GRT::VectorDouble &regression_data = active_mlp->get_regression_data();
+                
+                if (regression_data.size() != numOutputs)
+                {
+                    flext::error("invalid output dimensions: %d", regression_data.size());
+                    return;
+                }
+                
+                for (GRT::UINT index = 0; index < numOutputs; ++index)
+                {
+                    SetFloat(output[index], regression_data[index]);
+                }
+            }
         }
+        
+        ToOutList(0, (int)result.size(), result.data());
     }
     
     // Methods
@@ -695,6 +1899,34 @@ namespace ml
                       
     }
     
+    // error <restart> <epoch> <training error> <validation error> for every epoch while training, without the validation error when there is no validation set
+    void mlp::report_progress(background_job &job)
+    {
+        if (job.selector != get_s_train())
+        {
+            return;
+        }
+        
+        grt_mlp.take_epoch_errors(epoch_errors);
+        
+        for (std::vector<compiled_mlp::epoch_error>::const_iterator epoch = epoch_errors.begin(); epoch != epoch_errors.end(); ++epoch)
+        {
+            t_atom error_a[4];
+            int count = 3;
+            
+            SetInt(error_a[0], epoch->restart);
+            SetInt(error_a[1], epoch->epoch);
+            SetFloat(error_a[2], epoch->training_error);
+            
+            if (!std::isnan(epoch->validation_error))
+            {
+                SetFloat(error_a[count++], epoch->validation_error);
+            }
+            
+            ToOutAnything(0, get_s_error(), count, error_a);
+        }
+    }
+    
     // Implement pure virtual methods
     GRT::MLBase &mlp::get_MLBase_instance()
     {
@@ -706,40 +1938,98 @@ namespace ml
         return grt_mlp;
     }
     
-    bool mlp::read_specialised_dataset(std::string &path)
+    GRT::MLBase *mlp::copy_MLBase_instance(const GRT::MLBase &instance) const
+    {
+        compiled_mlp *copy = new compiled_mlp;
+        
+        if (!copy->deepCopyFrom(static_cast<const GRT::Regressifier *>(&instance)))
+        {
+            delete copy;
+            return NULL;
+        }
+        
+        return copy;
+    }
+    
+    bool mlp::set_MLBase_instance(const GRT::MLBase &instance)
+    {
+        return grt_mlp.deepCopyFrom(static_cast<const GRT::MLP *>(&instance));
+    }
+    
+    // NOTE: MLP is special since it supports both regression and classification, the network is therefore sized here before training
+    bool mlp::init_training_instance(GRT::MLBase &instance)
+    {
+        GRT::MLP &training_mlp = static_cast<GRT::MLP &>(instance);
+        
+        const data_type data_type = get_data_type();
+        
+        if (data_type == LABELLED_CLASSIFICATION)
+        {
+            if (grt_mlp.get_trains_flattened() && grt_mlp.getNullRejectionEnabled())
+            {
+                flext::error("null_rejection needs GRT's training, batch_size, patience, rate_schedule, rate_decay and parallel_restarts are ignored and no 'error' is output per epoch");
+            }
+            
+            return training_mlp.init(
+                                     classification_data.getNumDimensions(),
+                                     num_hidden_neurons,
+                                     classification_data.getNumClasses(),
+                                     input_activation_function,
+                                     hidden_activation_function,
+                                     output_activation_function
+                                     );
+        }
+        else if (data_type == LABELLED_REGRESSION)
+        {
+            return training_mlp.init(
+                                     regression_data.getNumInputDimensions(),
+                                     num_hidden_neurons,
+                                     regression_data.getNumTargetDimensions(),
+                                     input_activation_function,
+                                     hidden_activation_function,
+                                     output_activation_function
+                                     );
+        }
+        
+        flext::error("unable to train, invalid data type: %d", data_type);
+        
+        return false;
+    }
+    
+    bool mlp::read_specialised_dataset(std::string &path, background_job &job) const
     {
         bool success = false;
         
-        success = classification_data.loadDatasetFromFile(path);
+        success = job.classification_data.loadDatasetFromFile(path);
         
         if (success)
         {
-            set_data_type(LABELLED_CLASSIFICATION);
+            job.data_type_ = LABELLED_CLASSIFICATION;
             return success;
         }
         
-        success = regression_data.loadDatasetFromFile(path);
+        success = job.regression_data.loadDatasetFromFile(path);
         
         if (success)
         {
-            set_data_type(LABELLED_REGRESSION);
+            job.data_type_ = LABELLED_REGRESSION;
         }
         
         return success;
         
     }
     
-    bool mlp::write_specialised_dataset(std::string &path) const
+    bool mlp::write_specialised_dataset(std::string &path, const background_job &job) const
     {
-        const data_type data_type = get_data_type();
+        const data_type data_type = job.data_type_;
 
         if (data_type == LABELLED_CLASSIFICATION)
         {
-            return classification_data.saveDatasetToFile(path);
+            return job.classification_data.saveDatasetToFile(path);
         }
         else if (data_type == LABELLED_REGRESSION)
         {
-            return regression_data.saveDatasetToFile(path);
+            return job.regression_data.saveDatasetToFile(path);
         }
         
         flext::error("unable to write dataset, invalid data type: %d", data_type);
@@ -747,6 +2037,14 @@ namespace ml
         return false;
     }
         
+    // Training settings, these take effect at the next 'train', and 'error' only reads the staging model
+    bool mlp::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const training_settings[] = {"min_epochs", "max_epochs", "min_change", "training_rate", "momentum", "rand_training_iterations", "parallel_restarts", "use_validation_set", "validation_set_size", "randomize_training_order", "batch_size", "patience", "rate_schedule", "rate_decay", "rate_decay_epochs", "error", NULL};
+        
+        return !is_symbol_in(s, training_settings) && ml::changes_prediction(s);
+    }
+    
     typedef class mlp ml0x2emlp;
     
 #ifdef BUILD_AS_LIBRARY
@@ -66,47 +66,47 @@ namespace ml
         set_data_type(LABELLED_REGRESSION);
     }
     
-    void regression::train()
+    // GRT only returns the regression output by value, this reads it in place so that 'map' doesn't allocate
+    struct regressifier_access : GRT::Regressifier
     {
-        GRT::UINT numSamples = regression_data.getNumSamples();
-        GRT::Regressifier &regressifier = get_Regressifier_instance();
-        
-        if (numSamples == 0)
-        {
-            error("no observations added, use 'add' to add training data");
-            return;
-        }
-        
-        bool success = false;
-        success = regressifier.train(regression_data);
-        
-        if (!success)
+        static const GRT::VectorDouble &get_regression_data(const GRT::Regressifier &regressifier)
         {
-            error("training failed");
+            return regressifier.*(&regressifier_access::regressionData);
         }
-        
-        t_atom a_success;
-        
-        SetInt(a_success, success);
-        ToOutAnything(1, get_s_train(), 1, &a_success);
+    };
+    
+    void regression::prepare_inference_context(const GRT::Regressifier &regressifier, uint32_t generation)
+    {
+        context.query.resize(regressifier.getNumInputFeatures());
+        context.output.resize(regressifier.getNumOutputDimensions());
+        context.generation = generation;
     }
-
+    
     void regression::map(int argc, const t_atom *argv)
     {
-        GRT::Regressifier &regressifier = get_Regressifier_instance();
+        const uint32_t generation = get_active_generation();
+        GRT::Regressifier *active_regressifier = static_cast<GRT::Regressifier *>(get_active_MLBase_instance());
         
-        if (regressifier.getTrained() == false)
+        if (active_regressifier == NULL || active_regressifier->getTrained() == false)
         {
             error("model has not been trained, use 'train' to train the model");
             return;
         }
         
-        GRT::UINT numInputNeurons = regressifier.getNumInputFeatures();
-        GRT::VectorDouble query(numInputNeurons);
+        GRT::Regressifier &regressifier = *active_regressifier;
+        
+        if (context.generation != generation)
+        {
+            prepare_inference_context(regressifier, generation);
+        }
+        
+        GRT::VectorDouble &query = context.query;
+        GRT::UINT numInputNeurons = query.size();
         
         if (argc < 0 || (unsigned)argc != numInputNeurons)
         {
             error("invalid input length, expected " + std::to_string(numInputNeurons) + " got " + std::to_string(argc));
+            return;
         }
         
         for (uint32_t index = 0; index < (uint32_t)argc; ++index)
@@ -115,7 +115,7 @@ namespace ml
             query[index] = value;
         }
         
-        bool success = regressifier.predict(query);
+        bool success = regressifier.predict_(query);
         
         if (success == false)
         {
@@ -123,26 +123,82 @@ namespace ml
             return;
         }
         
-        GRT::VectorDouble regression_data = regressifier.getRegressionData();
+        const GRT::VectorDouble &regression_data = regressifier_access::get_regression_data(regressifier);
         GRT::VectorDouble::size_type numOutputDimensions = regression_data.size();
+        std::vector<t_atom> &result = context.output;
         
-        if (numOutputDimensions != regressifier.getNumOutputDimensions())
+        if (numOutputDimensions != result.size())
         {
             error("invalid output dimensions: " + std::to_string(numOutputDimensions));
             return;
         }
         
-        AtomList result;
-        
         for (uint32_t index = 0; index < numOutputDimensions; ++index)
         {
-            t_atom value_a;
             double value = regression_data[index];
-            SetFloat(value_a, value);
-            result.Append(value_a);
+            SetFloat(result[index], value);
         }
         
-        ToOutList(0, result);
+        ToOutList(0, (int)result.size(), result.data());
+    }
+    
+    void regression::map_batch(int argc, const t_atom *argv)
+    {
+        const uint32_t generation = get_active_generation();
+        GRT::Regressifier *active_regressifier = static_cast<GRT::Regressifier *>(get_active_MLBase_instance());
+        
+        if (active_regressifier == NULL || active_regressifier->getTrained() == false)
+        {
+            error("model has not been trained, use 'train' to train the model");
+            return;
+        }
+        
+        GRT::Regressifier &regressifier = *active_regressifier;
+        
+        if (context.generation != generation)
+        {
+            prepare_inference_context(regressifier, generation);
+        }
+        
+        GRT::VectorDouble &query = context.query;
+        GRT::UINT numInputNeurons = query.size();
+        GRT::UINT numOutputDimensions = context.output.size();
+        GRT::UINT numRows = 0;
+        
+        if (!get_batch_num_rows(argc, argv, numInputNeurons, numRows))
+        {
+            return;
+        }
+        
+        // Rows of numOutputDimensions values, only grows so repeated batches of the same size don't allocate
+        std::vector<t_atom> &result = context.batch_output;
+        result.resize(numRows * numOutputDimensions);
+        
+        const GRT::VectorDouble &regression_data = regressifier_access::get_regression_data(regressifier);
+        const t_atom *row = argv + 1;
+        
+        for (GRT::UINT rowIndex = 0; rowIndex < numRows; ++rowIndex, row += numInputNeurons)
+        {
+            for (GRT::UINT index = 0; index < numInputNeurons; ++index)
+            {
+                query[index] = GetAFloat(row[index]);
+            }
+            
+            if (!regressifier.predict_(query) || regression_data.size() != numOutputDimensions)
+            {
+                error("unable to map input " + std::to_string(rowIndex));
+                return;
+            }
+            
+            t_atom *output = &result[rowIndex * numOutputDimensions];
+            
+            for (GRT::UINT index = 0; index < numOutputDimensions; ++index)
+            {
+                SetFloat(output[index], regression_data[index]);
+            }
+        }
+        
+        ToOutList(0, (int)result.size(), result.data());
     }
     
     // pure virtual method implementation
@@ -156,13 +212,103 @@ namespace ml
         return get_Regressifier_instance();
     }
     
-    bool regression::read_specialised_dataset(std::string &path)
+    GRT::MLBase *regression::copy_MLBase_instance(const GRT::MLBase &instance) const
     {
-        return regression_data.loadDatasetFromFile(path);
+        return static_cast<const GRT::Regressifier &>(instance).deepCopyRegressifier();
     }
     
-    bool regression::write_specialised_dataset(std::string &path) const
+    bool regression::set_MLBase_instance(const GRT::MLBase &instance)
     {
-        return regression_data.saveDatasetToFile(path);
+        return get_Regressifier_instance().deepCopyFrom(static_cast<const GRT::Regressifier *>(&instance));
+    }
+    
+    // Training settings, these take effect at the next 'train'
+    bool regression::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const training_settings[] = {"max_iterations", "min_change", "training_rate", NULL};
+        
+        return !is_symbol_in(s, training_settings) && ml::changes_prediction(s);
+    }
+    
+    bool regression::read_specialised_dataset(std::string &path, background_job &job) const
+    {
+        return job.regression_data.loadDatasetFromFile(path);
+    }
+    
+    bool regression::write_specialised_dataset(std::string &path, const background_job &job) const
+    {
+        return job.regression_data.saveDatasetToFile(path);
+    }
+    
+    online_regression::online_regression()
+    : online(false), keep_samples(false)
+    {
+    }
+    
+    // Flext attribute setters
+    void online_regression::set_online(bool online)
+    {
+        this->online = online;
+    }
+    
+    void online_regression::set_keep_samples(bool keep_samples)
+    {
+        this->keep_samples = keep_samples;
+    }
+    
+    // Flext attribute getters
+    void online_regression::get_online(bool &online) const
+    {
+        online = this->online;
+    }
+    
+    void online_regression::get_keep_samples(bool &keep_samples) const
+    {
+        keep_samples = this->keep_samples;
+    }
+    
+    // These only change what 'add' does
+    bool online_regression::changes_prediction(const t_symbol *s) const
+    {
+        static const char *const object_settings[] = {"online", "keep_samples", NULL};
+        
+        return !is_symbol_in(s, object_settings) && regression::changes_prediction(s);
+    }
+    
+    // Methods
+    void online_regression::add(int argc, const t_atom *argv)
+    {
+        const GRT::UINT numSamples = regression_data.getNumSamples();
+        
+        regression::add(argc, argv);
+        
+        if (!online || regression_data.getNumSamples() != numSamples + 1)
+        {
+            return;
+        }
+        
+        // A 'train' in progress will replace the staging model with one trained on the dataset, so the sample stays there
+        if (get_staging_busy())
+        {
+            post("sample added to the dataset only, send 'train' to add it to the model");
+            return;
+        }
+        
+        const GRT::RegressionSample &sample = regression_data[numSamples];
+        GRT::Regressifier &regressifier = get_Regressifier_instance();
+        
+        if (!update_online(regressifier, sample.getInputVector(), sample.getTargetVector()))
+        {
+            error("unable to update the model, online learning needs 1 output and the number of inputs the model was trained with, the sample was added to the dataset only");
+            return;
+        }
+        
+        // 'map' may be reading the active model, the model is small enough to publish a copy per sample
+        publish_MLBase_instance();
+        
+        if (!keep_samples)
+        {
+            regression_data.removeLastSample();
+        }
     }
 }
@@ -11,6 +11,8 @@
 
 #include "ml_ml.h"
 
+#include <cmath>
+
 namespace ml
 {
     class regression : public ml
@@ -33,8 +35,8 @@ namespace ml
             FLEXT_CADDATTR_GET(c, "training_rate", get_training_rate);
         }
         
-        void train();
         void map(int argc, const t_atom *argv);
+        void map_batch(int argc, const t_atom *argv);
         
         // Flext attribute setters
         void set_max_iterations(int max_iterations);
@@ -53,16 +55,144 @@ namespace ml
         virtual GRT::Regressifier &get_Regressifier_instance() = 0;
         virtual const GRT::Regressifier &get_Regressifier_instance() const = 0;
         
-        bool read_specialised_dataset(std::string &path);
-        bool write_specialised_dataset(std::string &path) const;
-
+        bool read_specialised_dataset(std::string &path, background_job &job) const;
+        bool write_specialised_dataset(std::string &path, const background_job &job) const;
+        
+        GRT::MLBase *copy_MLBase_instance(const GRT::MLBase &instance) const;
+        bool set_MLBase_instance(const GRT::MLBase &instance);
+        bool changes_prediction(const t_symbol *s) const;
         
     private:
+        void prepare_inference_context(const GRT::Regressifier &regressifier, uint32_t generation);
+        
         // Flext attribute wrappers
         FLEXT_CALLVAR_I(get_max_iterations, set_max_iterations);
         FLEXT_CALLVAR_F(get_min_change, set_min_change);
         FLEXT_CALLVAR_F(get_training_rate, set_training_rate);
         
+        inference_context context;
+    };
+    
+    // GRT's linear and logistic regression train by stochastic gradient descent on inputs and a target scaled to [0, 1],
+    // update() takes one more step of it for a single sample
+    template <class T, bool logistic>
+    class online_regressifier : public T
+    {
+    public:
+        // An untrained model starts from zero weights, with [0, 1] scaling ranges that leave the values as they are until 'train' learns real ones
+        bool update(const GRT::VectorDouble &input, const GRT::VectorDouble &target)
+        {
+            if (!this->trained)
+            {
+                init(input.size());
+            }
+            
+            const GRT::UINT num_inputs = this->numInputDimensions;
+            
+            if (
+                input.size() != num_inputs || target.size() != 1 || this->w.size() != num_inputs ||
+                (this->useScaling && (this->inputVectorRanges.size() != num_inputs || this->targetVectorRanges.size() != 1))
+                )
+            {
+                return false;
+            }
+            
+            const double rate = this->getLearningRate();
+            double estimate = this->w0;
+            
+            for (GRT::UINT index = 0; index < num_inputs; ++index)
+            {
+                estimate += get_input(input, index) * this->w[index];
+            }
+            
+            if (logistic)
+            {
+                estimate = 1.0 / (1.0 + std::exp(-estimate));
+            }
+            
+            const double error = (this->useScaling ? scale_value(target[0], this->targetVectorRanges[0]) : target[0]) - estimate;
+            
+            for (GRT::UINT index = 0; index < num_inputs; ++index)
+            {
+                this->w[index] += rate * error * get_input(input, index);
+            }
+            this->w0 += rate * error;
+            
+            return true;
+        }
+        
+    private:
+        void init(GRT::UINT num_inputs)
+        {
+            GRT::MinMax unit;
+            
+            unit.minValue = 0;
+            unit.maxValue = 1;
+            
+            this->numInputDimensions = num_inputs;
+            this->numOutputDimensions = 1;
+            this->w0 = 0;
+            this->w.assign(num_inputs, 0);
+            this->inputVectorRanges.assign(num_inputs, unit);
+            this->targetVectorRanges.assign(1, unit);
+            this->regressionData.assign(1, 0);
+            this->trained = true;
+        }
+        
+        double get_input(const GRT::VectorDouble &input, GRT::UINT index) const
+        {
+            return this->useScaling ? scale_value(input[index], this->inputVectorRanges[index]) : input[index];
+        }
+        
+        // As GRT scales to [0, 1], a constant maps to 0
+        static double scale_value(double value, const GRT::MinMax &range)
+        {
+            return range.minValue == range.maxValue ? 0 : (value - range.minValue) / (range.maxValue - range.minValue);
+        }
+    };
+    
+    // Regressors whose model can also learn one sample at a time: with 'online' on, each 'add' is a gradient step on the staging
+    // model, which is then published, and the sample is only kept in the dataset with 'keep_samples'
+    class online_regression : public regression
+    {
+        FLEXT_HEADER_S(online_regression, regression, setup);
+        
+    public:
+        online_regression();
+        
+    protected:
+        static void setup(t_classid c)
+        {
+            // Flext attribute wrappers
+            FLEXT_CADDATTR_SET(c, "online", set_online);
+            FLEXT_CADDATTR_SET(c, "keep_samples", set_keep_samples);
+            
+            FLEXT_CADDATTR_GET(c, "online", get_online);
+            FLEXT_CADDATTR_GET(c, "keep_samples", get_keep_samples);
+        }
+        
+        void add(int argc, const t_atom *argv);
+        
+        // Flext attribute setters
+        void set_online(bool online);
+        void set_keep_samples(bool keep_samples);
+        
+        // Flext attribute getters
+        void get_online(bool &online) const;
+        void get_keep_samples(bool &keep_samples) const;
+        
+        // One gradient step on instance, false if the sample doesn't fit the model
+        virtual bool update_online(GRT::Regressifier &instance, const GRT::VectorDouble &input, const GRT::VectorDouble &target) = 0;
+        
+        bool changes_prediction(const t_symbol *s) const;
+        
+    private:
+        // Flext attribute wrappers
+        FLEXT_CALLVAR_B(get_online, set_online);
+        FLEXT_CALLVAR_B(get_keep_samples, set_keep_samples);
+        
+        bool online;
+        bool keep_samples;
     };
 }
 